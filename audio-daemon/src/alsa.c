@@ -42,9 +42,15 @@
 #include <time.h>
 #include <speex/speex_echo.h>
 #include <speex/speex_preprocess.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "audio-daemon.h"
 #include "mb.h"
+#include "mix.h"
+#include "resample.h"
+#include "ring.h"
 
 int period_size;
 static snd_output_t *output = NULL;
@@ -54,10 +60,82 @@ static char *device = "asym0";
 static int do_playback_work(struct alsa_stream *as);
 static int do_capture_work(struct alsa_stream *as);
 
-int playback_is_running = 0;
-int capture_is_running = 0;
-SpeexEchoState *echo_state;
-SpeexPreprocessState *preprocess_state;
+/*
+ * There is only one sound card, so every connected guest shares a single
+ * pair of PCM handles. A realtime audio thread waits for each capture
+ * period and drives both directions: it hands the captured period to each
+ * guest that is recording, and mixes one period from each guest that is
+ * playing into a single write.
+ *
+ * The event loop never touches stream state directly: when a guest kicks
+ * its event channel the audio thread is woken, and it is the one that
+ * consumes commands from the guest's cmd_ring. The backend table itself
+ * only changes on connect/disconnect.
+ *
+ * The audio thread takes no lock the event loop could be holding. The
+ * event loop owns backends[]; the audio thread copies it into rt_backends[]
+ * at the start of every pass and works from the copy, with audio_seq odd
+ * until the pass is done. A backend taken out of the table is only freed
+ * once the pass that may still have it is over, see wait_audio_pass(), and
+ * audio_seq doubles as a seqlock for the stats, see alsa_publish_stats().
+ */
+#define MAX_BACKENDS 8
+#define AUDIO_THREAD_PRIORITY 50
+
+static struct xen_vsnd_backend *backends[MAX_BACKENDS];
+static struct xen_vsnd_backend *rt_backends[MAX_BACKENDS];
+static int n_backends = 0;
+static unsigned int audio_seq = 0;
+static snd_pcm_t *p_handle = NULL;
+static snd_pcm_t *c_handle = NULL;
+
+/* Set when the PCM's ring is mapped rather than read and written */
+static int p_mmap = 0;
+static int c_mmap = 0;
+
+/* What the card actually runs at, shared by every guest */
+static unsigned int hw_rate = 0;
+static int hw_period = 0;
+static int hw_period_us = 0;
+
+/* The period the card was last opened for, it may have granted a longer one */
+static int req_period_us = 0;
+
+/* alsa_publish_stats() waits up to this many times 100us for a copy */
+#define STATS_TRIES 100
+
+/*
+ * Card wide counters; per stream ones live in each alsa_stream. Only the
+ * audio thread writes either, alsa_publish_stats() takes a snapshot.
+ */
+static const uint32_t period_us_buckets[STATS_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2000, 5000
+};
+
+static struct device_stats {
+    uint64_t periods;
+    uint64_t xruns;
+    uint64_t recovery_us;
+    uint32_t last_recovery_us;
+    uint32_t period_us_max;
+    uint64_t period_us_hist[STATS_BUCKETS];
+} dev_stats;
+
+static uint64_t recovering_since = 0;
+
+static pthread_t audio_thread_id;
+static int audio_thread_stop = 0;
+static int audio_thread_running = 0;
+static int wake_fd[2] = { -1, -1 };
+
+/*
+ * One echo canceller for the card, since every guest hears the same
+ * speakers. It only exists while some capturing guest has "echo-cancel"
+ * set; the preprocessor (AGC, denoise, echo suppression) is per guest.
+ * Both work on aec_frame mono frames, which divides hw_period.
+ */
+static SpeexEchoState *echo_state;
+static int aec_frame;
 
 void refresh_be_info(struct alsa_stream *as, int hw_ptr, int delay,
 		     uint64_t s_time, int status)
@@ -81,10 +159,10 @@ void alsa_refresh_be_playback_info(struct alsa_stream *as, int periods)
     time_nsec = get_nsec_now();
 
     pointer = as->hw_ptr/4;
-    pointer -= (1024 * periods);
+    pointer -= (as->period_frames * periods);
     if (pointer < 0)
-	pointer += (N_AUD_BUFFER_PAGES * 1024);
-    pointer %= (N_AUD_BUFFER_PAGES * 1024);
+	pointer += RING_FRAMES;
+    pointer %= RING_FRAMES;
 
     refresh_be_info(as, pointer, 0, time_nsec, STREAM_STARTED);
 }
@@ -98,62 +176,74 @@ void alsa_refresh_be_capture_info(struct alsa_stream *as)
     refresh_be_info(as, as->hw_ptr/4, 0, time_nsec, STREAM_STARTED);
 }
 
-static void get_data_from_sg(int16_t *dst, int size, struct alsa_stream *as)
+/*
+ * The guest's ring is N_AUD_BUFFER_PAGES separately mapped pages, so copy
+ * in page sized chunks and only deal with the page boundary and the ring
+ * wrap at the end of each chunk. hw_ptr and size are in bytes and always
+ * whole frames, so a chunk never splits a stereo pair.
+ */
+static void get_data_from_sg(int16_t *dst, int size, struct alsa_stream *as,
+			     int gain_l, int gain_r)
 {
-    int16_t *src;
-    int val, vol;
+    int offset, chunk;
 
-    val = 100; //as->vol_l;
-    if (val < 1)
-	val = 1;
+    while (size > 0) {
+	offset = as->hw_ptr % XENVSND_PAGE_SIZE;
+	chunk = XENVSND_PAGE_SIZE - offset;
+	if (chunk > size)
+	    chunk = size;
 
-    size = size / 2;
-   
-    while (size--) {
-	src = as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + as->hw_ptr % XENVSND_PAGE_SIZE;
-	*dst++ = (*src) * val / 100;
+	mix_gain(dst, as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + offset,
+		 chunk / 2, gain_l, gain_r);
 
-	as->processed += 2;
-	as->hw_ptr += 2;
+	dst += chunk / 2;
+	size -= chunk;
+	as->processed += chunk;
+	as->hw_ptr += chunk;
 	if (as->hw_ptr == XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES) {
 	    as->hw_ptr = 0;
 	}
     }
-    return;   
 }
 
-static void put_data_to_sg(int16_t *dst, int size, struct alsa_stream *as)
+static void put_data_to_sg(const int16_t *src, int size, struct alsa_stream *as,
+			   int gain_l, int gain_r)
 {
-    int16_t *src;
-    int val, vol;
-
-    val = 100; //as->vol_l;
-    if (val < 1)
-	val = 1;
+    int offset, chunk;
 
-    size = size / 2;
+    while (size > 0) {
+	offset = as->hw_ptr % XENVSND_PAGE_SIZE;
+	chunk = XENVSND_PAGE_SIZE - offset;
+	if (chunk > size)
+	    chunk = size;
 
-    while (size--) {
-	src = as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + as->hw_ptr % XENVSND_PAGE_SIZE;
-	*src = (*dst++) * val / 100;
+	mix_gain(as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + offset, src,
+		 chunk / 2, gain_l, gain_r);
 
-	as->processed += 2;
-	as->hw_ptr += 2;
+	src += chunk / 2;
+	size -= chunk;
+	as->processed += chunk;
+	as->hw_ptr += chunk;
 	if (as->hw_ptr == XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES) {
 	    as->hw_ptr = 0;
 	}
     }
-    return;    
 }
 
+/*
+ * Asks for *rate and a period of period_us, and settles for whatever is
+ * nearest: guests that run at another rate go through a resampler, so a
+ * card that only does 48kHz is fine. The result is passed back.
+ */
 static int set_hwparams(snd_pcm_t *handle,
 			snd_pcm_hw_params_t *params,
 			snd_pcm_access_t access,
-			int period_frames,
-			int buffer_frames)
+			unsigned int *rate,
+			int period_us,
+			snd_pcm_uframes_t *period_frames)
 {
     unsigned int rrate;
-    snd_pcm_uframes_t size;
+    snd_pcm_uframes_t size, period;
     int err, dir;
 
     /* choose all parameters */
@@ -187,42 +277,52 @@ static int set_hwparams(snd_pcm_t *handle,
 	return err;
     }
     /* set the stream rate */
-    rrate = SAMPLE_RATE;
+    rrate = *rate;
     err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
     if (err < 0) {
-	printf("Rate %iHz not available for playback: %s\n", SAMPLE_RATE, snd_strerror(err));
+	printf("Rate %iHz not available for playback: %s\n", *rate, snd_strerror(err));
 	return err;
     }
-    if (rrate != SAMPLE_RATE) {
-	printf("Rate doesn't match (requested %iHz, get %iHz)\n", SAMPLE_RATE, err);
+    if (rrate < MIN_SAMPLE_RATE || rrate > MAX_SAMPLE_RATE) {
+	printf("Rate %iHz out of range (requested %iHz)\n", rrate, *rate);
 	return -EINVAL;
     }
-    err = snd_pcm_hw_params_set_buffer_size(handle, params, buffer_frames);
-    if (err < 0) {
-	printf("Unable to set buffer time %i for playback: %s\n", 2048, snd_strerror(err));
-	return err;
-    }
-    err = snd_pcm_hw_params_get_buffer_size(params, &size);
+    if (rrate != *rate)
+	printf("Rate doesn't match (requested %iHz, get %iHz), resampling\n", *rate, rrate);
+    period = (uint64_t)period_us * rrate / 1000000;
+    if (period < MIN_PERIOD_FRAMES)
+	period = MIN_PERIOD_FRAMES;
+    if (period > MAX_PERIOD_FRAMES)
+	period = MAX_PERIOD_FRAMES;
+    dir = 0;
+    err = snd_pcm_hw_params_set_period_size_near(handle, params, &period, &dir);
     if (err < 0) {
-	printf("Unable to get buffer size for playback: %s\n", snd_strerror(err));
+	printf("Unable to set period size %i for playback: %s\n", (int)period, snd_strerror(err));
 	return err;
     }
-    err = snd_pcm_hw_params_set_period_size(handle, params, period_frames, 0);
+    size = period * DEVICE_PERIODS;
+    err = snd_pcm_hw_params_set_buffer_size_near(handle, params, &size);
     if (err < 0) {
-	printf("Unable to set period time %i for playback: %s\n", period_frames, snd_strerror(err));
+	printf("Unable to set buffer size %i for playback: %s\n", (int)size, snd_strerror(err));
 	return err;
     }
-    err = snd_pcm_hw_params_get_period_size(params, &size, &dir);
+    err = snd_pcm_hw_params_get_period_size(params, &period, &dir);
     if (err < 0) {
 	printf("Unable to get period size for playback: %s\n", snd_strerror(err));
 	return err;
     }
+    if (period > MAX_PERIOD_FRAMES) {
+	printf("Period size %i too large\n", (int)period);
+	return -EINVAL;
+    }
     /* write the parameters to device */
     err = snd_pcm_hw_params(handle, params);
     if (err < 0) {
 	printf("Unable to set hw params for playback: %s\n", snd_strerror(err));
 	return err;
     }
+    *rate = rrate;
+    *period_frames = period;
     return 0;
 }
 
@@ -285,10 +385,8 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
 
 static int alsa_prepare(struct alsa_stream *as)
 {
-    pthread_mutex_lock(&as->mutex);   
-    snd_pcm_prepare(as->handle);
     as->hw_ptr = as->processed = as->processed_periods = 0;
-    pthread_mutex_unlock(&as->mutex);   
+    as->running = 0;
     return 0;
 }
 
@@ -306,309 +404,1315 @@ int alsa_get_live_frames(struct alsa_stream *as)
     return pv_avail;
 }
 
-char null_buffer[4096] = {0};
-char prev_buf_1[4096] = {0};
-char prev_buf_2[4096] = {0};
-char mono_input[4096] = {0};
+int16_t null_buffer[MAX_PERIOD_FRAMES * 2] = {0};
+
+/* Mono copies of what was played one and two card periods ago */
+static int16_t prev_buf_1[MAX_PERIOD_FRAMES];
+static int16_t prev_buf_2[MAX_PERIOD_FRAMES];
+
+static uint64_t mono_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-static void fill_averege(int16_t *src, int16_t *dst)
+/* Charges an xrun to the card and to the running streams it hit. */
+static void count_xrun(int playback, int capture)
 {
+    struct xen_vsnd_backend *xvb;
     int i;
-    for (i=0; i<2048; i+=2) {
-	dst[i/2] = (src[i] + src[i+1])/2;
+
+    dev_stats.xruns++;
+    if (!recovering_since)
+	recovering_since = mono_nsec();
+
+    for (i = 0; i < MAX_BACKENDS; i++) {
+	if (!(xvb = rt_backends[i]))
+	    continue;
+	if (playback && xvb->p.running)
+	    xvb->p.stats.xruns++;
+	if (capture && xvb->c.running)
+	    xvb->c.stats.xruns++;
     }
 }
 
-static void double_mono(int16_t *src, int16_t *dst)
+/* Audio is flowing again: account for how long the card was out. */
+static void count_recovered(void)
+{
+    uint64_t us;
+
+    if (!recovering_since)
+	return;
+    us = (mono_nsec() - recovering_since) / 1000;
+    dev_stats.recovery_us += us;
+    dev_stats.last_recovery_us = us;
+    recovering_since = 0;
+}
+
+static void count_period_time(uint64_t ns)
+{
+    uint32_t us = ns / 1000;
+    int b;
+
+    dev_stats.periods++;
+    if (us > dev_stats.period_us_max)
+	dev_stats.period_us_max = us;
+    for (b = 0; b < STATS_BUCKETS - 1; b++)
+	if (us < period_us_buckets[b])
+	    break;
+    dev_stats.period_us_hist[b]++;
+}
+
+static void count_latency(struct alsa_stream *as, uint64_t ns)
+{
+    as->stats.latency_us = ns / 1000;
+    if (as->stats.latency_us > as->stats.latency_max_us)
+	as->stats.latency_max_us = as->stats.latency_us;
+}
+
+/* Playback wants a few periods of silence queued whenever it (re)starts */
+static int p_primed = 0;
+
+static void recover_playback(void)
+{
+    count_xrun(1, 0);
+
+    snd_pcm_drop(p_handle);
+    snd_pcm_resume(p_handle);
+    snd_pcm_prepare(p_handle);
+    p_primed = 0;
+}
+
+static void recover_capture(void)
+{
+    count_xrun(0, 1);
+
+    snd_pcm_drop(c_handle);
+    snd_pcm_resume(c_handle);
+    snd_pcm_prepare(c_handle);
+    snd_pcm_start(c_handle);
+}
+
+/* Linked streams go down and come back up together. */
+static void alsa_repare(void)
+{
+    count_xrun(1, 1);
+
+    snd_pcm_drop(p_handle);
+    snd_pcm_drop(c_handle);
+    snd_pcm_resume(p_handle);
+    snd_pcm_resume(c_handle);
+    snd_pcm_prepare(p_handle);
+    snd_pcm_prepare(c_handle);
+    p_primed = 0;
+    snd_pcm_start(c_handle);
+}
+
+/*
+ * Everything below runs once per hw_period frames of the card. A guest
+ * running at another rate has its own resampler, so per card period it
+ * may consume or produce a few frames more or less than hw_period; its
+ * period interrupt is raised whenever a whole guest period has gone by.
+ *
+ * The buffers here hold what the card itself plays and records. Anything
+ * that differs between guests lives in their alsa_stream.
+ */
+static int16_t orig_input[MAX_PERIOD_FRAMES * 2];
+static int16_t mono_input[MAX_PERIOD_FRAMES];
+static int16_t clean_input[MAX_PERIOD_FRAMES];
+static int16_t output_frame[MAX_PERIOD_FRAMES * 2];
+static int16_t resampled[MAX_PERIOD_FRAMES * 2];
+static int32_t mix_frame[MAX_PERIOD_FRAMES * 2];
+
+static int guest_period_elapsed(struct alsa_stream *as, int frames)
+{
+    as->period_pos += frames;
+    if (as->period_pos < as->period_frames)
+	return 0;
+    as->period_pos %= as->period_frames;
+    return 1;
+}
+
+/*
+ * Speex costs grow with its frame size, and a card period can be far
+ * longer than the 10ms or so it is tuned for. Halve the period for as
+ * long as it stays whole and above 10ms worth of frames.
+ */
+static int aec_frame_size(int period, int rate)
+{
+    while (!(period & 1) && period > rate / 100)
+	period /= 2;
+    return period;
+}
+
+static SpeexEchoState *get_echo_state(void)
+{
+    spx_int32_t rate = hw_rate;
+
+    if (echo_state)
+	return echo_state;
+
+    echo_state = speex_echo_state_init(aec_frame, 8192);
+    if (!echo_state) {
+	printf("Unable to create echo canceller\n");
+	return NULL;
+    }
+    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    return echo_state;
+}
+
+static SpeexPreprocessState *get_preprocess(struct alsa_stream *as)
+{
+    SpeexPreprocessState *pp;
+    spx_int32_t tmp;
+
+    if (as->preprocess)
+	return as->preprocess;
+
+    pp = speex_preprocess_state_init(aec_frame, hw_rate);
+    if (!pp) {
+	printf("Unable to create preprocessor\n");
+	return NULL;
+    }
+
+    tmp = 1;
+    speex_preprocess_ctl(pp, SPEEX_PREPROCESS_SET_AGC, &tmp);
+
+    tmp = as->denoise;
+    speex_preprocess_ctl(pp, SPEEX_PREPROCESS_SET_DENOISE, &tmp);
+
+    if (as->aec) {
+	tmp = -60;
+	speex_preprocess_ctl(pp, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &tmp);
+	tmp = -60;
+	speex_preprocess_ctl(pp, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS_ACTIVE, &tmp);
+	speex_preprocess_ctl(pp, SPEEX_PREPROCESS_SET_ECHO_STATE, echo_state);
+    }
+
+    as->preprocess = pp;
+    return pp;
+}
+
+static void drop_preprocess(struct alsa_stream *as)
+{
+    if (as->preprocess)
+	speex_preprocess_state_destroy(as->preprocess);
+    as->preprocess = NULL;
+}
+
+/* Runs the echo canceller over one card period of mono_input. */
+static int cancel_echo(int frames)
 {
     int i;
-    for (i=0; i<2048; i+=2) {
-	dst[i] = dst[i+1] = src[i/2];
+
+    if (!get_echo_state())
+	return -1;
+    for (i = 0; i + aec_frame <= frames; i += aec_frame) {
+	speex_echo_playback(echo_state, prev_buf_2 + i);
+	speex_echo_capture(echo_state, mono_input + i, clean_input + i);
     }
+    return 0;
 }
 
-int number = 0;
-static void alsa_repare(struct xen_vsnd_backend *xvb)
+/*
+ * What a guest gets from the mic: the echo cancelled or plain mono signal
+ * through its own preprocessor. Returns NULL if the guest wants no
+ * processing or it can't be set up, the card input is used as it is then.
+ */
+static int16_t *capture_frames(struct alsa_stream *as, int frames,
+			       int downmixed, int cancelled)
 {
-    snd_pcm_drop(xvb->p.handle);
-    snd_pcm_drop(xvb->c.handle);
-    snd_pcm_resume(xvb->p.handle);
-    snd_pcm_resume(xvb->c.handle);
-    snd_pcm_prepare(xvb->p.handle);
-    snd_pcm_prepare(xvb->c.handle);
-    number = 0;
-    snd_pcm_start(xvb->c.handle);
+    SpeexPreprocessState *pp;
+    int i;
+
+    if (!as->aec && !as->denoise)
+	return NULL;
+    if (as->aec && !cancelled)
+	return NULL;
+    if (!downmixed || !as->mono || !(pp = get_preprocess(as)))
+	return NULL;
+
+    memcpy(as->mono, as->aec ? clean_input : mono_input, frames * 2);
+    for (i = 0; i + aec_frame <= frames; i += aec_frame)
+	speex_preprocess_run(pp, as->mono + i);
+    mix_upmix(as->processed_input, as->mono, frames);
+    return as->processed_input;
 }
 
-static void capture_callback(snd_async_handler_t *ahandler)
+/*
+ * The echo canceller needs the speakers and the mic lined up period for
+ * period, so while any capturing guest uses it playback is written right
+ * after each captured period, like one clock. Otherwise the two run off
+ * their own PCMs and a stalled mic does not hold up the speakers.
+ */
+static int aec_in_use(void)
 {
-    struct xen_vsnd_backend *xvb = snd_async_handler_get_callback_private(ahandler);
-    char orig_input[4096];
-    char clean_input[4096];
-    char output_frame[4096];
-    int generate_period = 0;
+    int i;
+
+    if (!c_handle)
+	return 0;
+    for (i = 0; i < MAX_BACKENDS; i++)
+	if (rt_backends[i] && rt_backends[i]->c.running && rt_backends[i]->c.aec)
+	    return 1;
+    return 0;
+}
+
+/*
+ * Hands one card period of input to every capturing guest. delay is what
+ * was still waiting in the card; raw input skips all mic processing.
+ */
+static void deliver_capture(int16_t *input, int read, int delay, int raw,
+			    int *generate_period)
+{
+    struct xen_vsnd_backend *xvb;
     struct alsa_stream *as;
-    int read, written;
-    int avail;
+    int16_t *frames;
+    int downmixed = 0;
+    int cancelled = 0;
+    int n, i;
+
+    for (i = 0; i < MAX_BACKENDS; i++) {
+	if (!(xvb = rt_backends[i]))
+	    continue;
+	as = &xvb->c;
+	if (as->running > 1) {
+	    frames = NULL;
+	    if (!raw) {
+		/* Downmix and echo cancellation run once for every guest */
+		if ((as->aec || as->denoise) && !downmixed) {
+		    mix_downmix(mono_input, input, read);
+		    downmixed = 1;
+		}
+		if (as->aec && !cancelled && cancel_echo(read) == 0)
+		    cancelled = 1;
+		frames = capture_frames(as, read, downmixed, cancelled);
+	    }
+	    if (!frames)
+		frames = input;
+
+	    n = read;
+	    if (as->rs) {
+		n = resample(as->rs, frames, read, as->frame, as->max_frames);
+		frames = as->frame;
+	    }
+
+	    put_data_to_sg(frames, n * 4, as,
+			   MIX_VOLUME_TO_GAIN(as->vol_l),
+			   MIX_VOLUME_TO_GAIN(as->vol_r));
+	    /* mic to guest: what was still waiting in the card */
+	    count_latency(as, (uint64_t)delay * 1000000000ULL / hw_rate);
+
+	    if (guest_period_elapsed(as, n)) {
+		alsa_refresh_be_capture_info(as);
+		as->stats.periods++;
+		generate_period[i] = 1;
+	    }
+	} else if (as->running == 1){
+	    as->running = 2;
+	    /* nothing else to do */
+	}
+    }
+}
 
-    if (number == 0) {
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	number = 1;
+static void *mmap_addr(const snd_pcm_channel_area_t *areas,
+		       snd_pcm_uframes_t offset)
+{
+    return (char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+}
+
+/*
+ * How long to wait on the card for room or data: a couple of periods. A
+ * card that has nothing by then is stuck, and gets restarted.
+ */
+static int period_wait_ms(void)
+{
+    return hw_period_us * 2 / 1000 + 1;
+}
+
+/*
+ * Copies frames between buf and the mapped ring, a contiguous piece at a
+ * time. Only needed when a period wraps around the end of the ring.
+ */
+static int mmap_copy(snd_pcm_t *handle, int16_t *buf, int frames, int to_card)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, n;
+    snd_pcm_sframes_t done;
+    int err;
+
+    while (frames > 0) {
+	n = frames;
+	if ((err = snd_pcm_mmap_begin(handle, &areas, &offset, &n)) < 0)
+	    return err;
+	if (n == 0) {
+	    if ((err = snd_pcm_wait(handle, period_wait_ms())) < 0)
+		return err;
+	    if (err == 0)
+		return -EPIPE;
+	    continue;
+	}
+	if (to_card)
+	    memcpy(mmap_addr(areas, offset), buf, n * 4);
+	else
+	    memcpy(buf, mmap_addr(areas, offset), n * 4);
+	done = snd_pcm_mmap_commit(handle, offset, n);
+	if (done < 0)
+	    return done;
+	if ((snd_pcm_uframes_t)done != n)
+	    return -EPIPE;
+	buf += n * 2;
+	frames -= n;
     }
+    return 0;
+}
+
+/*
+ * Maps the next hw_period frames of the ring. Returns NULL if they are not
+ * contiguous, *offset is only good for snd_pcm_mmap_commit() otherwise.
+ */
+static int16_t *mmap_period(snd_pcm_t *handle, snd_pcm_uframes_t *offset,
+			    int *err)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t frames = hw_period;
+
+    *err = snd_pcm_mmap_begin(handle, &areas, offset, &frames);
+    if (*err < 0 || frames < hw_period)
+	return NULL;
+    return mmap_addr(areas, *offset);
+}
+
+static int mmap_commit_period(snd_pcm_t *handle, snd_pcm_uframes_t offset)
+{
+    snd_pcm_sframes_t done;
+
+    done = snd_pcm_mmap_commit(handle, offset, hw_period);
+    if (done < 0)
+	return done;
+    return done == hw_period ? 0 : -EPIPE;
+}
+
+/* Writes a staged period, however the ring is accessed. */
+static int write_period(int16_t *buf)
+{
+    int err;
+
+    if (!p_mmap)
+	return snd_pcm_writei(p_handle, buf, hw_period);
+    if ((err = mmap_copy(p_handle, buf, hw_period, 1)) < 0)
+	return err;
+    return hw_period;
+}
+
+/* Mapped playback does not start itself on the first commit. */
+static void start_playback(void)
+{
+    if (p_mmap && snd_pcm_state(p_handle) == SND_PCM_STATE_PREPARED)
+	snd_pcm_start(p_handle);
+}
+
+/*
+ * Returns the frames read, 0 if a period isn't there yet, < 0 on error.
+ * A mapped period is handed to the guests straight out of the card's ring.
+ */
+static int process_capture(int *generate_period)
+{
+    snd_pcm_uframes_t offset;
+    int16_t *input;
+    int avail, read, err;
 
-    as = &xvb->c;
-    avail = snd_pcm_avail(as->handle);
+    avail = snd_pcm_avail(c_handle);
     if (avail < 0) {
-	printf("restarting for avail=%d\n", avail);
-	alsa_repare(xvb);
-	return;
+	printf("restarting capture for avail=%d\n", avail);
+	return avail;
     }
 
-    if (avail < 1024)
-	return;
+    if (avail < hw_period)
+	return 0;
 
-    read = snd_pcm_readi(as->handle, orig_input, PERIOD_FRAMES);
-    if (read < 0) {
-	printf("restarting for read=%d\n", read);
-	alsa_repare(xvb);
-	return;
+    if (!c_mmap) {
+	read = snd_pcm_readi(c_handle, orig_input, hw_period);
+	if (read < 0) {
+	    printf("restarting capture for read=%d\n", read);
+	    return read;
+	}
+	deliver_capture(orig_input, read, avail - read, 0, generate_period);
+	return read;
     }
-    pthread_mutex_lock(&as->mutex);
-    if (capture_is_running > 1) {
 
-	fill_averege(orig_input, mono_input);
+    input = mmap_period(c_handle, &offset, &err);
+    if (!input) {
+	if (err >= 0)
+	    err = mmap_copy(c_handle, orig_input, hw_period, 0);
+	if (err < 0) {
+	    printf("restarting capture for mmap=%d\n", err);
+	    return err;
+	}
+	deliver_capture(orig_input, hw_period, avail - hw_period, 0,
+			generate_period);
+	return hw_period;
+    }
 
-	speex_echo_playback(echo_state, prev_buf_2); 
-	speex_echo_capture(echo_state, mono_input, clean_input); 
-	speex_preprocess_run(preprocess_state, clean_input); 
+    deliver_capture(input, hw_period, avail - hw_period, 0, generate_period);
+    if ((err = mmap_commit_period(c_handle, offset)) < 0) {
+	printf("restarting capture for commit=%d\n", err);
+	return err;
+    }
+    return hw_period;
+}
 
-	double_mono(clean_input, orig_input);
+/*
+ * Mixes and writes one card period. Linked to capture it waits for room
+ * like it always did; on its own it only writes when a period is free.
+ * With mmap the period is mixed straight into the card's ring, and a lone
+ * guest at the card's rate is copied there straight from its pages.
+ * Returns the frames written, 0 if there was no room, < 0 on error.
+ */
+static int process_playback(int *generate_period, int linked)
+{
+    struct alsa_stream *ready[MAX_BACKENDS];
+    struct xen_vsnd_backend *xvb;
+    struct alsa_stream *as;
+    snd_pcm_sframes_t p_delay;
+    snd_pcm_uframes_t offset;
+    int16_t *frames, *out;
+    int written, err;
+    int avail, n, live;
+    int mixed = 0;
+    int direct = 0;
+    int i;
 
-	put_data_to_sg((uint16_t *)orig_input, read * 4, as);
-	alsa_refresh_be_capture_info(as);
-	generate_period = 1;
-    } else if (capture_is_running == 1){
-	capture_is_running = 2;
-	/* nothing else to do */
+    /*
+     * Prime with silence, leaving a period free. The card may have granted
+     * fewer periods than asked for, and nothing frees any up until it is
+     * started, so only what fits is written.
+     */
+    if (!p_primed) {
+	avail = snd_pcm_avail(p_handle);
+	for (i = 0; i < DEVICE_PERIODS - 1 && avail >= 2 * hw_period; i++) {
+	    if (write_period(null_buffer) < 0)
+		break;
+	    avail -= hw_period;
+	}
+	start_playback();
+	p_primed = 1;
     }
-    pthread_mutex_unlock(&as->mutex);
 
-    as = &xvb->p;
-    avail = snd_pcm_avail(as->handle);
+    avail = snd_pcm_avail(p_handle);
     if (avail < 0) {
-	printf("restarting for avail=%d\n", avail);
-	alsa_repare(xvb);
-	return;
+	printf("restarting playback for avail=%d\n", avail);
+	return avail;
     }
-    pthread_mutex_lock(&as->mutex);
-    if ((playback_is_running == 0) || (alsa_get_live_frames(as) < 1024) ) {
-	memcpy(output_frame, null_buffer, 4096);
-    } else {
-	get_data_from_sg((uint16_t *)output_frame, PERIOD_FRAMES * 4, as);
- 
-	if(playback_is_running < 2) {
-	    playback_is_running++;
+
+    if (avail < hw_period) {
+	if (!linked)
+	    return 0;
+	/*
+	 * only writei blocks, a mapped ring has to be waited for. The
+	 * backends are locked, so not for longer than a couple of periods.
+	 */
+	if (p_mmap && (err = snd_pcm_wait(p_handle, period_wait_ms())) <= 0)
+	    return err;
+    }
+
+    if (snd_pcm_delay(p_handle, &p_delay) < 0)
+	p_delay = 0;
+
+    for (i = 0; i < MAX_BACKENDS; i++) {
+	ready[i] = NULL;
+	if (!(xvb = rt_backends[i]))
+	    continue;
+	as = &xvb->p;
+	n = as->rs ? resample_needed(as->rs, hw_period) : hw_period;
+	live = as->running ? alsa_get_live_frames(as) : 0;
+	if (as->running > 1 && live < n)
+	    as->stats.starved++;
+	if ((as->running != 0) && (live >= n)) {
+	    /* guest to speaker: what is queued in the guest ring and the card */
+	    count_latency(as, (uint64_t)live * 1000000000ULL / as->rate +
+			  (uint64_t)p_delay * 1000000000ULL / hw_rate);
+	    ready[i] = as;
+	    mixed++;
+	}
+    }
+
+    out = NULL;
+    if (p_mmap) {
+	out = mmap_period(p_handle, &offset, &err);
+	if (err < 0) {
+	    printf("restarting playback for mmap=%d\n", err);
+	    return err;
+	}
+    }
+    if (!out)
+	out = output_frame;
+
+    if (mixed)
+	mix_clear(mix_frame, hw_period * 2);
+    for (i = 0; i < MAX_BACKENDS; i++) {
+	if (!(as = ready[i]))
+	    continue;
+	n = as->rs ? resample_needed(as->rs, hw_period) : hw_period;
+
+	if (mixed == 1 && !as->rs) {
+	    /* nothing to mix with, the volume can go on during the copy */
+	    get_data_from_sg(out, n * 4, as,
+			     MIX_VOLUME_TO_GAIN(as->vol_l),
+			     MIX_VOLUME_TO_GAIN(as->vol_r));
+	    direct = 1;
 	} else {
+	    /* volume is applied by the mixer */
+	    get_data_from_sg(as->frame, n * 4, as,
+			     MIX_UNITY_GAIN, MIX_UNITY_GAIN);
+	    frames = as->frame;
+	    if (as->rs) {
+		resample(as->rs, as->frame, n, resampled, hw_period);
+		frames = resampled;
+	    }
+	    mix_accumulate(mix_frame, frames, hw_period * 2,
+			   MIX_VOLUME_TO_GAIN(as->vol_l),
+			   MIX_VOLUME_TO_GAIN(as->vol_r));
+	}
+
+	if(as->running < 2) {
+	    as->running++;
+	} else if (guest_period_elapsed(as, n)) {
 	    alsa_refresh_be_playback_info(as, 1);
-	    generate_period = 1;
+	    as->stats.periods++;
+	    generate_period[i] = 1;
 	}
     }
-    pthread_mutex_unlock(&as->mutex);
 
-    written = snd_pcm_writei(as->handle, output_frame, PERIOD_FRAMES);
+    if (!mixed)
+	memset(out, 0, hw_period * 4);
+    else if (!direct)
+	mix_saturate(out, mix_frame, hw_period * 2);
+
+    /* The echo reference is only worth keeping while someone uses it */
+    if (linked) {
+	memcpy(prev_buf_2, prev_buf_1, hw_period * 2);
+	mix_downmix(prev_buf_1, out, hw_period);
+    }
+
+    if (out != output_frame) {
+	err = mmap_commit_period(p_handle, offset);
+	written = err < 0 ? err : hw_period;
+    } else {
+	written = write_period(output_frame);
+    }
     if (written < 0) {
-	printf("restarting for snd_pcm_writei: written=%d\n", written);
-	alsa_repare(xvb);
-	return;
+	printf("restarting playback for write: written=%d\n", written);
+	return written;
     }
-    memcpy(prev_buf_2, prev_buf_1, 2048);
-    fill_averege(output_frame, prev_buf_1);
+    start_playback();
+    count_recovered();
+    return written;
+}
 
-    if (generate_period)
-	generate_period_interrupt();
+/*
+ * Services whichever PCMs are ready. Without a capture device, guests
+ * that record get silence, paced by playback.
+ */
+static void process_period(unsigned short c_revents, unsigned short p_revents,
+			   int linked)
+{
+    int generate_period[MAX_BACKENDS] = {0};
+    int n, i;
+
+    if (c_handle && (c_revents & (POLLIN | POLLERR))) {
+	n = process_capture(generate_period);
+	if (n < 0) {
+	    if (linked)
+		alsa_repare();
+	    else
+		recover_capture();
+	} else if (n > 0 && linked && process_playback(generate_period, 1) < 0) {
+	    alsa_repare();
+	}
+    }
 
-}
+    if (!linked && (p_revents & (POLLOUT | POLLERR))) {
+	n = process_playback(generate_period, 0);
+	if (n < 0)
+	    recover_playback();
+	else if (n > 0 && !c_handle)
+	    deliver_capture(null_buffer, n, 0, 1, generate_period);
+    }
 
+    for (i = 0; i < MAX_BACKENDS; i++) {
+	if (generate_period[i])
+	    generate_period_interrupt(rt_backends[i]);
+    }
+}
 
-int alsa_open(struct alsa_stream *as, struct xen_vsnd_backend *xvb)
+/*
+ * Opens the PCM for mapped access if it has it, *mapped says which it got.
+ * Read/write access costs an extra copy each way for every period.
+ */
+static int alsa_open(snd_pcm_t **handle, snd_pcm_stream_t stream,
+		     unsigned int *rate, int period_us,
+		     snd_pcm_uframes_t *period_frames, int *mapped)
 {
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
     int err;
-    int period_frames;
-    int buffer_frames;
 
-    pthread_mutex_lock(&as->mutex);
+    snd_pcm_hw_params_alloca(&hwparams);
+    snd_pcm_sw_params_alloca(&swparams);
 
-    snd_pcm_hw_params_alloca(&as->hwparams);
-    snd_pcm_sw_params_alloca(&as->swparams);
+    if ((err = snd_pcm_open(handle, device, stream, 0)) < 0) {
+	printf("%s open error: %s\n",
+	       stream == SND_PCM_STREAM_PLAYBACK ? "Playback" : "Capture",
+	       snd_strerror(err));
+	return err;
+    }
 
-    err = snd_output_stdio_attach(&output, stdout, 0);
+    *mapped = 1;
+    if ((err = set_hwparams(*handle, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED,
+			    rate, period_us, period_frames)) < 0) {
+	*mapped = 0;
+	err = set_hwparams(*handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
+			   rate, period_us, period_frames);
+    }
     if (err < 0) {
-	printf("Output failed: %s\n", snd_strerror(err));
-	return 0;
+	printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+	goto fail;
+    }
+    if ((err = set_swparams(*handle, swparams)) < 0) {
+	printf("Setting of swparams failed: %s\n", snd_strerror(err));
+	goto fail;
     }
 
-    if (as->stream_type == XC_STREAM_PLAYBACK) {
-	period_frames = P_PERIOD_FRAMES;
-	buffer_frames = P_BUFFER_FRAMES;
-	if ((err = snd_pcm_open(&as->handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-	    printf("Playback open error: %s\n", snd_strerror(err));
-	    return 0;
+    //snd_pcm_dump(*handle, output);
+    return 0;
+
+fail:
+    snd_pcm_close(*handle);
+    *handle = NULL;
+    return err;
+}
+
+/* Opens the card for periods of period_us, at SAMPLE_RATE if it can. */
+static int open_device(int period_us)
+{
+    snd_pcm_uframes_t p_period, c_period;
+    unsigned int p_rate, c_rate;
+    int err;
+
+    if (!output) {
+	err = snd_output_stdio_attach(&output, stdout, 0);
+	if (err < 0) {
+	    printf("Output failed: %s\n", snd_strerror(err));
+	    return err;
 	}
-    } else {
-	period_frames = C_PERIOD_FRAMES;
-	buffer_frames = C_BUFFER_FRAMES;
-	if ((err = snd_pcm_open(&as->handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
-	    printf("Capture open error: %s\n", snd_strerror(err));
-	    return 0;
+    }
+
+    p_rate = SAMPLE_RATE;
+    if ((err = alsa_open(&p_handle, SND_PCM_STREAM_PLAYBACK,
+			 &p_rate, period_us, &p_period, &p_mmap)) < 0)
+	return err;
+
+    /*
+     * The card is usable without a mic. Capture shares the period buffers
+     * and the echo canceller with playback, so it has to match them.
+     */
+    c_rate = p_rate;
+    if (alsa_open(&c_handle, SND_PCM_STREAM_CAPTURE,
+		  &c_rate, period_us, &c_period, &c_mmap) < 0) {
+	printf("No capture, playback only\n");
+    } else if (c_rate != p_rate || c_period != p_period) {
+	printf("Capture and playback disagree: %uHz/%d vs %uHz/%d, playback only\n",
+	       c_rate, (int)c_period, p_rate, (int)p_period);
+	snd_pcm_close(c_handle);
+	c_handle = NULL;
+    }
+
+    hw_rate = p_rate;
+    hw_period = p_period;
+    hw_period_us = (int)((uint64_t)hw_period * 1000000 / hw_rate);
+    req_period_us = period_us;
+    aec_frame = aec_frame_size(hw_period, hw_rate);
+    printf("card running at %uHz, %d frame periods, %s playback, %s capture\n",
+	   hw_rate, hw_period, p_mmap ? "mmap" : "rw",
+	   !c_handle ? "no" : c_mmap ? "mmap" : "rw");
+
+    snd_pcm_prepare(p_handle);
+    p_primed = 0;
+
+    if (c_handle) {
+	snd_pcm_prepare(c_handle);
+	snd_pcm_start(c_handle);
+    }
+    return 0;
+}
+
+/* Speex state is sized for the card period, so it goes with the card. */
+static void close_device(void)
+{
+    int i;
+
+    if (!p_handle)
+	return;
+
+    for (i = 0; i < MAX_BACKENDS; i++)
+	if (backends[i])
+	    drop_preprocess(&backends[i]->c);
+    if (echo_state)
+	speex_echo_state_destroy(echo_state);
+    echo_state = NULL;
+    memset(prev_buf_1, 0, sizeof (prev_buf_1));
+    memset(prev_buf_2, 0, sizeof (prev_buf_2));
+
+    snd_pcm_close(p_handle);
+    if (c_handle)
+	snd_pcm_close(c_handle);
+    p_handle = c_handle = NULL;
+}
+
+static void wake_audio_thread(void)
+{
+    char c = 0;
+
+    write(wake_fd[1], &c, 1);
+}
+
+static void print_cmd(struct fe_cmd *cmd)
+{
+    printf("(%d) ", cmd->stream);
+    switch(cmd->cmd) {
+    case XC_PCM_OPEN:
+	printf("OPEN\n");
+	break;
+    case XC_PCM_CLOSE:
+	printf("CLOSE\n\n");
+	break;
+    case XC_PCM_PREPARE:
+	printf("  PREPARE\n");
+	break;
+    case XC_TRIGGER_START:
+	printf("    START\n");
+	break;
+    case XC_TRIGGER_STOP:
+	printf("    STOP\n");
+	break;
+    }
+}
+
+/*
+ * Takes every command the guest has queued, CMD_BATCH at a time, in
+ * order. Whatever does not fit stays in the guest's ring, so a busy
+ * guest just sees a full ring rather than losing commands.
+ */
+static void drain_cmds(struct xen_vsnd_backend *xvb)
+{
+    struct fe_cmd cmds[CMD_BATCH];
+    int n, i;
+
+    while ((n = ring_read_batch(xvb->cmd_ring, cmds, sizeof (cmds[0]),
+				CMD_BATCH)) > 0) {
+	for (i = 0; i < n; i++) {
+	    print_cmd(&cmds[i]);
+	    if (cmds[i].stream == XC_STREAM_PLAYBACK)
+		process_playback_cmd(&cmds[i], xvb);
+	    else
+		process_capture_cmd(&cmds[i], xvb);
 	}
     }
+    if (n < 0)
+	printf("cmd ring of vsnd device %d is corrupt, reset\n", xvb->devid);
+}
+
+/* Called from the event loop when a guest signals new commands. */
+void alsa_kick(void)
+{
+    wake_audio_thread();
+}
+
+/*
+ * Waits on the capture PCM, the playback PCM and the wake pipe, which
+ * gets the thread going early for new commands and for shutdown. While
+ * playback is linked to capture its descriptors are left out of the poll.
+ */
+static void *audio_thread(void *arg)
+{
+    struct pollfd *fds, *c_fds, *p_fds;
+    unsigned short c_revents, p_revents;
+    short *p_events;
+    uint64_t start;
+    char buf[64];
+    int c_nfds, p_nfds, i;
+    int linked = 0;
+
+    c_nfds = c_handle ? snd_pcm_poll_descriptors_count(c_handle) : 0;
+    p_nfds = snd_pcm_poll_descriptors_count(p_handle);
+    fds = alloca((1 + c_nfds + p_nfds) * sizeof (*fds));
+    p_events = alloca(p_nfds * sizeof (*p_events));
+    c_fds = fds + 1;
+    p_fds = c_fds + c_nfds;
+
+    fds[0].fd = wake_fd[0];
+    fds[0].events = POLLIN;
+    if (c_handle)
+	snd_pcm_poll_descriptors(c_handle, c_fds, c_nfds);
+    snd_pcm_poll_descriptors(p_handle, p_fds, p_nfds);
+    for (i = 0; i < p_nfds; i++)
+	p_events[i] = p_fds[i].events;
+
+    while (!__atomic_load_n(&audio_thread_stop, __ATOMIC_ACQUIRE)) {
+	for (i = 0; i < p_nfds; i++)
+	    p_fds[i].events = linked ? 0 : p_events[i];
+
+	if (poll(fds, 1 + c_nfds + p_nfds, -1) < 0) {
+	    if (errno != EINTR)
+		printf("audio thread poll failed: %s\n", strerror(errno));
+	    continue;
+	}
+
+	if (fds[0].revents & POLLIN)
+	    while (read(wake_fd[0], buf, sizeof (buf)) > 0)
+		;
+
+	/* Odd from here: see wait_audio_pass() */
+	__atomic_add_fetch(&audio_seq, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < MAX_BACKENDS; i++)
+	    rt_backends[i] = __atomic_load_n(&backends[i], __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < MAX_BACKENDS; i++)
+	    if (rt_backends[i])
+		drain_cmds(rt_backends[i]);
+
+	c_revents = p_revents = 0;
+	if (c_handle)
+	    snd_pcm_poll_descriptors_revents(c_handle, c_fds, c_nfds, &c_revents);
+	if (!linked)
+	    snd_pcm_poll_descriptors_revents(p_handle, p_fds, p_nfds, &p_revents);
+
+	linked = aec_in_use();
+	if ((c_revents & (POLLIN | POLLERR)) ||
+	    (p_revents & (POLLOUT | POLLERR))) {
+	    start = mono_nsec();
+	    process_period(c_revents, p_revents, linked);
+	    count_period_time(mono_nsec() - start);
+	}
 
-    if ((err = set_hwparams(as->handle, as->hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
-			    period_frames, buffer_frames)) < 0) {
-	printf("Setting of p_hwparams failed: %s\n", snd_strerror(err));
-	exit(EXIT_FAILURE);
+	__atomic_add_fetch(&audio_seq, 1, __ATOMIC_RELEASE);
     }
-    if ((err = set_swparams(as->handle, as->swparams)) < 0) {
-	printf("Setting of p_swparams failed: %s\n", snd_strerror(err));
-	exit(EXIT_FAILURE);
+
+    return NULL;
+}
+
+static int start_audio_thread(void)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    int err;
+
+    if (wake_fd[0] < 0) {
+	if (pipe(wake_fd) < 0) {
+	    printf("Unable to create wake pipe: %s\n", strerror(errno));
+	    return -1;
+	}
+	fcntl(wake_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_fd[1], F_SETFL, O_NONBLOCK);
     }
 
+    audio_thread_stop = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = AUDIO_THREAD_PRIORITY;
+    pthread_attr_setschedparam(&attr, &param);
+
+    err = pthread_create(&audio_thread_id, &attr, audio_thread, NULL);
+    if (err == EPERM) {
+	printf("No permission for SCHED_FIFO, audio thread is not realtime\n");
+	err = pthread_create(&audio_thread_id, NULL, audio_thread, NULL);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (err) {
+	printf("Unable to start audio thread: %s\n", strerror(err));
+	return -1;
+    }
+    audio_thread_running = 1;
+    return 0;
+}
+
+/*
+ * Waits until the audio thread is out of any pass that began before
+ * backends[] was last changed; a pass that starts after that does not see
+ * what was taken out, so it can be freed. Only called from the event loop.
+ */
+static void wait_audio_pass(void)
+{
+    unsigned int seq = __atomic_load_n(&audio_seq, __ATOMIC_SEQ_CST);
+
+    if (!audio_thread_running || !(seq & 1))
+	return;
+    while (__atomic_load_n(&audio_seq, __ATOMIC_ACQUIRE) == seq)
+	usleep(100);
+}
+
+static void stop_audio_thread(void)
+{
+    if (!audio_thread_running)
+	return;
+    audio_thread_running = 0;
+
+    __atomic_store_n(&audio_thread_stop, 1, __ATOMIC_RELEASE);
+    wake_audio_thread();
+    pthread_join(audio_thread_id, NULL);
+}
+
+static void free_buffers(struct alsa_stream *as)
+{
+    free(as->frame);
+    as->frame = as->processed_input = as->mono = NULL;
+    as->max_frames = 0;
+}
+
+static int stream_period_us(struct alsa_stream *as)
+{
+    return (int)((uint64_t)as->period_frames * 1000000 / as->rate);
+}
+
+/*
+ * One card period at the guest's rate, and for capture with processing
+ * the guest's own stereo and mono copies of it at the card's rate.
+ */
+static int setup_buffers(struct alsa_stream *as)
+{
+    int frames = hw_period;
+    int size;
+
+    free_buffers(as);
+
+    /* a resampler gives or takes at most a frame either side */
+    if (as->rate != hw_rate)
+	frames = (int)((uint64_t)hw_period * as->rate / hw_rate) + 2;
+    size = frames * 2;
+    if (as->stream_type == XC_STREAM_CAPTURE && (as->aec || as->denoise))
+	size += hw_period * 3;
+
+    as->frame = calloc(size, sizeof (*as->frame));
+    if (!as->frame) {
+	printf("Unable to allocate %d frame stream buffers\n", frames);
+	return -1;
+    }
+    as->max_frames = frames;
+    if (size > frames * 2) {
+	as->processed_input = as->frame + frames * 2;
+	as->mono = as->processed_input + hw_period * 2;
+    }
+    return 0;
+}
+
+/* (Re)creates the stream's buffers and resampler for the card's current rate. */
+static int setup_stream(struct alsa_stream *as)
+{
+    int max_in;
+
+    resampler_free(as->rs);
+    as->rs = NULL;
+    as->period_pos = 0;
+
+    if (setup_buffers(as) < 0)
+	return -1;
+
+    if (as->rate == hw_rate)
+	return 0;
+
     if (as->stream_type == XC_STREAM_PLAYBACK) {
-    	/* nothing to do, we only rely on the capture callback */
+	as->rs = resampler_new(as->rate, hw_rate, as->max_frames);
+	max_in = as->max_frames;
     } else {
-    	err = snd_async_add_pcm_handler(&as->ahandler, as->handle, capture_callback, xvb);
-    	if (err < 0) {
-    	    printf("Unable to register async handler\n");
-    	    exit(EXIT_FAILURE);
-    	}
+	as->rs = resampler_new(hw_rate, as->rate, MAX_PERIOD_FRAMES);
+	max_in = MAX_PERIOD_FRAMES;
+    }
+    if (!as->rs) {
+	printf("Unable to resample %dHz <-> %uHz (max %d frames)\n",
+	       as->rate, hw_rate, max_in);
+	return -1;
     }
+    return 0;
+}
 
-    //snd_pcm_dump(as->handle, output);
-    pthread_mutex_unlock(&as->mutex);
+static void cleanup_stream(struct alsa_stream *as)
+{
+    resampler_free(as->rs);
+    as->rs = NULL;
+    free_buffers(as);
 }
 
-void init_alsa(struct xen_vsnd_backend *xvb)
+static int setup_streams(struct xen_vsnd_backend *xvb)
 {
-    struct alsa_stream *as;
-    int written;
+    if (setup_stream(&xvb->p) < 0 || setup_stream(&xvb->c) < 0)
+	return -1;
+    return 0;
+}
 
-    printf("init_alsa\n");
+/*
+ * The card runs at the shortest period any connected guest asked for.
+ * A guest that wants a shorter one than the card has means a reopen,
+ * unless the card was already asked for it and granted longer.
+ * If the card won't take the new period, the guests already connected
+ * get it back at the old one.
+ */
+static int reopen_device(int period_us)
+{
+    int i, err;
+    int old_period_us = req_period_us;
 
-    as = &xvb->p;
-    as->stream_type = XC_STREAM_PLAYBACK;
-    alsa_open(as, xvb);
-    alsa_prepare(as);
+    stop_audio_thread();
+    close_device();
 
-    as = &xvb->c;
-    as->stream_type = XC_STREAM_CAPTURE;
-    alsa_open(as, xvb);
-    alsa_prepare(as);
+    if ((err = open_device(period_us)) < 0) {
+	printf("Unable to reopen card at %dus, going back to %dus\n",
+	       period_us, old_period_us);
+	if (open_device(old_period_us) < 0)
+	    return err;
+    }
 
-    //snd_pcm_link(xvb->c.handle, xvb->p.handle);
+    for (i = 0; i < MAX_BACKENDS; i++)
+	if (backends[i] && setup_streams(backends[i]) < 0)
+	    printf("Lost resampler for backend %d\n", i);
 
-    snd_pcm_start(xvb->c.handle);
+    if (start_audio_thread() < 0) {
+	close_device();
+	return -1;
+    }
+    return err;
 }
 
-void cleanup_alsa(struct xen_vsnd_backend *xvb)
+int init_alsa(struct xen_vsnd_backend *xvb)
 {
-    struct alsa_stream *as;
+    int i, err = 0;
+    int period_us;
 
-    printf("cleanup_alsa\n");
+    printf("init_alsa\n");
 
-    as = &xvb->p;
-    as->stream_type = XC_STREAM_PLAYBACK;
-    snd_pcm_close(as->handle);
+    xvb->p.stream_type = XC_STREAM_PLAYBACK;
+    alsa_prepare(&xvb->p);
+    memset(&xvb->p.stats, 0, sizeof (xvb->p.stats));
+    memset(&xvb->c.stats, 0, sizeof (xvb->c.stats));
+    xvb->c.stream_type = XC_STREAM_CAPTURE;
+    alsa_prepare(&xvb->c);
+
+    for (i = 0; i < MAX_BACKENDS; i++)
+	if (!backends[i])
+	    break;
+    if (i == MAX_BACKENDS) {
+	printf("Too many backends, %d already connected\n", n_backends);
+	return -1;
+    }
+
+    period_us = stream_period_us(&xvb->p);
+    if (stream_period_us(&xvb->c) < period_us)
+	period_us = stream_period_us(&xvb->c);
+
+    if (!p_handle) {
+	if ((err = open_device(period_us)) < 0)
+	    return err;
+	if ((err = start_audio_thread()) < 0) {
+	    close_device();
+	    return err;
+	}
+    } else if (period_us < req_period_us && period_us < hw_period_us) {
+	if ((err = reopen_device(period_us)) < 0)
+	    return err;
+    }
 
-    as = &xvb->c;
-    as->stream_type = XC_STREAM_CAPTURE;
-    snd_pcm_close(as->handle);
+    if ((err = setup_streams(xvb)) < 0) {
+	cleanup_stream(&xvb->p);
+	cleanup_stream(&xvb->c);
+	if (n_backends == 0) {
+	    stop_audio_thread();
+	    close_device();
+	}
+	return err;
+    }
+
+    __atomic_store_n(&backends[i], xvb, __ATOMIC_SEQ_CST);
+    n_backends++;
+
+    return 0;
 }
 
-void init_speex()
+void cleanup_alsa(struct xen_vsnd_backend *xvb)
 {
-    int rate=44100;
-    spx_int32_t tmp;
+    int i, last = 0;
 
-    echo_state = speex_echo_state_init(1024, 8192);
-    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    printf("cleanup_alsa\n");
 
-    preprocess_state = speex_preprocess_state_init(1024, 44100);
+    for (i = 0; i < MAX_BACKENDS; i++) {
+	if (backends[i] != xvb)
+	    continue;
+	__atomic_store_n(&backends[i], NULL, __ATOMIC_SEQ_CST);
+	last = (--n_backends == 0);
+	break;
+    }
 
-    tmp = 1;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_AGC, &tmp);
+    /* From here on the audio thread no longer sees xvb */
+    if (last) {
+	stop_audio_thread();
+	close_device();
+    } else {
+	wait_audio_pass();
+    }
 
-    tmp = 1;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_DENOISE, &tmp);
+    cleanup_stream(&xvb->p);
+    cleanup_stream(&xvb->c);
+    drop_preprocess(&xvb->c);
+}
 
-    tmp = -60;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &tmp);
-    
-    tmp = -60;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS_ACTIVE, &tmp);
+static void publish_stream(struct xen_vsnd_backend *xvb, const char *dir,
+			   struct stream_stats *s)
+{
+    char node[64];
+
+    snprintf(node, sizeof (node), "stats/%s/periods", dir);
+    backend_print(xvb->back, xvb->devid, node, "%llu", (unsigned long long)s->periods);
+    snprintf(node, sizeof (node), "stats/%s/xruns", dir);
+    backend_print(xvb->back, xvb->devid, node, "%llu", (unsigned long long)s->xruns);
+    snprintf(node, sizeof (node), "stats/%s/starved", dir);
+    backend_print(xvb->back, xvb->devid, node, "%llu", (unsigned long long)s->starved);
+    snprintf(node, sizeof (node), "stats/%s/latency-us", dir);
+    backend_print(xvb->back, xvb->devid, node, "%u", s->latency_us);
+    snprintf(node, sizeof (node), "stats/%s/latency-max-us", dir);
+    backend_print(xvb->back, xvb->devid, node, "%u", s->latency_max_us);
+}
 
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_STATE, echo_state);  
-  
+/*
+ * Called from the event loop every STATS_INTERVAL seconds. Counters are
+ * copied out between two passes of the audio thread, and written to
+ * xenstore afterwards, so the audio thread never waits on the event loop.
+ * If the audio thread stays in a pass for too long, this round is skipped.
+ */
+void alsa_publish_stats(void)
+{
+    struct {
+	struct xen_vsnd_backend *xvb;
+	struct stream_stats p, c;
+    } snap[MAX_BACKENDS];
+    struct device_stats dev;
+    char hist[STATS_BUCKETS * 21];
+    unsigned int seq;
+    int i, b, len, tries;
+
+    for (tries = 0; ; tries++) {
+	if (tries == STATS_TRIES)
+	    return;
+	seq = __atomic_load_n(&audio_seq, __ATOMIC_ACQUIRE);
+	if (seq & 1) {
+	    usleep(100);
+	    continue;
+	}
+	for (i = 0; i < MAX_BACKENDS; i++) {
+	    snap[i].xvb = backends[i];
+	    if (!backends[i])
+		continue;
+	    snap[i].p = backends[i]->p.stats;
+	    snap[i].c = backends[i]->c.stats;
+	}
+	dev = dev_stats;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&audio_seq, __ATOMIC_RELAXED) == seq)
+	    break;
+    }
+
+    len = 0;
+    for (b = 0; b < STATS_BUCKETS; b++)
+	len += snprintf(hist + len, sizeof (hist) - len, "%s%llu",
+			b ? " " : "", (unsigned long long)dev.period_us_hist[b]);
+
+    for (i = 0; i < MAX_BACKENDS; i++) {
+	struct xen_vsnd_backend *xvb = snap[i].xvb;
+
+	if (!xvb)
+	    continue;
+	publish_stream(xvb, "playback", &snap[i].p);
+	publish_stream(xvb, "capture", &snap[i].c);
+
+	/* What the shared card did, as seen from every guest */
+	backend_print(xvb->back, xvb->devid, "stats/card/periods", "%llu",
+		      (unsigned long long)dev.periods);
+	backend_print(xvb->back, xvb->devid, "stats/card/xruns", "%llu",
+		      (unsigned long long)dev.xruns);
+	backend_print(xvb->back, xvb->devid, "stats/card/recovery-us", "%llu",
+		      (unsigned long long)dev.recovery_us);
+	backend_print(xvb->back, xvb->devid, "stats/card/last-recovery-us", "%u",
+		      dev.last_recovery_us);
+	backend_print(xvb->back, xvb->devid, "stats/card/period-us-max", "%u",
+		      dev.period_us_max);
+	backend_print(xvb->back, xvb->devid, "stats/card/period-us-histogram", "%s",
+		      hist);
+    }
 }
 
-void process_playback_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+void process_playback_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb)
 {
+    struct alsa_stream *as = &xvb->p;
     int ret;
 
-    pthread_mutex_lock(&as->mutex);   
     switch (fe_cmd->cmd) {
     case XC_PCM_OPEN:
-	playback_is_running = 0;
+	as->running = 0;
 	break;
     case XC_PCM_CLOSE:
-	playback_is_running = 0;
+	as->running = 0;
 	break;
     case XC_PCM_PREPARE:
-	playback_is_running = 0;
+	as->running = 0;
 	as->hw_ptr = as->processed = as->processed_periods = 0;
+	as->period_pos = 0;
+	if (as->rs)
+	    resampler_reset(as->rs);
 	break;
     case XC_TRIGGER_START:
 	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
-	generate_period_interrupt();
-	playback_is_running = 1;
+	generate_period_interrupt(xvb);
+	as->running = 1;
 	break;
     case XC_TRIGGER_STOP:
 	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
-	generate_period_interrupt();
-	playback_is_running = 0;
+	generate_period_interrupt(xvb);
+	as->running = 0;
 	break;
     }
-    pthread_mutex_unlock(&as->mutex);   
 }
 
-void process_capture_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+void process_capture_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb)
 {
+    struct alsa_stream *as = &xvb->c;
     int ret;
 
-    pthread_mutex_lock(&as->mutex);   
     switch (fe_cmd->cmd) {
     case XC_PCM_OPEN:
-	capture_is_running = 0;
+	as->running = 0;
 	break;
     case XC_PCM_CLOSE:
-	capture_is_running = 0;
+	as->running = 0;
 	break;
     case XC_PCM_PREPARE:
-	capture_is_running = 0;
+	as->running = 0;
 	as->hw_ptr = as->processed = as->processed_periods = 0;
+	as->period_pos = 0;
+	if (as->rs)
+	    resampler_reset(as->rs);
 	break;
     case XC_TRIGGER_START:
 	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
-	generate_period_interrupt();
-	capture_is_running = 1;
+	generate_period_interrupt(xvb);
+	as->running = 1;
 	break;
     case XC_TRIGGER_STOP:
 	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
-	generate_period_interrupt();
-	capture_is_running = 0;
+	generate_period_interrupt(xvb);
+	as->running = 0;
 	break;
     }
-    pthread_mutex_unlock(&as->mutex);   
 }
 
@@ -45,11 +45,10 @@
 #include "ring.h"
 #include "mb.h"
 #include "audio-daemon.h"
+#include "mix.h"
 
 struct xc_interface *xc_handle = NULL;
-struct xen_vsnd_backend *glob_xvb;
 char paulian_debug[4];
-struct ring_t *cmd_ring = 0;
 
 struct xen_vsnd_device
 {
@@ -58,6 +57,7 @@ struct xen_vsnd_device
 };
 
 static struct event backend_xenstore_event;
+static struct event stats_timer;
 
 /* Backend vsnd operations */
 uint64_t get_nsec_now(void)
@@ -67,9 +67,9 @@ uint64_t get_nsec_now(void)
     return now;
 }
 
-void generate_period_interrupt(struct alsa_stream *as)
+void generate_period_interrupt(struct xen_vsnd_backend *xvb)
 {
-    backend_evtchn_notify(glob_xvb->back, glob_xvb->devid);
+    backend_evtchn_notify(xvb->back, xvb->devid);
 }
 
 void *playback_worker_thread(void *arg);
@@ -81,17 +81,15 @@ static xen_device_t xen_vsnd_alloc(xen_backend_t backend, int devid, void *priv)
     struct xen_vsnd_backend *xvb;
     int err;
 
-    xvb = (struct xen_vsnd_backend*) malloc(sizeof (*xvb));
+    xvb = (struct xen_vsnd_backend*) calloc(1, sizeof (*xvb));
     xvb->devid = devid;
     xvb->dev = dev;
     xvb->back = backend;
 
-    glob_xvb = xvb;
-
-    err = pthread_mutex_init(&xvb->p.mutex, NULL);
-    err = pthread_mutex_init(&xvb->c.mutex, NULL);
-
-    init_speex();
+    xvb->p.vol_l = xvb->p.vol_r = DEFAULT_VOLUME;
+    xvb->c.vol_l = xvb->c.vol_r = DEFAULT_VOLUME;
+    xvb->p.rate = xvb->c.rate = SAMPLE_RATE;
+    xvb->p.period_frames = xvb->c.period_frames = PERIOD_FRAMES;
 
     return xvb;
 }
@@ -100,7 +98,41 @@ static int xen_vsnd_init(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
 
-    backend_print(xvb->back, xvb->devid, "sample-rate", "%d", SAMPLE_RATE);
+    int vol, rate, period;
+    int aec, denoise;
+
+    /*
+     * Take what the toolstack asked for if it makes sense, and publish
+     * what will actually be used for the frontend to pick up.
+     */
+    if (backend_scan(xvb->back, xvb->devid, "sample-rate", "%d", &rate) != 1 ||
+	rate < MIN_SAMPLE_RATE || rate > MAX_SAMPLE_RATE)
+	rate = SAMPLE_RATE;
+    if (backend_scan(xvb->back, xvb->devid, "period-frames", "%d", &period) != 1 ||
+	period < MIN_PERIOD_FRAMES || period > MAX_PERIOD_FRAMES ||
+	period > RING_FRAMES / 2)
+	period = PERIOD_FRAMES;
+
+    xvb->p.rate = xvb->c.rate = rate;
+    xvb->p.period_frames = xvb->c.period_frames = period;
+
+    backend_print(xvb->back, xvb->devid, "sample-rate", "%d", rate);
+    backend_print(xvb->back, xvb->devid, "period-frames", "%d", period);
+
+    if (backend_scan(xvb->back, xvb->devid, "volume", "%d", &vol) == 1 &&
+	vol >= 0 && vol <= 100)
+	xvb->p.vol_l = xvb->p.vol_r = vol;
+
+    /* Mic processing is on unless turned off, raw stereo if both are off */
+    if (backend_scan(xvb->back, xvb->devid, "echo-cancel", "%d", &aec) != 1)
+	aec = 1;
+    if (backend_scan(xvb->back, xvb->devid, "denoise", "%d", &denoise) != 1)
+	denoise = 1;
+    xvb->c.aec = !!aec;
+    xvb->c.denoise = !!denoise;
+
+    backend_print(xvb->back, xvb->devid, "echo-cancel", "%d", xvb->c.aec);
+    backend_print(xvb->back, xvb->devid, "denoise", "%d", xvb->c.denoise);
 
     return 0;
 }
@@ -145,19 +177,18 @@ static int xen_vsnd_connect(xen_device_t xendev)
     }
     
 	/* cmd_ring */
-    if (!cmd_ring) {
-        printf("MAPPING CMDS RING!\n");
-    	cmd_ring = (struct ring_t *) xc_map_foreign_range(xc_handle, xvb->dev->domid,
-							  XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
-							  page_ref[300]);
-	ring_init(cmd_ring);
-    }
+    printf("MAPPING CMDS RING!\n");
+    xvb->cmd_ring = (struct ring_t *) xc_map_foreign_range(xc_handle, xvb->dev->domid,
+							   XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
+							   page_ref[300]);
+    ring_init(xvb->cmd_ring);
 
     xvb->p.be_info = (struct be_info *) &page_ref[400];
 	
     xvb->c.be_info = (struct be_info *) &page_ref[500];
 
-    init_alsa(xvb);
+    if (init_alsa(xvb) < 0)
+	return -1;
 
     printf("%s exit\n", __FUNCTION__); fflush(stdout);
     return 0;
@@ -194,8 +225,8 @@ static void xen_vsnd_disconnect(xen_device_t xendev)
 	xvb->c.dma_buffer[i] = NULL;
     }
 
-    munmap(cmd_ring, XENVSND_PAGE_SIZE);
-    cmd_ring = NULL;
+    munmap(xvb->cmd_ring, XENVSND_PAGE_SIZE);
+    xvb->cmd_ring = NULL;
 
     printf("%s exit\n", __FUNCTION__); fflush(stdout);
 }
@@ -203,41 +234,8 @@ static void xen_vsnd_disconnect(xen_device_t xendev)
 
 static void xen_vsnd_event(xen_device_t xendev)
 {
-    struct xen_vsnd_backend *xvb = xendev;
-    struct fe_cmd cmd;
-    int len;
-
-    while (1) {
-	len = ring_read(cmd_ring, (void *)&cmd, sizeof(cmd));
-	if (len == sizeof(cmd)) {
-
-	    printf("(%d) ", cmd.stream);
-	    switch(cmd.cmd) {
-	    case XC_PCM_OPEN:
-	    	printf("OPEN\n");
-	    	break;
-	    case XC_PCM_CLOSE:
-	    	printf("CLOSE\n\n");
-	    	break;
-	    case XC_PCM_PREPARE:
-	    	printf("  PREPARE\n");
-	    	break;
-	    case XC_TRIGGER_START:
-	    	printf("    START\n");
-	    	break;
-	    case XC_TRIGGER_STOP:
-	    	printf("    STOP\n");
-	    	break;
-	    }
-
-	    if (cmd.stream == XC_STREAM_PLAYBACK)
-		process_playback_cmd(&cmd, &xvb->p);
-	    else
-		process_capture_cmd(&cmd, &xvb->c);	
-	} else {
-	    return;
-	}
-    }
+    /* Commands are consumed, and stream state changed, by the audio thread */
+    alsa_kick();
 }
 
 static void xen_vsnd_free(xen_device_t xendev)
@@ -277,6 +275,14 @@ void xen_vsnd_device_create(int domid)
 }
 
 
+static void stats_timer_handler(int fd, short event, void *priv)
+{
+    struct timeval tv = { STATS_INTERVAL, 0 };
+
+    alsa_publish_stats();
+    evtimer_add(&stats_timer, &tv);
+}
+
 /* Backend init functions */
 static void xen_backend_handler(int fd, short event, void *priv)
 {
@@ -303,7 +309,8 @@ void xen_backend_init(int dom0)
 
 int main(int argc, char *argv[])
 {
-    int companion = atoi(argv[1]);
+    int companion;
+    int i;
 
     event_init ();
 
@@ -312,9 +319,18 @@ int main(int argc, char *argv[])
         return -1;
 
     xen_backend_init (0);
-        
-    printf("companion domain = %d\n", companion);
-    xen_vsnd_device_create(companion); 
+
+    mix_init();
+
+    evtimer_set(&stats_timer, stats_timer_handler, NULL);
+    stats_timer_handler(-1, 0, NULL);
+
+    /* One vsnd backend per companion domain, all mixed onto the same card */
+    for (i = 1; i < argc; i++) {
+	companion = atoi(argv[i]);
+	printf("companion domain = %d\n", companion);
+	xen_vsnd_device_create(companion); 
+    }
 
     event_dispatch();
 	
@@ -54,35 +54,70 @@ struct be_info {
 
 #define N_AUD_BUFFER_PAGES 8
 #define XENVSND_PAGE_SIZE 4096
-#define P_PERIOD_FRAMES 1024
-#define P_BUFFER_FRAMES 4096
-#define C_PERIOD_FRAMES P_PERIOD_FRAMES
-#define C_BUFFER_FRAMES P_BUFFER_FRAMES
-#define PERIOD_FRAMES P_PERIOD_FRAMES
-#define BUFFER_FRAMES P_BUFFER_FRAMES
+#define RING_FRAMES (N_AUD_BUFFER_PAGES * XENVSND_PAGE_SIZE / 4)
+
+/*
+ * Per guest defaults, used unless the toolstack put "sample-rate" or
+ * "period-frames" in the backend node. The card itself is asked for
+ * SAMPLE_RATE and for the shortest period any connected guest wants.
+ */
+#define PERIOD_FRAMES 1024
 #define SAMPLE_RATE            (44100)
 #define PERIOD_BYTES            (PERIOD_FRAMES * 4)
 
+#define MIN_PERIOD_FRAMES 64
+#define MAX_PERIOD_FRAMES 4096
+#define MIN_SAMPLE_RATE 8000
+#define MAX_SAMPLE_RATE 48000
+#define DEVICE_PERIODS 4
+
+/*
+ * Telemetry, published under "stats/" in each backend node every
+ * STATS_INTERVAL seconds. The card also keeps a histogram of how long
+ * each period took to process, bucketed at 50, 100, 250, 500us, 1, 2, 5ms.
+ */
+#define STATS_INTERVAL 5
+#define STATS_BUCKETS 8
+
+struct stream_stats {
+    uint64_t periods;		/* guest periods completed */
+    uint64_t xruns;		/* card xruns while the stream was running */
+    uint64_t starved;		/* card periods the guest had no data for */
+    uint32_t latency_us;	/* guest to speaker, or mic to guest */
+    uint32_t latency_max_us;
+};
+
 struct alsa_stream {
     uint8_t stream_type;
     void *dma_buffer[N_AUD_BUFFER_PAGES];
     struct be_info *be_info;
     int hw_ptr;
     int app_ptr;
-    snd_pcm_t *handle;
-    snd_pcm_hw_params_t *hwparams;
-    snd_pcm_sw_params_t *swparams;
-    snd_async_handler_t *ahandler;
+    int running;
+    int rate;
+    int period_frames;
+    int period_pos;
+    struct resampler *rs;
+    int16_t *frame;		/* one card period at the guest's rate */
+    int max_frames;
+    int16_t *processed_input;	/* capture: mic input after this guest's */
+    int16_t *mono;		/* preprocessor, stereo and mono */
+    struct stream_stats stats;
     int vol_l;
     int vol_r;
+    int aec;			/* capture: echo cancel against the speakers */
+    int denoise;		/* capture: speex noise suppression */
+    struct SpeexPreprocessState_ *preprocess;
     enum stream_status status;
-    pthread_mutex_t mutex;
     int32_t processed;
     int32_t processed_periods;
     uint64_t last_time;
     pthread_t worker_thread;
 };
 
+/* Most guest commands taken off the cmd_ring in one go */
+#define CMD_BATCH 16
+
 struct xen_vsnd_backend {
     struct xen_vsnd_device *dev;
     xen_backend_t back;
@@ -90,10 +125,20 @@ struct xen_vsnd_backend {
 
     void *page;
     struct event evtchn_event;
+    struct ring_t *cmd_ring;
 
     struct alsa_stream p;
     struct alsa_stream c;
 };
 
+/* Default per-guest volume, 0..100, overridden by the "volume" backend node */
+#define DEFAULT_VOLUME 100
+
+void generate_period_interrupt(struct xen_vsnd_backend *xvb);
+void alsa_kick(void);
+void alsa_publish_stats(void);
+void process_playback_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb);
+void process_capture_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb);
+
 struct event audio_work_timer;
 void audio_work(int a, short b, void *arg);
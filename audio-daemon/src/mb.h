@@ -31,4 +31,8 @@
 #error "Unknow architecture"
 #endif
 
+/* Index publication for the lock-free rings */
+#define load_acquire(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
 #endif
@@ -0,0 +1,152 @@
+/*
+ * mix-bench.c:
+ *
+ * Times the per-period sample copy, mixing and echo canceller channel
+ * conversion paths against the old sample-at-a-time loop. Build with "make mix-bench".
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mix.h"
+
+/* Same shape as the guest ring and ALSA period in audio-daemon.h */
+#define PAGES 8
+#define PAGE_SIZE 4096
+#define PERIOD_FRAMES 1024
+#define PERIOD_SAMPLES (PERIOD_FRAMES * 2)
+#define GUESTS 4
+
+#define ITERATIONS 20000
+
+static void *pages[PAGES];
+static int hw_ptr;
+
+/* The loop get_data_from_sg() used to run. */
+static void copy_legacy(int16_t *dst, int size, int val)
+{
+    int16_t *src;
+
+    size = size / 2;
+    while (size--) {
+	src = pages[hw_ptr / PAGE_SIZE] + hw_ptr % PAGE_SIZE;
+	*dst++ = (*src) * val / 100;
+	hw_ptr += 2;
+	if (hw_ptr == PAGE_SIZE * PAGES)
+	    hw_ptr = 0;
+    }
+}
+
+static void copy_chunked(int16_t *dst, int size, int gain)
+{
+    int offset, chunk;
+
+    while (size > 0) {
+	offset = hw_ptr % PAGE_SIZE;
+	chunk = PAGE_SIZE - offset;
+	if (chunk > size)
+	    chunk = size;
+	mix_gain(dst, pages[hw_ptr / PAGE_SIZE] + offset, chunk / 2, gain, gain);
+	dst += chunk / 2;
+	size -= chunk;
+	hw_ptr += chunk;
+	if (hw_ptr == PAGE_SIZE * PAGES)
+	    hw_ptr = 0;
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t start)
+{
+    printf("%-28s %8.1f ns/period\n", name,
+	   (double)(now_ns() - start) / ITERATIONS);
+}
+
+int main(int argc, char *argv[])
+{
+    static int16_t out[PERIOD_SAMPLES];
+    static int16_t guest[GUESTS][PERIOD_SAMPLES];
+    static int32_t acc[PERIOD_SAMPLES];
+    static int16_t mono[PERIOD_FRAMES];
+    uint64_t start;
+    int i, j;
+
+    mix_init();
+
+    srand(1);
+    for (i = 0; i < PAGES; i++) {
+	pages[i] = malloc(PAGE_SIZE);
+	for (j = 0; j < PAGE_SIZE / 2; j++)
+	    ((int16_t *)pages[i])[j] = rand();
+    }
+    for (i = 0; i < GUESTS; i++)
+	for (j = 0; j < PERIOD_SAMPLES; j++)
+	    guest[i][j] = rand();
+
+    start = now_ns();
+    for (i = 0; i < ITERATIONS; i++)
+	copy_legacy(out, PERIOD_FRAMES * 4, 100);
+    report("legacy copy, volume 100", start);
+
+    start = now_ns();
+    for (i = 0; i < ITERATIONS; i++)
+	copy_legacy(out, PERIOD_FRAMES * 4, 50);
+    report("legacy copy, volume 50", start);
+
+    start = now_ns();
+    for (i = 0; i < ITERATIONS; i++)
+	copy_chunked(out, PERIOD_FRAMES * 4, MIX_UNITY_GAIN);
+    report("chunked copy, unity gain", start);
+
+    start = now_ns();
+    for (i = 0; i < ITERATIONS; i++)
+	copy_chunked(out, PERIOD_FRAMES * 4, MIX_VOLUME_TO_GAIN(50));
+    report("chunked copy, gain 50", start);
+
+    start = now_ns();
+    for (i = 0; i < ITERATIONS; i++) {
+	mix_clear(acc, PERIOD_SAMPLES);
+	for (j = 0; j < GUESTS; j++)
+	    mix_accumulate(acc, guest[j], PERIOD_SAMPLES,
+			   MIX_VOLUME_TO_GAIN(80), MIX_VOLUME_TO_GAIN(60));
+	mix_saturate(out, acc, PERIOD_SAMPLES);
+    }
+    report("mix of 4 guests", start);
+
+    start = now_ns();
+    for (i = 0; i < ITERATIONS; i++) {
+	mix_downmix(mono, guest[0], PERIOD_FRAMES);
+	mix_upmix(out, mono, PERIOD_FRAMES);
+    }
+    report("downmix and upmix", start);
+
+    return 0;
+}
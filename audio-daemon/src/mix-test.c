@@ -0,0 +1,173 @@
+/*
+ * mix-test.c:
+ *
+ * Checks the mixing kernels mix_init() picks on this CPU against a plain
+ * C version of what they compute, for every length up to a few vector
+ * blocks and for sources shorter than the mix. Build with "make mix-test".
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mix.h"
+
+/* A few blocks of the widest kernel (16 samples), plus a tail */
+#define MAX_SAMPLES 80
+#define SOURCES 3
+#define ROUNDS 200
+
+static int failed = 0;
+
+static int16_t clamp16(int32_t v)
+{
+    if (v > INT16_MAX)
+	return INT16_MAX;
+    if (v < INT16_MIN)
+	return INT16_MIN;
+    return v;
+}
+
+static int gain_of(int i, const int *gains)
+{
+    return gains[i & 1];
+}
+
+static void fill(int16_t *buf, int samples)
+{
+    int i;
+
+    for (i = 0; i < samples; i++)
+	buf[i] = (int16_t)(rand() & 0xffff);
+}
+
+static void check(const char *what, int len, const int16_t *got,
+		  const int16_t *want, int samples)
+{
+    int i;
+
+    for (i = 0; i < samples; i++) {
+	if (got[i] != want[i]) {
+	    printf("%s (%d samples): sample %d is %d, expected %d\n",
+		   what, len, i, got[i], want[i]);
+	    failed = 1;
+	    return;
+	}
+    }
+}
+
+static int random_gain(void)
+{
+    switch (rand() % 4) {
+    case 0:
+	return MIX_UNITY_GAIN;
+    case 1:
+	return 0;
+    default:
+	return rand() % (INT16_MAX + 1);
+    }
+}
+
+/* Sources of different lengths, all mixed into one period of samples. */
+static void test_mix(int samples)
+{
+    int16_t src[SOURCES][MAX_SAMPLES];
+    int32_t acc[MAX_SAMPLES], ref[MAX_SAMPLES];
+    int16_t out[MAX_SAMPLES], want[MAX_SAMPLES];
+    int gains[SOURCES][2];
+    int len[SOURCES];
+    int i, j;
+
+    mix_clear(acc, samples);
+    memset(ref, 0, sizeof (ref));
+
+    for (j = 0; j < SOURCES; j++) {
+	len[j] = j == 0 ? samples : (rand() % (samples / 2 + 1)) * 2;
+	gains[j][0] = random_gain();
+	gains[j][1] = random_gain();
+	fill(src[j], len[j]);
+
+	mix_accumulate(acc, src[j], len[j], gains[j][0], gains[j][1]);
+	for (i = 0; i < len[j]; i++)
+	    ref[i] += (src[j][i] * gain_of(i, gains[j])) >> MIX_GAIN_SHIFT;
+    }
+
+    mix_saturate(out, acc, samples);
+    for (i = 0; i < samples; i++)
+	want[i] = clamp16(ref[i]);
+    check("mix", samples, out, want, samples);
+}
+
+static void test_gain(int samples)
+{
+    int16_t src[MAX_SAMPLES], out[MAX_SAMPLES], want[MAX_SAMPLES];
+    int gains[2];
+    int i;
+
+    gains[0] = random_gain();
+    gains[1] = random_gain();
+    fill(src, samples);
+
+    mix_gain(out, src, samples, gains[0], gains[1]);
+    for (i = 0; i < samples; i++)
+	want[i] = clamp16((src[i] * gain_of(i, gains)) >> MIX_GAIN_SHIFT);
+    check("gain", samples, out, want, samples);
+}
+
+static void test_downmix_upmix(int frames)
+{
+    int16_t stereo[MAX_SAMPLES], mono[MAX_SAMPLES / 2];
+    int16_t want_mono[MAX_SAMPLES / 2], want_stereo[MAX_SAMPLES];
+    int i;
+
+    memset(stereo, 0, sizeof (stereo));
+    fill(stereo, frames * 2);
+
+    mix_downmix(mono, stereo, frames);
+    for (i = 0; i < frames; i++)
+	want_mono[i] = (stereo[i * 2] + stereo[i * 2 + 1]) >> 1;
+    check("downmix", frames, mono, want_mono, frames);
+
+    mix_upmix(stereo, mono, frames);
+    for (i = 0; i < frames; i++)
+	want_stereo[i * 2] = want_stereo[i * 2 + 1] = want_mono[i];
+    check("upmix", frames, stereo, want_stereo, frames * 2);
+}
+
+int main(int argc, char *argv[])
+{
+    int samples, round;
+
+    mix_init();
+    srand(1);
+
+    for (round = 0; round < ROUNDS; round++) {
+	for (samples = 0; samples <= MAX_SAMPLES; samples += 2) {
+	    test_mix(samples);
+	    test_gain(samples);
+	    test_downmix_upmix(samples / 2);
+	}
+    }
+
+    printf("mix kernels: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
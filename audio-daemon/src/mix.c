@@ -0,0 +1,323 @@
+/*
+ * mix.c:
+ *
+ * Sample gain and mixing kernels.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNEL
+#include <immintrin.h>
+#endif
+
+#include "mix.h"
+
+/*
+ * Every kernel computes exactly the same thing, sample by sample:
+ *
+ *     acc += (sample * gain) >> MIX_GAIN_SHIFT
+ *     out  = clamp(acc, INT16_MIN, INT16_MAX)
+ *
+ * so the scalar code doubles as the reference for the vector versions and
+ * handles whatever is left over once the vector blocks are done.
+ */
+
+typedef void (*gain_fn)(int16_t *, const int16_t *, int, int, int);
+typedef void (*accumulate_fn)(int32_t *, const int16_t *, int, int, int);
+typedef void (*saturate_fn)(int16_t *, const int32_t *, int);
+
+static inline int16_t clamp16(int32_t v)
+{
+    if (v > INT16_MAX)
+	return INT16_MAX;
+    if (v < INT16_MIN)
+	return INT16_MIN;
+    return v;
+}
+
+static void gain_scalar(int16_t *dst, const int16_t *src, int i,
+			int samples, int gain_l, int gain_r)
+{
+    for (; i < samples; i += 2) {
+	dst[i] = clamp16((src[i] * gain_l) >> MIX_GAIN_SHIFT);
+	dst[i + 1] = clamp16((src[i + 1] * gain_r) >> MIX_GAIN_SHIFT);
+    }
+}
+
+static int accumulate_scalar(int32_t *acc, const int16_t *src, int i,
+			     int samples, int gain_l, int gain_r)
+{
+    for (; i < samples; i += 2) {
+	acc[i] += (src[i] * gain_l) >> MIX_GAIN_SHIFT;
+	acc[i + 1] += (src[i + 1] * gain_r) >> MIX_GAIN_SHIFT;
+    }
+    return i;
+}
+
+static void saturate_scalar(int16_t *dst, const int32_t *acc, int i, int samples)
+{
+    for (; i < samples; i++)
+	dst[i] = clamp16(acc[i]);
+}
+
+static void mix_gain_c(int16_t *dst, const int16_t *src, int samples,
+		       int gain_l, int gain_r)
+{
+    gain_scalar(dst, src, 0, samples, gain_l, gain_r);
+}
+
+static void mix_accumulate_c(int32_t *acc, const int16_t *src, int samples,
+			     int gain_l, int gain_r)
+{
+    accumulate_scalar(acc, src, 0, samples, gain_l, gain_r);
+}
+
+static void mix_saturate_c(int16_t *dst, const int32_t *acc, int samples)
+{
+    saturate_scalar(dst, acc, 0, samples);
+}
+
+#ifdef __SSE2__
+static void mix_gain_sse2(int16_t *dst, const int16_t *src, int samples,
+			  int gain_l, int gain_r)
+{
+    __m128i g = _mm_set1_epi32((gain_r << 16) | (gain_l & 0xffff));
+    __m128i s, lo, hi, p0, p1;
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+	s = _mm_loadu_si128((const __m128i *)(src + i));
+	lo = _mm_mullo_epi16(s, g);
+	hi = _mm_mulhi_epi16(s, g);
+	p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), MIX_GAIN_SHIFT);
+	p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), MIX_GAIN_SHIFT);
+	_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(p0, p1));
+    }
+    gain_scalar(dst, src, i, samples, gain_l, gain_r);
+}
+
+/* 8 samples (4 stereo frames) per step; accumulator keeps natural order. */
+static void mix_accumulate_sse2(int32_t *acc, const int16_t *src, int samples,
+				int gain_l, int gain_r)
+{
+    __m128i g = _mm_set1_epi32((gain_r << 16) | (gain_l & 0xffff));
+    __m128i s, lo, hi, a0, a1;
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+	s = _mm_loadu_si128((const __m128i *)(src + i));
+	lo = _mm_mullo_epi16(s, g);
+	hi = _mm_mulhi_epi16(s, g);
+	a0 = _mm_loadu_si128((__m128i *)(acc + i));
+	a1 = _mm_loadu_si128((__m128i *)(acc + i + 4));
+	a0 = _mm_add_epi32(a0, _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), MIX_GAIN_SHIFT));
+	a1 = _mm_add_epi32(a1, _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), MIX_GAIN_SHIFT));
+	_mm_storeu_si128((__m128i *)(acc + i), a0);
+	_mm_storeu_si128((__m128i *)(acc + i + 4), a1);
+    }
+    accumulate_scalar(acc, src, i, samples, gain_l, gain_r);
+}
+
+static void mix_saturate_sse2(int16_t *dst, const int32_t *acc, int samples)
+{
+    __m128i a0, a1;
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+	a0 = _mm_loadu_si128((const __m128i *)(acc + i));
+	a1 = _mm_loadu_si128((const __m128i *)(acc + i + 4));
+	_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a0, a1));
+    }
+    saturate_scalar(dst, acc, i, samples);
+}
+#endif
+
+#ifdef HAVE_AVX2_KERNEL
+/* The lane split of unpack is undone by pack, so the output is in order. */
+__attribute__((target("avx2")))
+static void mix_gain_avx2(int16_t *dst, const int16_t *src, int samples,
+			  int gain_l, int gain_r)
+{
+    __m256i g = _mm256_set1_epi32((gain_r << 16) | (gain_l & 0xffff));
+    __m256i s, lo, hi, p0, p1;
+    int i;
+
+    for (i = 0; i + 16 <= samples; i += 16) {
+	s = _mm256_loadu_si256((const __m256i *)(src + i));
+	lo = _mm256_mullo_epi16(s, g);
+	hi = _mm256_mulhi_epi16(s, g);
+	p0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), MIX_GAIN_SHIFT);
+	p1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), MIX_GAIN_SHIFT);
+	_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packs_epi32(p0, p1));
+    }
+    gain_scalar(dst, src, i, samples, gain_l, gain_r);
+}
+
+/*
+ * 16 samples per step. The 256-bit unpack/pack instructions work on each
+ * 128-bit lane separately, leaving samples 0-3,8-11 and 4-7,12-15; the
+ * lanes are swapped back so the accumulator keeps natural order, like the
+ * scalar tail that follows.
+ */
+__attribute__((target("avx2")))
+static void mix_accumulate_avx2(int32_t *acc, const int16_t *src, int samples,
+				int gain_l, int gain_r)
+{
+    __m256i g = _mm256_set1_epi32((gain_r << 16) | (gain_l & 0xffff));
+    __m256i s, lo, hi, p0, p1, a0, a1;
+    int i;
+
+    for (i = 0; i + 16 <= samples; i += 16) {
+	s = _mm256_loadu_si256((const __m256i *)(src + i));
+	lo = _mm256_mullo_epi16(s, g);
+	hi = _mm256_mulhi_epi16(s, g);
+	p0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), MIX_GAIN_SHIFT);
+	p1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), MIX_GAIN_SHIFT);
+	a0 = _mm256_loadu_si256((__m256i *)(acc + i));
+	a1 = _mm256_loadu_si256((__m256i *)(acc + i + 8));
+	a0 = _mm256_add_epi32(a0, _mm256_permute2x128_si256(p0, p1, 0x20));
+	a1 = _mm256_add_epi32(a1, _mm256_permute2x128_si256(p0, p1, 0x31));
+	_mm256_storeu_si256((__m256i *)(acc + i), a0);
+	_mm256_storeu_si256((__m256i *)(acc + i + 8), a1);
+    }
+    accumulate_scalar(acc, src, i, samples, gain_l, gain_r);
+}
+
+/* pack interleaves the two inputs per lane, the permute puts them back. */
+__attribute__((target("avx2")))
+static void mix_saturate_avx2(int16_t *dst, const int32_t *acc, int samples)
+{
+    __m256i a0, a1;
+    int i;
+
+    for (i = 0; i + 16 <= samples; i += 16) {
+	a0 = _mm256_loadu_si256((const __m256i *)(acc + i));
+	a1 = _mm256_loadu_si256((const __m256i *)(acc + i + 8));
+	_mm256_storeu_si256((__m256i *)(dst + i),
+			    _mm256_permute4x64_epi64(_mm256_packs_epi32(a0, a1), 0xd8));
+    }
+    saturate_scalar(dst, acc, i, samples);
+}
+#endif
+
+static gain_fn gain = mix_gain_c;
+static accumulate_fn accumulate = mix_accumulate_c;
+static saturate_fn saturate = mix_saturate_c;
+
+void mix_init(void)
+{
+#ifdef __SSE2__
+    gain = mix_gain_sse2;
+    accumulate = mix_accumulate_sse2;
+    saturate = mix_saturate_sse2;
+#endif
+#ifdef HAVE_AVX2_KERNEL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	gain = mix_gain_avx2;
+	accumulate = mix_accumulate_avx2;
+	saturate = mix_saturate_avx2;
+    }
+#endif
+}
+
+void mix_clear(int32_t *acc, int samples)
+{
+    memset(acc, 0, samples * sizeof (*acc));
+}
+
+static int clamp_gain(int g)
+{
+    if (g < 0)
+	return 0;
+    if (g > INT16_MAX)
+	return INT16_MAX;
+    return g;
+}
+
+/* Copies interleaved stereo samples, scaling each channel by its gain. */
+void mix_gain(int16_t *dst, const int16_t *src, int samples,
+	      int gain_l, int gain_r)
+{
+    if (gain_l == MIX_UNITY_GAIN && gain_r == MIX_UNITY_GAIN) {
+	memcpy(dst, src, samples * sizeof (*dst));
+	return;
+    }
+    gain(dst, src, samples, clamp_gain(gain_l), clamp_gain(gain_r));
+}
+
+/* Adds gain-scaled interleaved stereo samples into the accumulator. */
+void mix_accumulate(int32_t *acc, const int16_t *src, int samples,
+		    int gain_l, int gain_r)
+{
+    accumulate(acc, src, samples, clamp_gain(gain_l), clamp_gain(gain_r));
+}
+
+/* Averages each stereo frame down to one mono sample. */
+void mix_downmix(int16_t *mono, const int16_t *stereo, int frames)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i a, b;
+
+    /* madd adds each L/R pair into 32 bits, so the average cannot wrap */
+    for (; i + 8 <= frames; i += 8) {
+	a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(stereo + i * 2)), ones);
+	b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(stereo + i * 2 + 8)), ones);
+	a = _mm_srai_epi32(a, 1);
+	b = _mm_srai_epi32(b, 1);
+	_mm_storeu_si128((__m128i *)(mono + i), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; i < frames; i++)
+	mono[i] = (stereo[i * 2] + stereo[i * 2 + 1]) >> 1;
+}
+
+/* Duplicates each mono sample into both channels. */
+void mix_upmix(int16_t *stereo, const int16_t *mono, int frames)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i m;
+
+    for (; i + 8 <= frames; i += 8) {
+	m = _mm_loadu_si128((const __m128i *)(mono + i));
+	_mm_storeu_si128((__m128i *)(stereo + i * 2), _mm_unpacklo_epi16(m, m));
+	_mm_storeu_si128((__m128i *)(stereo + i * 2 + 8), _mm_unpackhi_epi16(m, m));
+    }
+#endif
+    for (; i < frames; i++)
+	stereo[i * 2] = stereo[i * 2 + 1] = mono[i];
+}
+
+/* Clamps the accumulator back down to 16-bit samples. */
+void mix_saturate(int16_t *dst, const int32_t *acc, int samples)
+{
+    saturate(dst, acc, samples);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MIX_H_
+#define _MIX_H_
+
+#include <stdint.h>
+
+/* Picks the fastest kernels the CPU supports; call once at start up. */
+void mix_init(void);
+
+/* Gains are Q14 fixed point: MIX_UNITY_GAIN leaves a sample untouched. */
+#define MIX_GAIN_SHIFT 14
+#define MIX_UNITY_GAIN (1 << MIX_GAIN_SHIFT)
+
+/* Converts a 0..100 volume, as kept in struct alsa_stream, to a Q14 gain. */
+#define MIX_VOLUME_TO_GAIN(vol) (((vol) * MIX_UNITY_GAIN) / 100)
+
+/*
+ * Samples are always interleaved stereo, so "samples" counts both channels
+ * and must be even. mix_gain() at unity gain on both channels is a memcpy.
+ */
+void mix_gain(int16_t *dst, const int16_t *src, int samples,
+	      int gain_l, int gain_r);
+
+/* Stereo <-> mono conversion for the echo canceller, counted in frames. */
+void mix_downmix(int16_t *mono, const int16_t *stereo, int frames);
+void mix_upmix(int16_t *stereo, const int16_t *mono, int frames);
+
+/*
+ * Mixing works on a 32-bit accumulator holding interleaved stereo samples,
+ * in the same order as the 16-bit samples, whichever kernel mix_init()
+ * selected. Sources of any (even) length can be accumulated into it.
+ */
+void mix_clear(int32_t *acc, int samples);
+void mix_accumulate(int32_t *acc, const int16_t *src, int samples,
+		    int gain_l, int gain_r);
+void mix_saturate(int16_t *dst, const int32_t *acc, int samples);
+
+#endif
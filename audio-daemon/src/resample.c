@@ -0,0 +1,218 @@
+/*
+ * resample.c:
+ *
+ * Polyphase sample rate conversion.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <alloca.h>
+
+#include "resample.h"
+
+/*
+ * Conversion from in_rate to out_rate is done as upsampling by "up",
+ * low-pass filtering and downsampling by "down", where up/down is
+ * out_rate/in_rate in lowest terms. Only the filter outputs that survive
+ * the downsampling are computed: each one is a RESAMPLE_TAPS long dot
+ * product against one of the "up" phases of the filter. When downsampling
+ * the filter is made proportionally longer so its cutoff stays sharp.
+ *
+ * Coefficients are Q14 and every phase sums to unity, so the sum of their
+ * magnitudes stays well under 4 and a 32-bit accumulator cannot overflow.
+ */
+#define RESAMPLE_TAPS 16
+#define RESAMPLE_COEF_SHIFT 14
+
+struct resampler {
+    int up;
+    int down;
+    int pos;		/* next output, in 1/up input frames from buf[taps] */
+    int max_in;
+    int taps;
+    int16_t *coef;	/* up phases of taps coefficients */
+    int16_t *buf;	/* taps old frames, then the new block */
+};
+
+static int gcd(int a, int b)
+{
+    int t;
+
+    while (b) {
+	t = a % b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+static int floor_div(int a, int b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static int16_t clamp16(int32_t v)
+{
+    if (v > INT16_MAX)
+	return INT16_MAX;
+    if (v < INT16_MIN)
+	return INT16_MIN;
+    return v;
+}
+
+/* Blackman windowed sinc, t in input frames, cutoff fc in cycles/frame */
+static double kernel(double t, double fc, int taps)
+{
+    double half = taps / 2;
+    double x, w;
+
+    if (fabs(t) >= half)
+	return 0.0;
+
+    w = 0.42 + 0.5 * cos(M_PI * t / half) + 0.08 * cos(2.0 * M_PI * t / half);
+    x = 2.0 * fc * t;
+    if (fabs(x) < 1e-9)
+	return 2.0 * fc * w;
+    return 2.0 * fc * sin(M_PI * x) / (M_PI * x) * w;
+}
+
+static void build_filter(struct resampler *rs)
+{
+    double *h;
+    double fc, sum;
+    int p, j;
+
+    /* Stay below the lower of the two Nyquist frequencies */
+    fc = 0.46;
+    if (rs->up < rs->down)
+	fc = fc * rs->up / rs->down;
+
+    h = alloca(rs->taps * sizeof (*h));
+    for (p = 0; p < rs->up; p++) {
+	sum = 0.0;
+	for (j = 0; j < rs->taps; j++) {
+	    h[j] = kernel(j + (double)p / rs->up - rs->taps / 2, fc, rs->taps);
+	    sum += h[j];
+	}
+	for (j = 0; j < rs->taps; j++)
+	    rs->coef[p * rs->taps + j] =
+		lrint(h[j] / sum * (1 << RESAMPLE_COEF_SHIFT));
+    }
+}
+
+struct resampler *resampler_new(int in_rate, int out_rate, int max_in)
+{
+    struct resampler *rs;
+    int g;
+
+    if (in_rate <= 0 || out_rate <= 0 || max_in <= 0)
+	return NULL;
+
+    rs = calloc(1, sizeof (*rs));
+    if (!rs)
+	return NULL;
+
+    g = gcd(in_rate, out_rate);
+    rs->up = out_rate / g;
+    rs->down = in_rate / g;
+    rs->max_in = max_in;
+    rs->taps = RESAMPLE_TAPS * ((rs->down + rs->up - 1) / rs->up);
+
+    rs->coef = malloc(rs->up * rs->taps * sizeof (*rs->coef));
+    rs->buf = calloc((rs->taps + max_in) * 2, sizeof (*rs->buf));
+    if (!rs->coef || !rs->buf) {
+	resampler_free(rs);
+	return NULL;
+    }
+
+    build_filter(rs);
+    return rs;
+}
+
+void resampler_free(struct resampler *rs)
+{
+    if (!rs)
+	return;
+    free(rs->coef);
+    free(rs->buf);
+    free(rs);
+}
+
+void resampler_reset(struct resampler *rs)
+{
+    rs->pos = 0;
+    memset(rs->buf, 0, rs->taps * 2 * sizeof (*rs->buf));
+}
+
+int resample_needed(struct resampler *rs, int out_frames)
+{
+    if (out_frames <= 0)
+	return 0;
+    return floor_div(rs->pos + (out_frames - 1) * rs->down, rs->up) + 1;
+}
+
+/*
+ * max_out only guards the output buffer: it must be at least what
+ * in_frames produces, which is always the case for in_frames taken from
+ * resample_needed().
+ */
+int resample(struct resampler *rs, const int16_t *in, int in_frames,
+	     int16_t *out, int max_out)
+{
+    const int16_t *c, *x;
+    int32_t l, r;
+    int n, p, j;
+    int produced = 0;
+
+    if (in_frames < 0 || in_frames > rs->max_in)
+	return -1;
+
+    memcpy(rs->buf + rs->taps * 2, in, in_frames * 2 * sizeof (*in));
+
+    while (produced < max_out) {
+	n = floor_div(rs->pos, rs->up);
+	if (n >= in_frames)
+	    break;
+	p = rs->pos - n * rs->up;
+
+	c = rs->coef + p * rs->taps;
+	x = rs->buf + (rs->taps + n) * 2;
+	l = r = 1 << (RESAMPLE_COEF_SHIFT - 1);
+	for (j = 0; j < rs->taps; j++) {
+	    l += c[j] * x[-2 * j];
+	    r += c[j] * x[-2 * j + 1];
+	}
+	out[produced * 2] = clamp16(l >> RESAMPLE_COEF_SHIFT);
+	out[produced * 2 + 1] = clamp16(r >> RESAMPLE_COEF_SHIFT);
+
+	produced++;
+	rs->pos += rs->down;
+    }
+
+    /* Keep the tail of this block as history for the next one */
+    rs->pos -= in_frames * rs->up;
+    memmove(rs->buf, rs->buf + in_frames * 2,
+	    rs->taps * 2 * sizeof (*rs->buf));
+
+    return produced;
+}
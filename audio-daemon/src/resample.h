@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+
+struct resampler;
+
+/*
+ * Polyphase FIR rate converter for interleaved S16 stereo. It is fed whole
+ * blocks: every input frame passed to resample() is consumed, and up to
+ * max_out frames are produced. resample_needed() says how many input frames
+ * produce exactly out_frames, for callers that are paced by the output.
+ * max_in bounds the input block size.
+ */
+struct resampler *resampler_new(int in_rate, int out_rate, int max_in);
+void resampler_free(struct resampler *rs);
+void resampler_reset(struct resampler *rs);
+int resample_needed(struct resampler *rs, int out_frames);
+int resample(struct resampler *rs, const int16_t *in, int in_frames,
+	     int16_t *out, int max_out);
+
+#endif
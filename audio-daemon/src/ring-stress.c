@@ -0,0 +1,178 @@
+/*
+ * ring-stress.c:
+ *
+ * Two threads hammering both directions of a struct ring_t, one playing
+ * the guest and one the backend. Build with "make ring-stress".
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "ring.h"
+
+#define DEFAULT_RECORDS 2000000
+#define BATCH 16
+#define MAX_RECORD 64
+
+/*
+ * Records carry a sequence number and a pattern derived from it, so any
+ * lost, duplicated, reordered or torn record is caught. Sizes that do not
+ * divide XC_RING_SIZE make records straddle the end of the buffer.
+ */
+struct record {
+    uint32_t seq;
+    uint8_t fill[MAX_RECORD - sizeof (uint32_t)];
+};
+
+static struct ring_t ring;
+static unsigned int record_size;
+static unsigned long records;
+static int failed = 0;
+
+static void fill_record(struct record *r, uint32_t seq)
+{
+    unsigned int i;
+
+    r->seq = seq;
+    for (i = 0; i < record_size - sizeof (r->seq); i++)
+	r->fill[i] = seq * 31 + i;
+}
+
+static int check_record(struct record *r, uint32_t seq, const char *dir)
+{
+    unsigned int i;
+
+    if (r->seq != seq) {
+	printf("%s: expected record %u, got %u\n", dir, seq, r->seq);
+	return -1;
+    }
+    for (i = 0; i < record_size - sizeof (r->seq); i++) {
+	if (r->fill[i] != (uint8_t)(seq * 31 + i)) {
+	    printf("%s: record %u torn at byte %u\n", dir, seq, i);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* Guest side: produces requests, consumes replies. */
+static void *guest_thread(void *arg)
+{
+    struct record out, in[BATCH];
+    char buf[BATCH * MAX_RECORD];
+    uint32_t sent = 0, received = 0;
+    int n, i, rc;
+
+    while (received < records && !failed) {
+	if (sent < records) {
+	    fill_record(&out, sent);
+	    rc = ring_produce(ring.req, &ring.req_cons, &ring.req_prod,
+			      &out, record_size);
+	    if (rc == 0)
+		sent++;
+	    else if (rc != -EAGAIN)
+		goto fail;
+	}
+
+	n = ring_consume(ring.rsp, &ring.rsp_cons, &ring.rsp_prod,
+			 buf, record_size, BATCH);
+	if (n < 0)
+	    goto fail;
+	for (i = 0; i < n; i++) {
+	    memcpy(&in[i], buf + i * record_size, record_size);
+	    if (check_record(&in[i], received++, "rsp"))
+		goto fail;
+	}
+	if (n == 0)
+	    sched_yield();
+    }
+    return NULL;
+
+fail:
+    failed = 1;
+    return NULL;
+}
+
+/* Backend side: drains requests in batches, echoes each one back. */
+static void *backend_thread(void *arg)
+{
+    struct record rec;
+    char buf[BATCH * MAX_RECORD];
+    uint32_t received = 0;
+    int n, i, rc;
+
+    while (received < records && !failed) {
+	n = ring_read_batch(&ring, buf, record_size, BATCH);
+	if (n < 0)
+	    goto fail;
+	for (i = 0; i < n; i++) {
+	    memcpy(&rec, buf + i * record_size, record_size);
+	    if (check_record(&rec, received++, "req"))
+		goto fail;
+	    /* A full reply ring pushes back on us, never drops */
+	    while ((rc = ring_write(&ring, &rec, record_size)) == -EAGAIN) {
+		if (failed)
+		    return NULL;
+		sched_yield();
+	    }
+	    if (rc)
+		goto fail;
+	}
+	if (n == 0)
+	    sched_yield();
+    }
+    return NULL;
+
+fail:
+    failed = 1;
+    return NULL;
+}
+
+static int run(unsigned int size)
+{
+    pthread_t guest, backend;
+
+    record_size = size;
+    ring_init(&ring);
+
+    pthread_create(&guest, NULL, guest_thread, NULL);
+    pthread_create(&backend, NULL, backend_thread, NULL);
+    pthread_join(guest, NULL);
+    pthread_join(backend, NULL);
+
+    printf("%2u byte records x %lu: %s\n", size, records,
+	   failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    records = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_RECORDS;
+
+    /* struct fe_cmd, then sizes that wrap mid-record */
+    if (run(16) || run(12) || run(28) || run(MAX_RECORD))
+	return 1;
+    return 0;
+}
@@ -16,110 +16,133 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <string.h>
+
 #include "ring.h"
 #include "mb.h"
 
+/*
+ * Each direction of the ring is single producer / single consumer: the
+ * guest produces requests and consumes replies, we do the opposite. An
+ * index is only ever written by its owner, and is published with a
+ * release store after the data it covers; the other side reads it with
+ * an acquire load before touching that data. Records are never split:
+ * a read or write either moves the whole thing or nothing, so a full or
+ * empty ring is just "try again later" rather than a torn command.
+ */
+
 static int ring_check_indexes(XC_RING_IDX cons, XC_RING_IDX prod)
 {
 	return ((prod - cons) <= XC_RING_SIZE);
 }
-static void *ring_get_output_chunk(XC_RING_IDX cons,
-			      XC_RING_IDX prod,
-			      char *buf, uint32_t *len)
-{
-	*len = XC_RING_SIZE - MASK_XC_RING_IDX(prod);
-	if ((XC_RING_SIZE - (prod - cons)) < *len)
-		*len = XC_RING_SIZE - (prod - cons);
-	return buf + MASK_XC_RING_IDX(prod);
-}
 
-static const void *ring_get_input_chunk(XC_RING_IDX cons,
-				   XC_RING_IDX prod,
-				   const char *buf, uint32_t *len)
+static void ring_copy_in(char *buf, XC_RING_IDX prod,
+			 const void *data, unsigned int len)
 {
-	*len = XC_RING_SIZE - MASK_XC_RING_IDX(cons);
-	if ((prod - cons) < *len)
-		*len = prod - cons;
-	return buf + MASK_XC_RING_IDX(cons);
+	unsigned int chunk = XC_RING_SIZE - MASK_XC_RING_IDX(prod);
+
+	if (chunk > len)
+		chunk = len;
+	memcpy(buf + MASK_XC_RING_IDX(prod), data, chunk);
+	memcpy(buf, (const char *)data + chunk, len - chunk);
 }
 
-int ring_data_to_read(struct ring_t *intf)
+static void ring_copy_out(void *data, const char *buf, XC_RING_IDX cons,
+			  unsigned int len)
 {
-	return (intf->req_cons != intf->req_prod);
+	unsigned int chunk = XC_RING_SIZE - MASK_XC_RING_IDX(cons);
+
+	if (chunk > len)
+		chunk = len;
+	memcpy(data, buf + MASK_XC_RING_IDX(cons), chunk);
+	memcpy((char *)data + chunk, buf, len - chunk);
 }
-int ring_write(struct ring_t *intf, const void *data, unsigned int len)
+
+/*
+ * Writes len bytes to buf as the producer. Returns 0, or -EAGAIN when
+ * there is not room for all of it yet, or -EIO if the indexes are bad.
+ */
+int ring_produce(char *buf, XC_RING_IDX *cons_p, XC_RING_IDX *prod_p,
+		 const void *data, unsigned int len)
 {
 	XC_RING_IDX cons, prod;
-	int rc;
 
-	if ((intf->rsp_prod - intf->rsp_cons) == XC_RING_SIZE)
-		return -1;
+	prod = *prod_p;
+	cons = load_acquire(cons_p);
+	if (!ring_check_indexes(cons, prod))
+		return -EIO;
+	if (XC_RING_SIZE - (prod - cons) < len)
+		return -EAGAIN;
 
-	while (len != 0) {
-		void *dst;
-		unsigned int avail;
+	ring_copy_in(buf, prod, data, len);
+	store_release(prod_p, prod + len);
 
-		cons = intf->rsp_cons;
-		prod = intf->rsp_prod;
-		if (!ring_check_indexes(cons, prod)) {
-			intf->rsp_cons = intf->rsp_prod = 0;
-			return -1;
-		}
-		dst = ring_get_output_chunk(cons, prod, intf->rsp, &avail);
-		if (avail < len)
-			return -1; /* FIXME ! wait here ? */
-		if (avail > len)
-			avail = len;
+	return 0;
+}
 
-		mb();
+/*
+ * Reads up to max records of size bytes from buf as the consumer, and
+ * releases them all with a single index update. Returns the number of
+ * records read, or -EIO if the indexes are bad.
+ */
+int ring_consume(const char *buf, XC_RING_IDX *cons_p, XC_RING_IDX *prod_p,
+		 void *data, unsigned int size, unsigned int max)
+{
+	XC_RING_IDX cons, prod;
+	unsigned int n;
 
-		memcpy(dst, data, avail);
-		data += avail;
-		len -= avail;
+	cons = *cons_p;
+	prod = load_acquire(prod_p);
+	if (!ring_check_indexes(cons, prod))
+		return -EIO;
 
-		wmb();
-		intf->rsp_prod += avail;
+	n = (prod - cons) / size;
+	if (n > max)
+		n = max;
+	if (n == 0)
+		return 0;
 
-	}
+	ring_copy_out(data, buf, cons, n * size);
+	store_release(cons_p, cons + n * size);
 
-	return 0;
+	return n;
 }
 
-int ring_read(struct ring_t *intf, void *data, unsigned len)
+int ring_data_to_read(struct ring_t *intf)
 {
-	XC_RING_IDX cons, prod;
-	int rc = len;
-
-	while (len != 0) {
-		unsigned int avail;
-		const char *src;
+	return (intf->req_cons != load_acquire(&intf->req_prod));
+}
 
-		if (!ring_data_to_read(intf))
-			return 0;
+int ring_write(struct ring_t *intf, const void *data, unsigned int len)
+{
+	int rc;
 
-		cons = intf->req_cons;
-		prod = intf->req_prod;
-		if (!ring_check_indexes(cons, prod)) {
-			intf->req_cons = intf->req_prod = 0;
-			return -1;
-		}
+	rc = ring_produce(intf->rsp, &intf->rsp_cons, &intf->rsp_prod,
+			  data, len);
+	if (rc == -EIO)
+		intf->rsp_cons = intf->rsp_prod = 0;
 
-		src = ring_get_input_chunk(cons, prod, intf->req, &avail);
-		if (avail == 0)
-			continue;
-		if (avail > len)
-			avail = len;
+	return rc;
+}
 
-		rmb();
+/* Returns len if a whole record was read, 0 if none is there yet. */
+int ring_read(struct ring_t *intf, void *data, unsigned len)
+{
+	int rc;
 
-		memcpy(data, src, avail);
-		data += avail;
-		len -= avail;
+	rc = ring_read_batch(intf, data, len, 1);
+	return rc > 0 ? (int)len : rc;
+}
 
-		mb();
-		intf->req_cons += avail;
+int ring_read_batch(struct ring_t *intf, void *data, unsigned int size,
+		    unsigned int max)
+{
+	int rc;
 
-	}
+	rc = ring_consume(intf->req, &intf->req_cons, &intf->req_prod,
+			  data, size, max);
+	if (rc == -EIO)
+		intf->req_cons = intf->req_prod = 0;
 
 	return rc;
 }
@@ -128,10 +151,5 @@ void ring_init(struct ring_t *intf)
 {
 	intf->rsp_cons = intf->rsp_prod = 0;
 	intf->req_cons = intf->req_prod = 0;
+	mb();
 }
-
-
-
-
-
-
@@ -20,6 +20,7 @@
 #define _XC_RING_H_
 
 #include <stdint.h>
+#include <errno.h>
 
 typedef uint32_t XC_RING_IDX;
 #define XC_RING_SIZE 1024
@@ -35,7 +36,15 @@ struct ring_t {
 void ring_init(struct ring_t *intf);
 int ring_data_to_read(struct ring_t *intf);
 int ring_read(struct ring_t *intf, void *data, unsigned len);
+int ring_read_batch(struct ring_t *intf, void *data, unsigned int size,
+		    unsigned int max);
 int ring_write(struct ring_t *intf, const void *data, unsigned int len);
 
+/* One direction of a ring, for either end of it */
+int ring_produce(char *buf, XC_RING_IDX *cons_p, XC_RING_IDX *prod_p,
+		 const void *data, unsigned int len);
+int ring_consume(const char *buf, XC_RING_IDX *cons_p, XC_RING_IDX *prod_p,
+		 void *data, unsigned int size, unsigned int max);
+
 #endif
 
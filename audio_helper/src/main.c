@@ -38,6 +38,7 @@ void help(int argc, char *argv[])
     openxt_info("\n");
     openxt_info("Available Commands:\n");
     openxt_info("    <stubdomid>            start audio backend for guest with stubdomid=<stubdomid>\n");
+    openxt_info("    daemon                 start audio backend for every guest, in one process\n");
     openxt_info("    unittest               run audio backend unittest\n");
     openxt_info("    scontrols              show all mixer simple controls\n");
     openxt_info("    scontents              show contents of all mixer simple controls (default command)\n");
@@ -31,6 +31,11 @@
 
 static char device[256] = "default";
 
+// When shared, every settings structure uses the same mixer handle
+static bool share_mixer = false;
+static snd_mixer_t *shared_mhandle = NULL;
+static int32_t shared_mhandle_refs = 0;
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Global Functions                                                                                    //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -85,6 +90,21 @@ int openxt_alsa_set_device(char *name)
     return 0;
 }
 
+///
+/// Share one mixer handle between all of the settings structures, rather
+/// than opening one each. Only useful when they all use the same card.
+///
+/// @param share true to share the mixer handle
+/// @return 0 on success
+///
+int openxt_alsa_set_shared_mixer(bool share)
+{
+    share_mixer = share;
+
+    // Done
+    return 0;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Settings Functions                                                                                  //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -182,6 +202,7 @@ int openxt_alsa_fini(Settings *settings)
 int openxt_alsa_init(Settings *settings)
 {
     int ret;
+    snd_pcm_uframes_t buffer_size;
     snd_pcm_hw_params_t *hw_params = NULL;
 
     // Sanity checks
@@ -217,7 +238,14 @@ int openxt_alsa_init(Settings *settings)
     // that figured out.
     ret = snd_pcm_hw_params_any(settings->handle, hw_params);
     openxt_assert_goto(ret == 0, failure);
-    ret = snd_pcm_hw_params_set_access(settings->handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+
+    // Map the PCM's buffer if it can be, so samples can go between it and
+    // V4V without a copy in between (see openxt_alsa_mmap_begin). A mapped
+    // PCM has to be read and written with the snd_pcm_mmap_* calls, which
+    // openxt_alsa_readi / openxt_alsa_writei take care of.
+    settings->mmap = (snd_pcm_hw_params_test_access(settings->handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0);
+
+    ret = snd_pcm_hw_params_set_access(settings->handle, hw_params, settings->mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED);
     openxt_assert_goto(ret == 0, failure);
     ret = snd_pcm_hw_params_set_format(settings->handle, hw_params, settings->fmt);
     openxt_assert_goto(ret == 0, failure);
@@ -239,6 +267,10 @@ int openxt_alsa_init(Settings *settings)
     openxt_assert_goto(ret == 0, failure);
     ret = snd_pcm_hw_params_get_channels(hw_params, &settings->nchannels);
     openxt_assert_goto(ret == 0, failure);
+    ret = snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_size);
+    openxt_assert_goto(ret == 0, failure);
+
+    settings->buffer_size = buffer_size;
 
     // Cleanup
     snd_pcm_hw_params_free(hw_params);
@@ -363,6 +395,55 @@ int openxt_alsa_get_available(Settings *settings)
     return ret;
 }
 
+///
+/// Get the delay of the PCM. For playback, this is how many samples from now
+/// a sample written now will be heard. For capture, it is how long ago the
+/// next sample to be read was recorded.
+///
+/// @param settings a pointer to the settings structure
+/// @return -EINVAL settings == NULL
+///         -EINVAL PCM closed
+///         negative error code on failure
+///         delay in samples on success
+///         0 on failure, or if the PCM is not running
+///
+int openxt_alsa_get_delay(Settings *settings)
+{
+    int ret;
+    snd_pcm_sframes_t delay = 0;
+
+    // Sanity checks
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    // See openxt_alsa_get_available
+    while(1) {
+
+        if ((ret = snd_pcm_delay(settings->handle, &delay)) < 0) {
+
+            // Check for EPIPE (xrun / suspended). If this is the case, we
+            // restart ALSA and try again.
+            if (ret == -EPIPE) {
+                ret = openxt_alsa_prepare(settings);
+                openxt_assert_ret(ret == 0, ret, ret);
+                continue;
+            }
+
+            // A PCM that is prepared but not started yet has no delay.
+            if (ret != -EBADFD)
+                openxt_error("snd_pcm_delay failed: %d - %s\n", ret, snd_strerror(ret));
+
+            delay = 0;
+        }
+
+        // Done
+        break;
+    }
+
+    // Return the number of samples
+    return max(delay, (snd_pcm_sframes_t)0);
+}
+
 ///
 /// Write samples to the PCM
 ///
@@ -392,7 +473,13 @@ int openxt_alsa_writei(Settings *settings, void *buffer, int32_t num, int32_t si
     // try again, and this provides an easy way to do that.
     while(1) {
 
-        if ((ret = snd_pcm_writei(settings->handle, buffer, num)) < 0) {
+        // A mapped PCM only takes the mmap variant
+        if (settings->mmap == true)
+            ret = snd_pcm_mmap_writei(settings->handle, buffer, num);
+        else
+            ret = snd_pcm_writei(settings->handle, buffer, num);
+
+        if (ret < 0) {
 
             // Check for EPIPE (xrun / suspended). If this is the case, we
             // restart ALSA and try again.
@@ -452,7 +539,13 @@ int openxt_alsa_readi(Settings *settings, void *buffer, int32_t num, int32_t siz
     // try again, and this provides an easy way to do that.
     while(1) {
 
-        if ((ret = snd_pcm_readi(settings->handle, buffer, num)) < 0) {
+        // A mapped PCM only takes the mmap variant
+        if (settings->mmap == true)
+            ret = snd_pcm_mmap_readi(settings->handle, buffer, num);
+        else
+            ret = snd_pcm_readi(settings->handle, buffer, num);
+
+        if (ret < 0) {
 
             // Check for EPIPE (xrun / suspended). If this is the case, we
             // restart ALSA and try again.
@@ -483,10 +576,275 @@ int openxt_alsa_readi(Settings *settings, void *buffer, int32_t num, int32_t siz
     return ret;
 }
 
+///
+/// Get direct access to the PCM's buffer. For playback this is where the
+/// next samples to be played go, and for capture it holds the next samples
+/// that were recorded. Only the part of the buffer up to where it wraps is
+/// given, so there may be fewer samples than are available. Once the samples
+/// have been written / read, they are handed over with
+/// openxt_alsa_mmap_commit.
+///
+/// @param settings a pointer to the settings structure
+/// @param area set to the first sample, if there are any
+/// @param offset set to what openxt_alsa_mmap_commit needs
+/// @param num the most samples wanted
+/// @return -EINVAL settings == NULL
+///         -EINVAL area == NULL
+///         -EINVAL offset == NULL
+///         -EINVAL PCM closed
+///         negative error code on failure
+///         number of samples on success, 0 if the buffer is not mapped
+///
+int openxt_alsa_mmap_begin(Settings *settings, void **area, int32_t *offset, int32_t num)
+{
+    int ret;
+    snd_pcm_sframes_t avail;
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t first;
+    const snd_pcm_channel_area_t *areas;
+
+    // Sanity checks
+    openxt_checkp(area, -EINVAL);
+    openxt_checkp(offset, -EINVAL);
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    *area = NULL;
+    *offset = 0;
+
+    // Nothing to do
+    if (settings->mmap == false || num <= 0)
+        return 0;
+
+    // Reading would start a capture PCM, so it has to be done by hand
+    if (settings->stream == SND_PCM_STREAM_CAPTURE &&
+        snd_pcm_state(settings->handle) == SND_PCM_STATE_PREPARED) {
+        ret = openxt_alsa_start(settings);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    // See openxt_alsa_get_available
+    while(1) {
+
+        if ((avail = snd_pcm_avail_update(settings->handle)) < 0) {
+
+            // Check for EPIPE (xrun / suspended). If this is the case, we
+            // restart ALSA and try again.
+            if (avail == -EPIPE) {
+                ret = openxt_alsa_prepare(settings);
+                openxt_assert_ret(ret == 0, ret, ret);
+                continue;
+            }
+
+            // A PCM that is not prepared has no buffer to give
+            if (avail == -EBADFD)
+                return 0;
+
+            // If we got this far, we got have an error.
+            openxt_error("snd_pcm_avail_update failed: %d - %s\n", (int)avail, snd_strerror(avail));
+            return avail;
+        }
+
+        // Done
+        break;
+    }
+
+    frames = min(avail, (snd_pcm_sframes_t)num);
+
+    // Nothing available
+    if (frames == 0)
+        return 0;
+
+    ret = snd_pcm_mmap_begin(settings->handle, &areas, &first, &frames);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // The samples are interleaved, so the first channel's area covers them all
+    *area = (char *)areas[0].addr + (areas[0].first + first * areas[0].step) / 8;
+    *offset = first;
+
+    // Done
+    return frames;
+}
+
+///
+/// Hand samples written to / read from the PCM's buffer over to ALSA. A
+/// playback PCM that is not running yet is started, like writing would.
+///
+/// @param settings a pointer to the settings structure
+/// @param offset what openxt_alsa_mmap_begin gave
+/// @param num the number of samples written / read
+/// @return -EINVAL settings == NULL
+///         -EINVAL PCM closed
+///         negative error code on failure
+///         number of samples committed on success
+///
+int openxt_alsa_mmap_commit(Settings *settings, int32_t offset, int32_t num)
+{
+    int ret;
+    snd_pcm_sframes_t committed;
+
+    // Sanity checks
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    // No need to run this if we are committing 0 samples
+    if (num <= 0)
+        return 0;
+
+    committed = snd_pcm_mmap_commit(settings->handle, offset, num);
+
+    // An xrun since openxt_alsa_mmap_begin loses the samples
+    if (committed == -EPIPE) {
+        ret = openxt_alsa_prepare(settings);
+        openxt_assert_ret(ret == 0, ret, ret);
+        return 0;
+    }
+
+    openxt_assert_ret(committed >= 0, (int)committed, committed);
+
+    if (settings->stream == SND_PCM_STREAM_PLAYBACK &&
+        snd_pcm_state(settings->handle) == SND_PCM_STATE_PREPARED) {
+        ret = openxt_alsa_start(settings);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    // Done
+    return committed;
+}
+
+///
+/// Get the file descriptors to poll on to find out when the PCM is ready to
+/// be read from / written to. An unopened PCM has none.
+///
+/// @param settings a pointer to the settings structure
+/// @param fds array to fill in
+/// @param count the number of entries in fds
+/// @return -EINVAL settings == NULL
+///         -EINVAL fds == NULL
+///         -ENOSPC count is too small
+///         negative error code on failure
+///         number of entries filled in on success
+///
+int openxt_alsa_poll_descriptors(Settings *settings, struct pollfd *fds, int32_t count)
+{
+    int ret;
+
+    // Sanity checks
+    openxt_checkp(fds, -EINVAL);
+    openxt_checkp(settings, -EINVAL);
+
+    // Nothing to wait on
+    if (settings->handle == NULL)
+        return 0;
+
+    ret = snd_pcm_poll_descriptors_count(settings->handle);
+    openxt_assert_ret(ret >= 0, ret, ret);
+    openxt_assert(ret <= count, -ENOSPC);
+
+    // Done
+    return snd_pcm_poll_descriptors(settings->handle, fds, ret);
+}
+
+///
+/// Translate what poll returned for the PCM's file descriptors into the
+/// events for the PCM itself. Plugins like dmix poll on fds that have
+/// nothing to do with the direction of the stream, so this must be used
+/// rather than looking at the revents directly.
+///
+/// @param settings a pointer to the settings structure
+/// @param fds the entries filled in by openxt_alsa_poll_descriptors
+/// @param count the number of entries in fds
+/// @return -EINVAL settings == NULL
+///         -EINVAL fds == NULL
+///         -EINVAL PCM closed
+///         negative error code on failure
+///         poll events (POLLIN, POLLOUT, POLLERR) on success
+///
+int openxt_alsa_poll_revents(Settings *settings, struct pollfd *fds, int32_t count)
+{
+    int ret;
+    unsigned short revents = 0;
+
+    // Sanity checks
+    openxt_checkp(fds, -EINVAL);
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    ret = snd_pcm_poll_descriptors_revents(settings->handle, fds, count, &revents);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // Done
+    return revents;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Simple Element Functions                                                                            //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+///
+/// Converts a percentage (0-100) to a value in the range cached by
+/// openxt_alsa_mixer_sget.
+///
+static long openxt_alsa_mixer_volume_value(Settings *settings, int32_t vol)
+{
+    return round(((double)((settings->volume_max - settings->volume_min) * vol)) / 100.0);
+}
+
+///
+/// Called by ALSA while it handles the mixer's events. A removed element
+/// is freed once this returns, so the cached pointer has to go with it, and
+/// the next openxt_alsa_mixer_sget() looks the element up again. A changed
+/// value drops the cached volume / switch, unless it is the one we set.
+///
+static int openxt_alsa_mixer_elem_event(snd_mixer_elem_t *elem, unsigned int mask)
+{
+    long value = 0;
+    int enabled = 0;
+    Settings *settings = snd_mixer_elem_get_callback_private(elem);
+
+    if (settings == NULL)
+        return 0;
+
+    if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+        settings->elem = NULL;
+        return 0;
+    }
+
+    if ((mask & SND_CTL_EVENT_MASK_VALUE) == 0)
+        return 0;
+
+    switch(settings->volume_type) {
+        case 'P':
+            snd_mixer_selem_get_playback_volume(elem, SND_MIXER_SCHN_MONO, &value);
+            break;
+        case 'C':
+            snd_mixer_selem_get_capture_volume(elem, SND_MIXER_SCHN_MONO, &value);
+            break;
+        default:
+            break;
+    }
+
+    if (settings->volume >= 0 &&
+        value != openxt_alsa_mixer_volume_value(settings, settings->volume))
+        settings->volume = -1;
+
+    switch(settings->switch_type) {
+        case 'P':
+            snd_mixer_selem_get_playback_switch(elem, SND_MIXER_SCHN_MONO, &enabled);
+            break;
+        case 'C':
+            snd_mixer_selem_get_capture_switch(elem, SND_MIXER_SCHN_MONO, &enabled);
+            break;
+        default:
+            break;
+    }
+
+    if (settings->enabled >= 0 && enabled != settings->enabled)
+        settings->enabled = -1;
+
+    return 0;
+}
+
 ///
 /// Initialize the mixer
 ///
@@ -503,6 +861,23 @@ int openxt_alsa_mixer_fini(Settings *settings)
     // Sanity checks
     openxt_checkp(settings, -EINVAL);
 
+    // Someone else is still using the shared mixer handle
+    if (settings->mhandle != NULL && settings->mhandle == shared_mhandle) {
+
+        // The element outlives us, so stop it calling back into settings
+        if (settings->elem != NULL)
+            snd_mixer_elem_set_callback(settings->elem, NULL);
+
+        settings->elem = NULL;
+
+        if (--shared_mhandle_refs > 0) {
+            settings->mhandle = NULL;
+            return 0;
+        }
+
+        shared_mhandle = NULL;
+    }
+
     // Cleanup
     if (settings->mhandle != NULL){
 
@@ -515,6 +890,7 @@ int openxt_alsa_mixer_fini(Settings *settings)
 
     // Reset
     settings->mhandle = NULL;
+    settings->elem = NULL;
 
     // Done
     return ret;
@@ -538,6 +914,20 @@ int openxt_alsa_mixer_init(Settings *settings)
     openxt_checkp(settings, -EINVAL);
     openxt_assert_quiet(settings->mhandle == NULL, 0);
 
+    // Use the shared handle if there is one. Its events have to be handled
+    // first, to pick up the elements added since it was loaded (softvol adds
+    // one the first time a PCM that uses it is opened).
+    if (share_mixer == true && shared_mhandle != NULL) {
+
+        ret = snd_mixer_handle_events(shared_mhandle);
+        openxt_assert_ret(ret >= 0, ret, ret);
+
+        settings->mhandle = shared_mhandle;
+        shared_mhandle_refs++;
+
+        return 0;
+    }
+
     // Setup the handle
     ret = snd_mixer_open(&settings->mhandle, 0);
     openxt_assert_goto(ret == 0, falure);
@@ -548,6 +938,12 @@ int openxt_alsa_mixer_init(Settings *settings)
     ret = snd_mixer_load(settings->mhandle);
     openxt_assert_goto(ret == 0, falure);
 
+    // This is the handle everyone else gets from now on
+    if (share_mixer == true) {
+        shared_mhandle = settings->mhandle;
+        shared_mhandle_refs = 1;
+    }
+
     // Success
     return 0;
 
@@ -850,6 +1246,11 @@ int openxt_alsa_mixer_sget(Settings *settings)
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->mhandle, -EINVAL);
 
+    // The element is looked up once, and kept until ALSA removes it or the
+    // mixer is closed.
+    if (settings->elem != NULL)
+        return 0;
+
     // Create a simple element id. For whatever reason, if you want to search
     // for a simple element, you need to define the selement id, and then set
     // the name there so that you can do the search
@@ -865,17 +1266,53 @@ int openxt_alsa_mixer_sget(Settings *settings)
 
     // Get the simple element
     settings->elem = snd_mixer_find_selem(settings->mhandle, selem_id);
-    openxt_checkp_goto(settings->elem, failure);
+    snd_mixer_selem_id_free(selem_id);
+    openxt_checkp(settings->elem, -ENOENT);
+
+    // Work out which volume and switch this element has, and the range that
+    // ALSA has setup for the volume, so that setting either one later on is
+    // a single call.
+    settings->volume_type = 0;
+    settings->switch_type = 0;
+    settings->volume_min = 0;
+    settings->volume_max = 0;
+
+    if (snd_mixer_selem_has_common_volume(settings->elem) == 1 ||
+        snd_mixer_selem_has_playback_volume(settings->elem) == 1) {
+        settings->volume_type = 'P';
+        ret = snd_mixer_selem_get_playback_volume_range(settings->elem, &settings->volume_min, &settings->volume_max);
+        openxt_assert_goto(ret == 0, failure);
+    }
+    else if (snd_mixer_selem_has_capture_volume(settings->elem) == 1) {
+        settings->volume_type = 'C';
+        ret = snd_mixer_selem_get_capture_volume_range(settings->elem, &settings->volume_min, &settings->volume_max);
+        openxt_assert_goto(ret == 0, failure);
+    }
+
+    if (snd_mixer_selem_has_common_switch(settings->elem) == 1 ||
+        snd_mixer_selem_has_playback_switch(settings->elem) == 1) {
+        settings->switch_type = 'P';
+    }
+    else if (snd_mixer_selem_has_capture_switch(settings->elem) == 1) {
+        settings->switch_type = 'C';
+    }
+
+    // Nothing has been set through this element yet
+    settings->volume = -1;
+    settings->enabled = -1;
+
+    // Find out if ALSA removes the element
+    snd_mixer_elem_set_callback(settings->elem, openxt_alsa_mixer_elem_event);
+    snd_mixer_elem_set_callback_private(settings->elem, settings);
 
     // Success
-    snd_mixer_selem_id_free(selem_id);
     return 0;
 
 failure:
 
     // Failure
-    snd_mixer_selem_id_free(selem_id);
-    return -ENOENT;
+    settings->elem = NULL;
+    return ret;
 }
 
 ///
@@ -932,71 +1369,43 @@ int openxt_alsa_mixer_sset_enum(Settings *settings, char *name)
 ///
 int openxt_alsa_mixer_sset_volume(Settings *settings, int32_t vol)
 {
-    int ret;
-    int chn;
-    long min;
-    long max;
-    char type = 0;
+    int ret = 0;
+    long value;
 
     // Sanity checks
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->elem, -EINVAL);
     openxt_assert(vol >= 0 && vol <= 100, -EINVAL);
 
-    // Figure out if this is a playback element
-    if (snd_mixer_selem_has_common_volume(settings->elem) == 1 ||
-        snd_mixer_selem_has_playback_volume(settings->elem) == 1) {
-        type = 'P';
-    }
-
-    // Figure out if this is a capture element
-    else if (snd_mixer_selem_has_capture_volume(settings->elem) == 1) {
-        type = 'C';
-    }
+    // Pick up changes made by anyone else first (see
+    // openxt_alsa_mixer_elem_event), which may also remove the element.
+    ret = snd_mixer_handle_events(settings->mhandle);
+    openxt_assert_ret(ret >= 0, ret, ret);
+    openxt_checkp(settings->elem, -EINVAL);
 
-    // Not supported
-    else {
+    // Not supported, or already set
+    if (settings->volume_type == 0 || settings->volume == vol)
         return 0;
-    }
 
-    // We need to get the actual range that ALSA has setup for the simple
-    // element. This function accepts a percentage (0-100) so we need to
-    // convert
-    switch(type) {
+    // This function accepts a percentage (0-100) so we need to convert it.
+    // Note that we don't support setting each channel manually, you set the
+    // volume for all of the channels.
+    value = openxt_alsa_mixer_volume_value(settings, vol);
+
+    switch(settings->volume_type) {
         case 'P':
-            ret = snd_mixer_selem_get_playback_volume_range(settings->elem, &min, &max);
-            openxt_assert_ret(ret == 0, ret, ret);
+            ret = snd_mixer_selem_set_playback_volume_all(settings->elem, value);
             break;
         case 'C':
-            ret = snd_mixer_selem_get_capture_volume_range(settings->elem, &min, &max);
-            openxt_assert_ret(ret == 0, ret, ret);
+            ret = snd_mixer_selem_set_capture_volume_all(settings->elem, value);
             break;
         default:
             break;
     }
+    openxt_assert_ret(ret == 0, ret, ret);
 
-    // Now that we have the max and min, we can calculate the volume .
-    // Note that we don't support setting each channel manually, you set the
-    // volume for all of the channels.
-    vol = round(((double)((max - min) * vol)) / 100.0);
-
-    // Loop through all of the channles, and their their volume as well
-    // as their switch
-    for (chn = 0; chn <= SND_MIXER_SCHN_LAST; chn++) {
-
-        switch(type) {
-            case 'P':
-                ret = snd_mixer_selem_set_playback_volume(settings->elem, chn, vol);
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-            case 'C':
-                ret = snd_mixer_selem_set_capture_volume(settings->elem, chn, vol);
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-            default:
-                break;
-        }
-    }
+    // Remember it, so repeats cost nothing
+    settings->volume = vol;
 
     // Success
     return 0;
@@ -1013,47 +1422,37 @@ int openxt_alsa_mixer_sset_volume(Settings *settings, int32_t vol)
 ///
 int openxt_alsa_mixer_sset_switch(Settings *settings, int32_t enabled)
 {
-    int ret;
-    int chn;
-    char type = 0;
+    int ret = 0;
 
     // Sanity checks
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->elem, -EINVAL);
 
-    // Figure out if this is a playback element
-    if (snd_mixer_selem_has_common_switch(settings->elem) == 1 ||
-        snd_mixer_selem_has_playback_switch(settings->elem) == 1) {
-        type = 'P';
-    }
-
-    // Figure out if this is a capture element
-    else if (snd_mixer_selem_has_capture_switch(settings->elem) == 1) {
-        type = 'C';
-    }
+    // Pick up changes made by anyone else first (see
+    // openxt_alsa_mixer_elem_event), which may also remove the element.
+    ret = snd_mixer_handle_events(settings->mhandle);
+    openxt_assert_ret(ret >= 0, ret, ret);
+    openxt_checkp(settings->elem, -EINVAL);
 
-    // Not supported
-    else {
+    // Not supported, or already set
+    if (settings->switch_type == 0 || settings->enabled == enabled)
         return 0;
-    }
-
-    // Loop through all of the channles, and their their volume as well
-    // as their switch
-    for (chn = 0; chn <= SND_MIXER_SCHN_LAST; chn++) {
 
-        switch(type) {
-            case 'P':
-                ret = snd_mixer_selem_set_playback_switch(settings->elem, chn, enabled);
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-            case 'C':
-                ret = snd_mixer_selem_set_capture_switch(settings->elem, chn, enabled);
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-            default:
-                break;
-        }
+    // Set the switch for all of the channels
+    switch(settings->switch_type) {
+        case 'P':
+            ret = snd_mixer_selem_set_playback_switch_all(settings->elem, enabled);
+            break;
+        case 'C':
+            ret = snd_mixer_selem_set_capture_switch_all(settings->elem, enabled);
+            break;
+        default:
+            break;
     }
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // Remember it, so repeats cost nothing
+    settings->enabled = enabled;
 
     // Success
     return 0;
@@ -1125,14 +1524,18 @@ failure:
 int openxt_alsa_percentage(Settings *settings, int32_t vol)
 {
     int ret;
-    long min;
-    long max;
+    long min = 0;
+    long max = 0;
 
     // Sanity checks
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->elem, -EINVAL);
     openxt_checkp(settings->mhandle, -EINVAL);
 
+    // The range is the current element's, which is not necessarily the one
+    // openxt_alsa_mixer_sget cached (openxt_alsa_mixer_print_selements walks
+    // all of them).
+
     // Get the range of the simple element (for playback or common)
     if (snd_mixer_selem_has_common_volume(settings->elem) ||
         snd_mixer_selem_has_playback_volume(settings->elem)) {
@@ -1146,6 +1549,10 @@ int openxt_alsa_percentage(Settings *settings, int32_t vol)
         openxt_assert_ret(ret == 0, ret, ret);
     }
 
+    // An element without a range is always at 0%
+    if (max <= min)
+        return 0;
+
     // Return the percentage.
     return round(((double)(vol * 100)) / ((double)(max - min)));
 }
@@ -26,11 +26,16 @@
 #define ALSA_PCM_NEW_HW_PARAMS_API
 #include <alsa/asoundlib.h>
 
+#include <poll.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/types.h>
 
+#include "openxtjitter.h"
+#include "openxtresampler.h"
+
 #define MAX_NAME_LENGTH 256
+#define MAX_POLL_FDS 16
 
 #define min(a,b) \
    ({ __typeof__ (a) _a = (a); \
@@ -50,12 +55,38 @@ typedef struct Settings {
     snd_mixer_t *mhandle;
     snd_mixer_elem_t *elem;
 
+    // Resolved along with elem, so setting the volume is one ALSA call.
+    // 'P' or 'C' for playback or capture, 0 if the element has none.
+    char volume_type;
+    char switch_type;
+    long volume_min;
+    long volume_max;
+    int32_t volume;
+    int32_t enabled;
+
     int32_t fmt;
     int32_t freq;
     int32_t mode;
     int32_t valid;
     int32_t nchannels;
     int32_t sample_size;
+    int32_t buffer_size;
+    bool mmap;
+    int32_t max_packet_size;
+    int32_t flags;
+
+    JitterBuffer *jitter;
+    Resampler *resampler;
+
+    bool watched;
+    int32_t nfds;
+    struct pollfd fds[MAX_POLL_FDS];
+
+    // Latest volume from QEMU, held back while a slider is being dragged
+    bool volume_pending;
+    int32_t pending_volume;
+    int32_t pending_enabled;
+    int64_t volume_due;
 
     char pcm_name[MAX_NAME_LENGTH];
 
@@ -67,6 +98,7 @@ typedef struct Settings {
 // Global
 int openxt_alsa_set_card(int32_t n);
 int openxt_alsa_set_device(char *name);
+int openxt_alsa_set_shared_mixer(bool share);
 
 // Settings
 int openxt_alsa_create(Settings **settings);
@@ -79,8 +111,13 @@ int openxt_alsa_prepare(Settings *settings);
 int openxt_alsa_drop(Settings *settings);
 int openxt_alsa_start(Settings *settings);
 int openxt_alsa_get_available(Settings *settings);
+int openxt_alsa_get_delay(Settings *settings);
 int openxt_alsa_writei(Settings *settings, void *buffer, int32_t num, int32_t size);
 int openxt_alsa_readi(Settings *settings, void *buffer, int32_t num, int32_t size);
+int openxt_alsa_mmap_begin(Settings *settings, void **area, int32_t *offset, int32_t num);
+int openxt_alsa_mmap_commit(Settings *settings, int32_t offset, int32_t num);
+int openxt_alsa_poll_descriptors(Settings *settings, struct pollfd *fds, int32_t count);
+int openxt_alsa_poll_revents(Settings *settings, struct pollfd *fds, int32_t count);
 
 // Simple Mixer
 int openxt_alsa_mixer_fini(Settings *settings);
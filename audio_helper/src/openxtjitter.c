@@ -0,0 +1,225 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// Dates Modified:
+//  - 4/8/2015: Initial commit
+//    Rian Quinn <quinnr@ainfosec.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "openxtjitter.h"
+#include "openxtdebug.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Jitter Buffer Functions                                                                             //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Create a jitter buffer that can hold up to size bytes.
+///
+/// @param jitter pointer to the jitter buffer to be created
+/// @param size the capacity of the buffer in bytes
+/// @return -EINVAL jitter == NULL
+///         -EINVAL *jitter != NULL
+///         -EINVAL size <= 0
+///         -ENOMEM if out of memory
+///         0 on success
+///
+int openxt_jitter_create(JitterBuffer **jitter, int32_t size)
+{
+    // Sanity checks
+    openxt_checkp(jitter, -EINVAL);
+    openxt_assert(*jitter == NULL, -EINVAL);
+    openxt_assert(size > 0, -EINVAL);
+
+    // Allocate the jitter buffer, and the memory it manages.
+    *jitter = (JitterBuffer *)calloc(1, sizeof(JitterBuffer));
+    if (*jitter == NULL)
+        return -ENOMEM;
+
+    (*jitter)->buffer = (char *)malloc(size);
+    if ((*jitter)->buffer == NULL) {
+        free(*jitter);
+        *jitter = NULL;
+        return -ENOMEM;
+    }
+
+    (*jitter)->size = size;
+
+    // Done
+    return 0;
+}
+
+///
+/// Destroy a jitter buffer that we previously created.
+///
+/// @param jitter a pointer to the jitter buffer
+/// @return 0 on success, or if the jitter buffer is already NULL
+///
+int openxt_jitter_destroy(JitterBuffer *jitter)
+{
+    // Ignore if the jitter buffer is already destroyed
+    if (jitter == NULL)
+        return 0;
+
+    // Cleanup memory
+    free(jitter->buffer);
+    free(jitter);
+
+    // Done
+    return 0;
+}
+
+///
+/// Throw away anything that is still buffered
+///
+/// @param jitter a pointer to the jitter buffer
+/// @return -EINVAL jitter == NULL
+///         0 on success
+///
+int openxt_jitter_reset(JitterBuffer *jitter)
+{
+    // Sanity checks
+    openxt_checkp(jitter, -EINVAL);
+
+    jitter->head = 0;
+    jitter->used = 0;
+
+    // Done
+    return 0;
+}
+
+///
+/// @param jitter a pointer to the jitter buffer
+/// @return the number of bytes buffered, 0 if jitter == NULL
+///
+int32_t openxt_jitter_used(JitterBuffer *jitter)
+{
+    // A stream that was never initialized has nothing buffered, and no room
+    if (jitter == NULL)
+        return 0;
+
+    return jitter->used;
+}
+
+///
+/// @param jitter a pointer to the jitter buffer
+/// @return the number of bytes that can still be written, 0 if jitter == NULL
+///
+int32_t openxt_jitter_free(JitterBuffer *jitter)
+{
+    // See openxt_jitter_used
+    if (jitter == NULL)
+        return 0;
+
+    return jitter->size - jitter->used;
+}
+
+///
+/// Append data to the jitter buffer. Whatever does not fit is not written,
+/// so the caller decides what to do about an overrun.
+///
+/// @param jitter a pointer to the jitter buffer
+/// @param data the data to append
+/// @param size the number of bytes to append
+/// @return -EINVAL jitter == NULL
+///         -EINVAL data == NULL
+///         number of bytes written on success
+///
+int32_t openxt_jitter_write(JitterBuffer *jitter, void *data, int32_t size)
+{
+    int32_t tail;
+    int32_t chunk;
+
+    // Sanity checks
+    openxt_checkp(jitter, -EINVAL);
+    openxt_checkp(data, -EINVAL);
+
+    // Only write what fits.
+    if (size > jitter->size - jitter->used)
+        size = jitter->size - jitter->used;
+    if (size <= 0)
+        return 0;
+
+    // The write may wrap around the end of the buffer, in which case it is
+    // done in two pieces.
+    tail = (jitter->head + jitter->used) % jitter->size;
+    chunk = jitter->size - tail;
+    if (chunk > size)
+        chunk = size;
+
+    memcpy(jitter->buffer + tail, data, chunk);
+    memcpy(jitter->buffer, (char *)data + chunk, size - chunk);
+
+    jitter->used += size;
+
+    // Done
+    return size;
+}
+
+///
+/// Get the oldest buffered data. Only the part that is contiguous in memory
+/// is returned, so once it has been consumed there may be more.
+///
+/// @param jitter a pointer to the jitter buffer
+/// @param data set to the oldest buffered data
+/// @return -EINVAL jitter == NULL
+///         -EINVAL data == NULL
+///         number of contiguous bytes at data on success
+///
+int32_t openxt_jitter_peek(JitterBuffer *jitter, void **data)
+{
+    // Sanity checks
+    openxt_checkp(jitter, -EINVAL);
+    openxt_checkp(data, -EINVAL);
+
+    *data = jitter->buffer + jitter->head;
+
+    // Done
+    if (jitter->used < jitter->size - jitter->head)
+        return jitter->used;
+
+    return jitter->size - jitter->head;
+}
+
+///
+/// Remove data from the front of the jitter buffer, normally after it has
+/// been handed to ALSA.
+///
+/// @param jitter a pointer to the jitter buffer
+/// @param size the number of bytes to remove
+/// @return -EINVAL jitter == NULL
+///         -EINVAL size < 0 or size > bytes buffered
+///         0 on success
+///
+int openxt_jitter_consume(JitterBuffer *jitter, int32_t size)
+{
+    // Sanity checks
+    openxt_checkp(jitter, -EINVAL);
+    openxt_assert(size >= 0, -EINVAL);
+    openxt_assert(size <= jitter->used, -EINVAL);
+
+    jitter->head = (jitter->head + size) % jitter->size;
+    jitter->used -= size;
+
+    // Keep the data at the start of the buffer when we can, so that peek
+    // hands out the largest pieces possible.
+    if (jitter->used == 0)
+        jitter->head = 0;
+
+    // Done
+    return 0;
+}
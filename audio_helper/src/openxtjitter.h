@@ -0,0 +1,55 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// Dates Modified:
+//  - 4/8/2015: Initial commit
+//    Rian Quinn <quinnr@ainfosec.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef OPENXT_JITTER_H
+#define OPENXT_JITTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+///
+/// A byte FIFO that sits between the V4V receive loop and a PCM, so that
+/// samples from QEMU can be taken as soon as they arrive and handed to
+/// ALSA whenever it has room, without ever blocking on the sound card.
+///
+typedef struct JitterBuffer {
+
+    char *buffer;
+    int32_t size;
+    int32_t head;
+    int32_t used;
+
+} JitterBuffer;
+
+int openxt_jitter_create(JitterBuffer **jitter, int32_t size);
+int openxt_jitter_destroy(JitterBuffer *jitter);
+int openxt_jitter_reset(JitterBuffer *jitter);
+
+int32_t openxt_jitter_used(JitterBuffer *jitter);
+int32_t openxt_jitter_free(JitterBuffer *jitter);
+
+int32_t openxt_jitter_write(JitterBuffer *jitter, void *data, int32_t size);
+int32_t openxt_jitter_peek(JitterBuffer *jitter, void **data);
+int openxt_jitter_consume(JitterBuffer *jitter, int32_t size);
+
+#endif // OPENXT_JITTER_H
@@ -223,9 +223,9 @@ int openxt_mixer_ctl_sset(int argc, char *argv[])
             }
         }
 
-        // Cleanup the percentage
-        percentage = max(percentage, 0);
-        percentage = min(percentage, 100);
+        // Cleanup the percentage, if one was given
+        if (percentage >= 0)
+            percentage = min(percentage, 100);
 
         // Finally set the volume and switch
         if (enabled >= 0) openxt_alsa_mixer_sset_switch(settings, enabled);
@@ -23,6 +23,9 @@
 #ifndef OPENXT_PACKETS_H
 #define OPENXT_PACKETS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "openxtsettings.h"
 
 typedef enum PacketOpCode {
@@ -64,6 +67,33 @@ typedef struct  __attribute__((packed)) {
 
 } OpenBlankPacket;
 
+///
+/// Sent with OPENXT_PLAYBACK_INIT / OPENXT_CAPTURE_INIT by a QEMU that can use
+/// PCM packets other than MAX_PCM_BUFFER_SIZE bytes. Older QEMUs send the init
+/// with no body, and keep getting MAX_PCM_BUFFER_SIZE and the short ack. The
+/// fields are optional from the end: the ack carries back the same ones.
+///
+typedef struct  __attribute__((packed)) {
+
+    int32_t max_packet_size;
+    int32_t flags;
+
+} OpenXTInitPacket;
+
+///
+/// Init flags.
+///
+/// - OPENXT_INIT_CAPTURE_PUSH: an OPENXT_CAPTURE_ACK is sent whenever the
+///   capture PCM has data, without waiting for OPENXT_CAPTURE.
+/// - OPENXT_INIT_DELAY: get available acks carry the stream's delay.
+/// - OPENXT_INIT_DRIFT: playback is resampled to hold the sound card at a
+///   fixed fill, rather than letting it drift against the guest's clock.
+///   QEMU should send samples as the guest produces them.
+///
+#define OPENXT_INIT_CAPTURE_PUSH 0x1
+#define OPENXT_INIT_DELAY 0x2
+#define OPENXT_INIT_DRIFT 0x4
+
 typedef struct  __attribute__((packed)) {
 
     int32_t fmt;
@@ -71,18 +101,28 @@ typedef struct  __attribute__((packed)) {
     int32_t valid;
     int32_t nchannels;
 
+    // Only sent in reply to an OpenXTInitPacket. The number of PCM bytes that
+    // either side may put in one packet from now on, and the init flags that
+    // were granted.
+    int32_t max_packet_size;
+    int32_t flags;
+
 } OpenXTPlaybackInitAckPacket;
 
 typedef struct  __attribute__((packed)) {
 
     int32_t available;
 
+    // Only sent with OPENXT_INIT_DELAY. The number of samples until a sample
+    // sent now is heard, including the ones still queued in audio_helper.
+    int32_t delay;
+
 } OpenXTPlaybackGetAvailableAckPacket;
 
 typedef struct  __attribute__((packed)) {
 
     int32_t num_samples;
-    char samples[MAX_PCM_BUFFER_SIZE];
+    char samples[MAX_PCM_PACKET_SIZE];
 
 } OpenXTPlaybackPacket;
 
@@ -100,12 +140,20 @@ typedef struct  __attribute__((packed)) {
     int32_t valid;
     int32_t nchannels;
 
+    // See OpenXTPlaybackInitAckPacket
+    int32_t max_packet_size;
+    int32_t flags;
+
 } OpenXTCaptureInitAckPacket;
 
 typedef struct  __attribute__((packed)) {
 
     int32_t available;
 
+    // Only sent with OPENXT_INIT_DELAY. The number of samples since the next
+    // sample to be read was recorded.
+    int32_t delay;
+
 } OpenXTCaptureGetAvailableAckPacket;
 
 typedef struct  __attribute__((packed)) {
@@ -117,10 +165,12 @@ typedef struct  __attribute__((packed)) {
 typedef struct  __attribute__((packed)) {
 
     int32_t num_samples;
-    char samples[MAX_PCM_BUFFER_SIZE];
+    char samples[MAX_PCM_PACKET_SIZE];
 
 } OpenXTCaptureAckPacket;
 
+#define INIT_ACK_PACKET_LENGTH(a,b) (offsetof(a, max_packet_size) + (b))
+#define GET_AVAILABLE_ACK_PACKET_LENGTH(a,b) (((b) & OPENXT_INIT_DELAY) ? sizeof(a) : offsetof(a, delay))
 #define PLAYBACK_PACKET_LENGTH(a) (sizeof(int32_t) + (sizeof(uint32_t) * a))
 #define CAPTURE_ACK_PACKET_LENGTH(a) (sizeof(int32_t) + (sizeof(uint32_t) * a))
 
@@ -0,0 +1,232 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// Dates Modified:
+//  - 4/8/2015: Initial commit
+//    Rian Quinn <quinnr@ainfosec.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "openxtresampler.h"
+#include "openxtdebug.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Settings                                                                                            //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The most the rate is ever changed by. Real clocks are well within this,
+// and at this size the change in pitch can't be heard.
+#define MAX_DRIFT 0.002
+
+// How hard the rate is steered towards the target fill: a fill that is off by
+// the whole target changes it by this much. A steady drift is made up for by
+// an integral term, which is scaled to this so that the fill settles without
+// overshooting whatever the target is.
+#define RESAMPLER_KP 0.01
+
+// The fill is measured per packet, and jumps by a period at a time as the
+// sound card takes them, so it is smoothed over this many packets.
+#define RESAMPLER_SMOOTHING 16
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Resampler Functions                                                                                 //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Create a resampler
+///
+/// @param resampler pointer to the resampler to be created
+/// @param target the fill level to hold the sound card at, in samples
+/// @param max_in the most samples that will be passed to process at once
+/// @return -EINVAL resampler == NULL
+///         -EINVAL *resampler != NULL
+///         -EINVAL target <= 0
+///         -EINVAL max_in <= 0
+///         -ENOMEM if out of memory
+///         0 on success
+///
+int openxt_resampler_create(Resampler **resampler, int32_t target, int32_t max_in)
+{
+    // Sanity checks
+    openxt_checkp(resampler, -EINVAL);
+    openxt_assert(*resampler == NULL, -EINVAL);
+    openxt_assert(target > 0, -EINVAL);
+    openxt_assert(max_in > 0, -EINVAL);
+
+    *resampler = (Resampler *)calloc(1, sizeof(Resampler));
+    if (*resampler == NULL)
+        return -ENOMEM;
+
+    // At the slowest rate, max_in samples become a little more than max_in
+    // samples, plus the one that is carried over.
+    (*resampler)->max_out = (max_in + 1) / (1.0 - MAX_DRIFT) + 1;
+    (*resampler)->buffer = (int16_t *)malloc((*resampler)->max_out * 2 * sizeof(int16_t));
+    if ((*resampler)->buffer == NULL) {
+        free(*resampler);
+        *resampler = NULL;
+        return -ENOMEM;
+    }
+
+    (*resampler)->target = target;
+    (*resampler)->max_in = max_in;
+
+    // Done
+    return openxt_resampler_reset(*resampler);
+}
+
+///
+/// Destroy a resampler that we previously created.
+///
+/// @param resampler a pointer to the resampler
+/// @return 0 on success, or if the resampler is already NULL
+///
+int openxt_resampler_destroy(Resampler *resampler)
+{
+    // Ignore if the resampler is already destroyed
+    if (resampler == NULL)
+        return 0;
+
+    // Cleanup memory
+    free(resampler->buffer);
+    free(resampler);
+
+    // Done
+    return 0;
+}
+
+///
+/// Start over, for a stream that was stopped
+///
+/// @param resampler a pointer to the resampler
+/// @return -EINVAL resampler == NULL
+///         0 on success
+///
+int openxt_resampler_reset(Resampler *resampler)
+{
+    // Sanity checks
+    openxt_checkp(resampler, -EINVAL);
+
+    resampler->ratio = 1.0;
+    resampler->pos = 0.0;
+    resampler->fill = -1.0;
+    resampler->error = 0.0;
+    resampler->integral = 0.0;
+    resampler->last[0] = 0;
+    resampler->last[1] = 0;
+
+    // Done
+    return 0;
+}
+
+///
+/// Steer the rate from how full the sound card is right now
+///
+/// @param resampler a pointer to the resampler
+/// @param fill samples queued up for the sound card, including the ones
+///        that are still waiting to be written to it
+/// @return -EINVAL resampler == NULL
+///         0 on success
+///
+int openxt_resampler_adjust(Resampler *resampler, int32_t fill)
+{
+    // Sanity checks
+    openxt_checkp(resampler, -EINVAL);
+
+    // Smooth out the period sized steps
+    if (resampler->fill < 0)
+        resampler->fill = fill;
+    else
+        resampler->fill += (fill - resampler->fill) / RESAMPLER_SMOOTHING;
+
+    resampler->error = (resampler->fill - resampler->target) / resampler->target;
+
+    // Above the target, take input samples slightly faster than we make
+    // output samples
+    resampler->ratio = 1.0 + resampler->error * RESAMPLER_KP + resampler->integral;
+    if (resampler->ratio > 1.0 + MAX_DRIFT) resampler->ratio = 1.0 + MAX_DRIFT;
+    if (resampler->ratio < 1.0 - MAX_DRIFT) resampler->ratio = 1.0 - MAX_DRIFT;
+
+    // Done
+    return 0;
+}
+
+///
+/// Resample a block of samples at the current rate. The rate changes are far
+/// too small for aliasing to matter, so this just interpolates between
+/// neighbouring samples. The last sample of each block is held back to
+/// interpolate against the next one.
+///
+/// @param resampler a pointer to the resampler
+/// @param in the samples to resample
+/// @param num the number of samples in
+/// @param out set to the resampled samples, which are valid until the next call
+/// @return -EINVAL resampler == NULL
+///         -EINVAL in == NULL
+///         -EINVAL out == NULL
+///         -EINVAL num < 0 or num > max_in
+///         number of resampled samples on success
+///
+int32_t openxt_resampler_process(Resampler *resampler, int16_t *in, int32_t num, int16_t **out)
+{
+    int32_t i;
+    int32_t c;
+    int32_t produced = 0;
+    double f;
+    int16_t *a;
+    int16_t *b;
+
+    // Sanity checks
+    openxt_checkp(resampler, -EINVAL);
+    openxt_checkp(in, -EINVAL);
+    openxt_checkp(out, -EINVAL);
+    openxt_assert(num >= 0 && num <= resampler->max_in, -EINVAL);
+
+    *out = resampler->buffer;
+
+    if (num == 0)
+        return 0;
+
+    // Position 0 is the sample held back from the last block, and position
+    // n is in[n - 1].
+    while (resampler->pos < num && produced < resampler->max_out) {
+
+        i = (int32_t)resampler->pos;
+        f = resampler->pos - i;
+
+        a = (i == 0) ? resampler->last : &in[(i - 1) * 2];
+        b = &in[i * 2];
+
+        for (c = 0; c < 2; c++)
+            resampler->buffer[produced * 2 + c] = (int16_t)(a[c] + f * (b[c] - a[c]));
+
+        produced++;
+        resampler->pos += resampler->ratio;
+    }
+
+    resampler->pos -= num;
+    resampler->last[0] = in[(num - 1) * 2];
+    resampler->last[1] = in[(num - 1) * 2 + 1];
+
+    // The integral builds up per sample, rather than per call, so that it
+    // doesn't depend on the packet size. The fill changes by one sample per
+    // sample for each unit of ratio, which makes this gain critically damped.
+    resampler->integral += resampler->error * num * RESAMPLER_KP * RESAMPLER_KP / (4.0 * resampler->target);
+    if (resampler->integral > MAX_DRIFT) resampler->integral = MAX_DRIFT;
+    if (resampler->integral < -MAX_DRIFT) resampler->integral = -MAX_DRIFT;
+
+    // Done
+    return produced;
+}
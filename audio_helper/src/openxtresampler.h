@@ -0,0 +1,61 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// Dates Modified:
+//  - 4/8/2015: Initial commit
+//    Rian Quinn <quinnr@ainfosec.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef OPENXT_RESAMPLER_H
+#define OPENXT_RESAMPLER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+///
+/// Makes small, continuous changes to the rate of an interleaved S16 stereo
+/// stream, to make up for the guest's clock and the sound card's clock
+/// drifting apart. The rate is steered by how full the sound card is: above
+/// the target fill, samples are consumed slightly faster than they are
+/// produced, and below it slightly slower.
+///
+typedef struct Resampler {
+
+    double ratio;
+    double pos;
+    double fill;
+    double error;
+    double integral;
+
+    int32_t target;
+    int32_t max_in;
+    int32_t max_out;
+
+    int16_t last[2];
+    int16_t *buffer;
+
+} Resampler;
+
+int openxt_resampler_create(Resampler **resampler, int32_t target, int32_t max_in);
+int openxt_resampler_destroy(Resampler *resampler);
+int openxt_resampler_reset(Resampler *resampler);
+
+int openxt_resampler_adjust(Resampler *resampler, int32_t fill);
+int32_t openxt_resampler_process(Resampler *resampler, int16_t *in, int32_t num, int16_t **out);
+
+#endif // OPENXT_RESAMPLER_H
@@ -27,11 +27,17 @@
 #define DEBUGGING_ENABLED
 #define TAG "openxt_audio_back"
 
-// The following means that we should have room for roughly 1280 samples
+// The following means that we should have room for roughly 1280 samples. This
+// is the PCM packet size used unless QEMU negotiates another one at init.
 #define MAX_PCM_BUFFER_SIZE (4096)
 
-// Define the maximum size of a V4V packet
-#define V4V_MAX_PACKET_BODY_SIZE (4096 * 2)
+// Define the maximum size of a V4V packet. A V4V ring is 32 pages by default,
+// so this leaves plenty of room for the ring and message headers.
+#define V4V_MAX_PACKET_BODY_SIZE (4096 * 16)
+
+// The largest PCM packet size that can be negotiated, which is whatever is
+// left of a V4V packet once the sample count is in.
+#define MAX_PCM_PACKET_SIZE (V4V_MAX_PACKET_BODY_SIZE - 4)
 
 // The following is the V4V port that we will use for communications.
 #define OPENXT_AUDIO_PORT 5001
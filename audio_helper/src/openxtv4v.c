@@ -39,6 +39,10 @@
 /// - remote port = V4V_PORT_NONE
 /// - remote domid = <client domid>
 ///
+/// A server whose remote domid is V4V_DOMID_ANY talks to every domain, and
+/// is not closed when sending to or receiving from one of them fails. Any
+/// other connection is closed by the first failure.
+///
 /// @param lport local port
 /// @param ldomid local domid
 /// @param rport remote port
@@ -55,6 +59,7 @@ V4VConnection *openxt_v4v_open(int32_t lport, int32_t ldomid, int32_t rport, int
     // Initialize the connection for safety.
     conn->fd = -1;
     conn->connected = false;
+    conn->shared = (rdomid == V4V_DOMID_ANY);
     conn->local_addr.port = lport;
     conn->local_addr.domain = ldomid;
     conn->remote_addr.port = rport;
@@ -107,6 +112,22 @@ int openxt_v4v_close_internal(V4VConnection *conn)
     return ret;
 }
 
+///
+/// The following is for internal use only. It is called when talking to the
+/// domain in remote_addr failed, with the error to return. A connection
+/// bound to one domain is no good after that, so it is closed. A shared one
+/// (bound to V4V_DOMID_ANY) is talking to other domains as well: an error
+/// with one of them is left to the caller, and only an error that says the
+/// socket itself is gone closes it.
+///
+static int openxt_v4v_fail(V4VConnection *conn, int err)
+{
+    if (conn->shared == false || err == -EBADF || err == -ENOTCONN)
+        openxt_v4v_close_internal(conn);
+
+    return err;
+}
+
 ///
 /// Once you are done with V4V, run this function. Note that this function
 /// could be called by this API if something bad happens.
@@ -301,15 +322,15 @@ int openxt_v4v_send(V4VConnection *conn, V4VPacket *packet)
 
             // Failed to send anything
             case 0:
-                openxt_warn("failed openxt_v4v_send, wrote 0 bytes: %d - %s\n", errno, strerror(errno));
-                openxt_v4v_close_internal(conn);
-                return -errno;
+                ret = -errno;
+                openxt_warn("failed openxt_v4v_send, wrote 0 bytes: %d - %s\n", -ret, strerror(-ret));
+                return openxt_v4v_fail(conn, ret);
 
             // Error
             default:
-                openxt_warn("failed openxt_v4v_send: %d - %s\n", errno, strerror(errno));
-                openxt_v4v_close_internal(conn);
-                return -errno;
+                ret = -errno;
+                openxt_warn("failed openxt_v4v_send: %d - %s\n", -ret, strerror(-ret));
+                return openxt_v4v_fail(conn, ret);
         }
     }
 
@@ -354,15 +375,15 @@ int openxt_v4v_recv(V4VConnection *conn, V4VPacket *packet)
 
             // Failed to receive anything
             case 0:
-                openxt_warn("failed openxt_v4v_recv, read 0 bytes: %d - %s\n", errno, strerror(errno));
-                openxt_v4v_close_internal(conn);
-                return -errno;
+                ret = -errno;
+                openxt_warn("failed openxt_v4v_recv, read 0 bytes: %d - %s\n", -ret, strerror(-ret));
+                return openxt_v4v_fail(conn, ret);
 
             // Error
             default:
-                openxt_warn("failed openxt_v4v_recv: %d - %s\n", errno, strerror(errno));
-                openxt_v4v_close_internal(conn);
-                return -errno;
+                ret = -errno;
+                openxt_warn("failed openxt_v4v_recv: %d - %s\n", -ret, strerror(-ret));
+                return openxt_v4v_fail(conn, ret);
         }
     }
 
@@ -371,8 +392,179 @@ int openxt_v4v_recv(V4VConnection *conn, V4VPacket *packet)
     // packet should have returned. If it is not, we have an error
     if (packet->header.length != ret) {
         openxt_warn("failed openxt_v4v_recv: length mismatch %d - %d\n", packet->header.length, ret);
-        openxt_v4v_close_internal(conn);
+        return openxt_v4v_fail(conn, -EIO);
+    }
+
+    // Success
+    return ret - sizeof(V4VPacketHeader);
+}
+
+///
+/// The following function will look at the start of the next V4V packet
+/// without receiving it: the header and up to head bytes of the body are
+/// copied into the packet, and remote_addr is set to the sender. The next
+/// openxt_v4v_recv / openxt_v4v_recv_into still gets the whole packet.
+///
+/// @param conn the V4V connection created using openxt_v4v_open.
+/// @param packet the packet to copy the start of the next packet into
+/// @param head the most body bytes to copy
+///
+/// @return -EINVAL if conn or packet == NULL,
+///         -EINVAL if head is larger than a packet body,
+///         -EIO if less than a header is there,
+///         -ENODEV if conn is closed,
+///          negative errno if v4v_recvfrom fails,
+///          ret >= 0 on success representing number of body bytes copied
+///
+int openxt_v4v_peek(V4VConnection *conn, V4VPacket *packet, int32_t head)
+{
+    // Local variables
+    int ret;
+
+    // Sanity checks
+    openxt_checkp(conn, -EINVAL);
+    openxt_checkp(packet, -EINVAL);
+    openxt_assert(head >= 0 && head <= V4V_MAX_PACKET_BODY_SIZE, -EINVAL);
+
+    // See openxt_v4v_recv
+    openxt_assert_quiet(openxt_v4v_isconnected(conn) == true, -ENODEV);
+
+    ret = v4v_recvfrom(conn->fd, (char *)packet, sizeof(V4VPacketHeader) + head, MSG_PEEK, &conn->remote_addr);
+    if (ret <= 0) {
+        ret = -errno;
+        openxt_warn("failed openxt_v4v_peek: %d - %s\n", -ret, strerror(-ret));
+        return openxt_v4v_fail(conn, ret);
+    }
+
+    // A packet without a whole header will not be received either
+    if (ret < (int)sizeof(V4VPacketHeader))
         return -EIO;
+
+    // Success
+    return ret - sizeof(V4VPacketHeader);
+}
+
+///
+/// The following function will send a V4V packet whose body is split in
+/// two: the first head bytes are in the packet, and the size bytes after
+/// them are in buffer. This lets a large payload go out from where it
+/// already is, without copying it into the packet first. The packet's
+/// length must already be set to head + size.
+///
+/// @param conn the V4V connection created using openxt_v4v_open.
+/// @param packet the packet to send, holding the start of the body
+/// @param head the number of body bytes in the packet
+/// @param buffer the rest of the body
+/// @param size the number of body bytes in buffer
+///
+/// @return -EINVAL if conn, packet or buffer == NULL,
+///         -EINVAL if the packet length != head + size,
+///         -ENODEV if conn is closed,
+///          negative errno if v4v_sendmsg fails,
+///          ret >= 0 on success representing number of bytes sent
+///
+int openxt_v4v_send_from(V4VConnection *conn, V4VPacket *packet, int32_t head, void *buffer, int32_t size)
+{
+    // Local variables
+    int ret;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    // Sanity checks
+    openxt_checkp(conn, -EINVAL);
+    openxt_checkp(packet, -EINVAL);
+    openxt_checkp(buffer, -EINVAL);
+    openxt_assert(head >= 0 && size >= 0, -EINVAL);
+    openxt_assert(openxt_v4v_get_length(packet) == head + size, -EINVAL);
+
+    // See openxt_v4v_send
+    openxt_assert_quiet(openxt_v4v_isconnected(conn) == true, -ENODEV);
+
+    iov[0].iov_base = packet;
+    iov[0].iov_len = sizeof(V4VPacketHeader) + head;
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &conn->remote_addr;
+    msg.msg_namelen = sizeof(conn->remote_addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    // Send the packet
+    ret = v4v_sendmsg(conn->fd, &msg, 0);
+    if (ret <= 0) {
+        ret = -errno;
+        openxt_warn("failed openxt_v4v_send_from: %d - %s\n", -ret, strerror(-ret));
+        return openxt_v4v_fail(conn, ret);
+    }
+
+    // Success
+    return ret - sizeof(V4VPacketHeader);
+}
+
+///
+/// The following function will receive a V4V packet, with part of its body
+/// going straight to somewhere else. The first head bytes of the body land
+/// in the packet, the next size bytes in buffer, and anything after that
+/// in the packet again, at the offset it would have had anyway. A caller
+/// that turns out not to want the bytes in buffer copies them back into
+/// the packet.
+///
+/// @param conn the V4V connection created using openxt_v4v_open.
+/// @param packet the packet to receive the rest of the packet into
+/// @param head the number of body bytes to receive into the packet first
+/// @param buffer where the next size bytes of the body go
+/// @param size the most body bytes to put in buffer
+///
+/// @return -EINVAL if conn, packet or buffer == NULL,
+///         -EINVAL if head + size is larger than a packet body,
+///         -EIO if the received packet length != length in header,
+///         -ENODEV if conn is closed,
+///          negative errno if v4v_recvmsg fails,
+///          ret >= 0 on success representing number of bytes received
+///
+int openxt_v4v_recv_into(V4VConnection *conn, V4VPacket *packet, int32_t head, void *buffer, int32_t size)
+{
+    // Local variables
+    int ret;
+    struct iovec iov[3];
+    struct msghdr msg;
+
+    // Sanity checks
+    openxt_checkp(conn, -EINVAL);
+    openxt_checkp(packet, -EINVAL);
+    openxt_checkp(buffer, -EINVAL);
+    openxt_assert(head >= 0 && size >= 0 && head + size <= V4V_MAX_PACKET_BODY_SIZE, -EINVAL);
+
+    // See openxt_v4v_recv
+    openxt_assert_quiet(openxt_v4v_isconnected(conn) == true, -ENODEV);
+
+    iov[0].iov_base = packet;
+    iov[0].iov_len = sizeof(V4VPacketHeader) + head;
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = size;
+    iov[2].iov_base = packet->body.buffer + head + size;
+    iov[2].iov_len = V4V_MAX_PACKET_BODY_SIZE - head - size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &conn->remote_addr;
+    msg.msg_namelen = sizeof(conn->remote_addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    // Receive the packet
+    ret = v4v_recvmsg(conn->fd, &msg, 0);
+    if (ret <= 0) {
+        ret = -errno;
+        openxt_warn("failed openxt_v4v_recv_into: %d - %s\n", -ret, strerror(-ret));
+        return openxt_v4v_fail(conn, ret);
+    }
+
+    // See openxt_v4v_recv
+    if (ret < (int)sizeof(V4VPacketHeader) || packet->header.length != ret) {
+        openxt_warn("failed openxt_v4v_recv_into: length mismatch %d - %d\n", packet->header.length, ret);
+        return openxt_v4v_fail(conn, -EIO);
     }
 
     // Success
@@ -34,6 +34,7 @@ typedef struct V4VConnection {
 
     int fd;
     bool connected;
+    bool shared;
     v4v_addr_t local_addr;
     v4v_addr_t remote_addr;
 
@@ -74,5 +75,8 @@ void *openxt_v4v_get_body(V4VPacket *packet);
 
 int openxt_v4v_send(V4VConnection *conn, V4VPacket *packet);
 int openxt_v4v_recv(V4VConnection *conn, V4VPacket *packet);
+int openxt_v4v_peek(V4VConnection *conn, V4VPacket *packet, int32_t head);
+int openxt_v4v_send_from(V4VConnection *conn, V4VPacket *packet, int32_t head, void *buffer, int32_t size);
+int openxt_v4v_recv_into(V4VConnection *conn, V4VPacket *packet, int32_t head, void *buffer, int32_t size);
 
 #endif // OPENXT_V4V_H
@@ -20,6 +20,11 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 //
 
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <xs.h>
+
 #include "openxtv4v.h"
 #include "openxtalsa.h"
 #include "openxtdebug.h"
@@ -30,6 +35,33 @@
 // Global Data / Structures                                                                            //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Events taken per wakeup. epoll is level triggered, so anything beyond
+// this is just picked up on the next one.
+#define MAX_EVENTS (1 + 2 * MAX_POLL_FDS)
+
+// Least time between two volume changes reaching the sound card
+#define VOLUME_INTERVAL_MS 50
+
+///
+/// Everything that belongs to one stubdomain. A daemon serving every guest
+/// keeps a list of these; a helper started for one stubdomain has just the one.
+///
+typedef struct VMAudio {
+
+    int32_t stubdomid;
+    v4v_addr_t addr;
+
+    Settings *playback_settings;
+    Settings *capture_settings;
+
+    struct VMAudio *next;
+
+} VMAudio;
+
+// Global list of stubdomains being served
+VMAudio *vms = NULL;
+
+// The streams of the stubdomain being serviced right now. See openxt_vm_select
 Settings *playback_settings = NULL;
 Settings *capture_settings = NULL;
 
@@ -37,9 +69,22 @@ Settings *capture_settings = NULL;
 V4VPacket snd_packet;
 V4VPacket rcv_packet;
 
+// Samples at the start of the playback packet in rcv_packet that were
+// received straight into the sound card's buffer. See openxt_recv_packet
+int32_t playback_direct = 0;
+
 // GLobal V4V Connection
 V4VConnection *conn = NULL;
 
+// Global epoll instance, watching the V4V connection and the PCMs
+int epfd = -1;
+
+// Global xenstore connection, watching for domains going away. See openxt_vm_reap
+struct xs_handle *xsh = NULL;
+
+// Global V4V Packet Init Bodies
+OpenXTInitPacket *init_packet = NULL;
+
 // Global V4V Packet Playback Bodies
 OpenXTPlaybackPacket *playback_packet = NULL;
 OpenXTPlaybackInitAckPacket *playback_init_ack_packet = NULL;
@@ -52,30 +97,234 @@ OpenXTCaptureAckPacket *capture_ack_packet = NULL;
 OpenXTCaptureInitAckPacket *capture_init_ack_packet = NULL;
 OpenXTCaptureGetAvailableAckPacket *capture_get_available_ack_packet = NULL;
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Init Functions                                                                                      //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Works out the PCM packet size and flags to use for a stream from the init
+/// packet that was just received. A QEMU that knows about packet sizes asks
+/// for one, and gets the largest whole number of samples that fits in both
+/// what it asked for and a V4V packet. One that doesn't sends an empty init
+/// packet and keeps using MAX_PCM_BUFFER_SIZE. Flags QEMU asked for are
+/// granted if the stream supports them.
+///
+/// @param settings the stream that is being initialized
+/// @param supported the init flags this stream can honour
+/// @return the number of bytes of the init packet that were understood,
+///         which is how many QEMU expects back at the end of its ack
+///
+static int32_t openxt_negotiate(Settings *settings, int32_t supported)
+{
+    int32_t size;
+    int32_t length;
+
+    settings->max_packet_size = MAX_PCM_BUFFER_SIZE;
+    settings->flags = 0;
+
+    length = openxt_v4v_get_length(&rcv_packet);
+
+    // Legacy QEMU
+    if (length < (int32_t)offsetof(OpenXTInitPacket, flags))
+        return 0;
+
+    size = init_packet->max_packet_size;
+    size = min(size, (int32_t)MAX_PCM_PACKET_SIZE);
+    size -= size % settings->sample_size;
+
+    if (size > 0)
+        settings->max_packet_size = size;
+
+    // QEMU from before init flags
+    if (length < (int32_t)sizeof(OpenXTInitPacket))
+        return offsetof(OpenXTInitPacket, flags);
+
+    settings->flags = init_packet->flags & supported;
+
+    return sizeof(OpenXTInitPacket);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Event Functions                                                                                     //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Starts or stops waiting on a PCM's poll descriptors. A PCM is only watched
+/// while there is something to do with it: the descriptors of an idle PCM can
+/// report errors, or just wake us up every period, for nothing.
+///
+/// @param settings the stream to watch
+/// @param watch true to start watching, false to stop
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_watch_pcm(Settings *settings, bool watch)
+{
+    int i;
+    int ret;
+    struct epoll_event event;
+
+    // Nothing to do
+    if (settings->watched == watch)
+        return 0;
+
+    if (watch == true) {
+
+        ret = openxt_alsa_poll_descriptors(settings, settings->fds, MAX_POLL_FDS);
+        openxt_assert_ret(ret >= 0, ret, ret);
+        settings->nfds = ret;
+
+        // ALSA uses the poll() bits, which epoll shares. Each event points
+        // at the pollfd it is for, so its revents can go straight back in.
+        for (i = 0; i < settings->nfds; i++) {
+            memset(&event, 0, sizeof(event));
+            event.events = settings->fds[i].events;
+            event.data.ptr = &settings->fds[i];
+            settings->fds[i].revents = 0;
+
+            ret = epoll_ctl(epfd, EPOLL_CTL_ADD, settings->fds[i].fd, &event);
+            openxt_assert_ret(ret == 0, ret, -errno);
+        }
+    }
+    else {
+
+        // This must happen before the PCM is closed, or its fds reused
+        for (i = 0; i < settings->nfds; i++)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, settings->fds[i].fd, NULL);
+
+        settings->nfds = 0;
+    }
+
+    settings->watched = watch;
+
+    // Done
+    return 0;
+}
+
+///
+/// Gets what a watched PCM is ready for, from the events epoll returned for
+/// its descriptors, and clears them for the next round.
+///
+/// @param settings the stream to check
+/// @return negative error code on failure
+///         poll events (POLLIN, POLLOUT, POLLERR) on success
+///
+static int openxt_pcm_ready(Settings *settings)
+{
+    int i;
+    int ret = 0;
+    bool pending = false;
+
+    for (i = 0; i < settings->nfds; i++)
+        pending |= (settings->fds[i].revents != 0);
+
+    if (pending == false)
+        return 0;
+
+    ret = openxt_alsa_poll_revents(settings, settings->fds, settings->nfds);
+
+    for (i = 0; i < settings->nfds; i++)
+        settings->fds[i].revents = 0;
+
+    return ret;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Playback Functions                                                                                  //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ///
+/// Hands as much of the jitter buffer to ALSA as it will take without
+/// blocking. Whatever is left is written once the PCM polls writable.
 ///
+/// @return negative error code on failure
+///         0 on success
 ///
-/// @param
-/// @return -EINVAL
-///         -EINVAL
+static int openxt_flush_playback(void)
+{
+    int ret;
+    int32_t size;
+    void *samples;
+
+    // Nothing to flush until the stream is initialized
+    openxt_assert_quiet(playback_settings->jitter != NULL, 0);
+
+    while ((size = openxt_jitter_peek(playback_settings->jitter, &samples)) > 0) {
+
+        ret = openxt_alsa_writei(playback_settings,
+                                 samples,
+                                 size / playback_settings->sample_size,
+                                 size);
+        openxt_assert_ret(ret >= 0, ret, ret);
+
+        // ALSA is full
+        if (ret == 0)
+            break;
+
+        ret = openxt_jitter_consume(playback_settings->jitter, ret * playback_settings->sample_size);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    // Done
+    return 0;
+}
+
+///
+/// Queues the samples in a playback packet. With a negotiated packet size a
+/// packet may carry several periods. The samples go through the jitter
+/// buffer so that a full PCM never stalls the receive loop; QEMU is paced by
+/// OPENXT_PLAYBACK_GET_AVAILABLE, so if the buffer still overflows the
+/// excess is dropped. With OPENXT_INIT_DRIFT the samples are resampled on
+/// the way in, steered by how much is queued for the sound card. Samples
+/// that were received straight into the sound card's buffer are skipped.
+///
+/// @return -EINVAL number of samples > max packet size
 ///         negative error code on failure
 ///         0 on success
 ///
 static int openxt_process_playback(void)
 {
     int ret;
+    int32_t size;
+    int32_t fill;
+    int32_t skip;
+    int16_t *samples;
 
-    ret = openxt_alsa_writei(playback_settings,
-                             playback_packet->samples,
-                             playback_packet->num_samples,
-                             MAX_PCM_BUFFER_SIZE);
-    openxt_assert_ret(ret == playback_packet->num_samples, ret, -EPIPE);
+    skip = playback_direct;
+    playback_direct = 0;
 
-    return 0;
+    size = playback_packet->num_samples * playback_settings->sample_size;
+    openxt_assert(size >= 0 && size <= playback_settings->max_packet_size, -EINVAL);
+
+    size -= skip * playback_settings->sample_size;
+    samples = (int16_t *)(playback_packet->samples + skip * playback_settings->sample_size);
+
+    if (playback_settings->resampler != NULL) {
+
+        fill = openxt_jitter_used(playback_settings->jitter) / playback_settings->sample_size;
+        fill += openxt_alsa_get_delay(playback_settings);
+
+        ret = openxt_resampler_adjust(playback_settings->resampler, fill);
+        openxt_assert_ret(ret == 0, ret, ret);
+        ret = openxt_resampler_process(playback_settings->resampler, samples, size / playback_settings->sample_size, &samples);
+        openxt_assert_ret(ret >= 0, ret, ret);
+
+        size = ret * playback_settings->sample_size;
+    }
+
+    // Make room first if we can
+    if (openxt_jitter_free(playback_settings->jitter) < size) {
+        ret = openxt_flush_playback();
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    ret = openxt_jitter_write(playback_settings->jitter, samples, size);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    if (ret < size)
+        openxt_warn("playback overrun, dropped %d samples\n", (size - ret) / playback_settings->sample_size);
+
+    return openxt_flush_playback();
 }
 
 ///
@@ -91,10 +340,33 @@ static int openxt_process_playback_init(void)
 {
     int ret;
     int valid = 1;
+    int32_t length;
+
+    // The ack only carries back what QEMU asked for
+    length = openxt_negotiate(playback_settings, OPENXT_INIT_DELAY | OPENXT_INIT_DRIFT);
+    length = INIT_ACK_PACKET_LENGTH(OpenXTPlaybackInitAckPacket, length);
+
+    // Two packets worth of buffering lets a whole packet be queued while
+    // the previous one is still going out to the sound card
+    openxt_jitter_destroy(playback_settings->jitter);
+    playback_settings->jitter = NULL;
+    openxt_resampler_destroy(playback_settings->resampler);
+    playback_settings->resampler = NULL;
 
     // Set the valid bit
     valid &= (openxt_alsa_init(playback_settings) == 0) ? 1 : 0;
     valid &= (openxt_alsa_mixer_init(playback_settings) == 0) ? 1 : 0;
+    valid &= (openxt_jitter_create(&playback_settings->jitter, 2 * playback_settings->max_packet_size) == 0) ? 1 : 0;
+
+    // Hold the sound card half full. Without a resampler, QEMU is told
+    // that it is not getting drift compensation.
+    if (valid && (playback_settings->flags & OPENXT_INIT_DRIFT)) {
+        ret = openxt_resampler_create(&playback_settings->resampler,
+                                      playback_settings->buffer_size / 2,
+                                      playback_settings->max_packet_size / playback_settings->sample_size);
+        if (ret != 0)
+            playback_settings->flags &= ~OPENXT_INIT_DRIFT;
+    }
 
     // Store the resulting valid state for later use.
     playback_settings->valid = valid;
@@ -102,7 +374,7 @@ static int openxt_process_playback_init(void)
     // Setup the ack packet
     ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_PLAYBACK_INIT_ACK);
     openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_v4v_set_length(&snd_packet, sizeof(OpenXTPlaybackInitAckPacket));
+    ret = openxt_v4v_set_length(&snd_packet, length);
     openxt_assert_ret(ret == 0, ret, ret);
 
     // Setup the ack body that will be sent back to QEMU. Specifically we need to
@@ -112,10 +384,12 @@ static int openxt_process_playback_init(void)
     playback_init_ack_packet->freq = playback_settings->freq;
     playback_init_ack_packet->valid = playback_settings->valid;
     playback_init_ack_packet->nchannels = playback_settings->nchannels;
+    playback_init_ack_packet->max_packet_size = playback_settings->max_packet_size;
+    playback_init_ack_packet->flags = playback_settings->flags;
 
     // Send the ack.
     ret = openxt_v4v_send(conn, &snd_packet);
-    openxt_assert_ret(ret == sizeof(OpenXTPlaybackInitAckPacket), ret, ret);
+    openxt_assert_ret(ret == length, ret, ret);
 
     // Success
     return 0;
@@ -123,9 +397,16 @@ static int openxt_process_playback_init(void)
 
 static int openxt_process_playback_fini(void)
 {
+    openxt_watch_pcm(playback_settings, false);
     openxt_alsa_mixer_fini(playback_settings);
+    playback_settings->volume_pending = false;
     openxt_alsa_fini(playback_settings);
 
+    openxt_jitter_destroy(playback_settings->jitter);
+    playback_settings->jitter = NULL;
+    openxt_resampler_destroy(playback_settings->resampler);
+    playback_settings->resampler = NULL;
+
     // No validation code on fini. If there is an error there really isn't
     // much you can do about it and you want as much of the code closing
     // down safely as possible
@@ -133,20 +414,70 @@ static int openxt_process_playback_fini(void)
     return 0;
 }
 
-static int openxt_process_playback_set_volume(void)
+static int64_t openxt_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+///
+/// Works out how long until a held back volume is due
+///
+/// @param settings the playback stream
+/// @return -1 if no volume is held back, the ms to wait otherwise
+///
+static int openxt_volume_wait(Settings *settings)
+{
+    int64_t now;
+
+    if (settings->volume_pending == false)
+        return -1;
+
+    now = openxt_now_ms();
+    return (settings->volume_due > now) ? (int)(settings->volume_due - now) : 0;
+}
+
+///
+/// Sets the volume QEMU last asked for, unless one was set less than
+/// VOLUME_INTERVAL_MS ago. Dragging a volume slider in the guest sends a
+/// packet for every step; the ones that come too quickly are held back, and
+/// only the last of them is set once the interval is up.
+///
+/// @param settings the playback stream
+/// @return negative error code on failure
+///         0 on success, or if the volume is held back
+///
+static int openxt_apply_volume(Settings *settings)
 {
     int ret;
 
-    ret = openxt_alsa_mixer_sget(playback_settings);
+    if (openxt_volume_wait(settings) != 0)
+        return 0;
+
+    settings->volume_pending = false;
+    settings->volume_due = openxt_now_ms() + VOLUME_INTERVAL_MS;
+
+    ret = openxt_alsa_mixer_sget(settings);
     openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_alsa_mixer_sset_volume(playback_settings, playback_set_volume_packet->vol);
+    ret = openxt_alsa_mixer_sset_volume(settings, settings->pending_volume);
     openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_alsa_mixer_sset_switch(playback_settings, playback_set_volume_packet->enabled);
+    ret = openxt_alsa_mixer_sset_switch(settings, settings->pending_enabled);
     openxt_assert_ret(ret == 0, ret, ret);
 
     return 0;
 }
 
+static int openxt_process_playback_set_volume(void)
+{
+    playback_settings->pending_volume = playback_set_volume_packet->vol;
+    playback_settings->pending_enabled = playback_set_volume_packet->enabled;
+    playback_settings->volume_pending = true;
+
+    return openxt_apply_volume(playback_settings);
+}
+
 static int openxt_process_playback_enable_voice(void)
 {
     int ret;
@@ -161,28 +492,57 @@ static int openxt_process_playback_disable_voice(void)
 {
     int ret;
 
+    ret = openxt_jitter_reset(playback_settings->jitter);
+    openxt_assert_ret(ret == 0, ret, ret);
     ret = openxt_alsa_drop(playback_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
+    // The next stream starts from scratch
+    if (playback_settings->resampler != NULL)
+        openxt_resampler_reset(playback_settings->resampler);
+
     return 0;
 }
 
+///
+/// Tells QEMU how many samples it can send. This is what the PCM has room
+/// for, less what is still waiting in the jitter buffer, and never more than
+/// the jitter buffer can take. With OPENXT_INIT_DELAY, QEMU also gets the
+/// latency of the stream.
+///
+/// @return negative error code on failure
+///         0 on success
+///
 static int openxt_process_playback_get_available(void)
 {
     int ret;
+    int32_t available;
+    int32_t queued;
+    int32_t length;
+
+    length = GET_AVAILABLE_ACK_PACKET_LENGTH(OpenXTPlaybackGetAvailableAckPacket, playback_settings->flags);
 
     // Setup the packet.
     ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_PLAYBACK_GET_AVAILABLE_ACK);
     openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_v4v_set_length(&snd_packet, sizeof(OpenXTPlaybackGetAvailableAckPacket));
+    ret = openxt_v4v_set_length(&snd_packet, length);
     openxt_assert_ret(ret == 0, ret, ret);
 
+    // Get whatever ALSA can take out of the way first.
+    ret = openxt_flush_playback();
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    queued = openxt_jitter_used(playback_settings->jitter) / playback_settings->sample_size;
+    available = openxt_alsa_get_available(playback_settings) - queued;
+    available = min(available, openxt_jitter_free(playback_settings->jitter) / playback_settings->sample_size);
+
     // Fill in the packet's contents.
-    playback_get_available_ack_packet->available = openxt_alsa_get_available(playback_settings);
+    playback_get_available_ack_packet->available = max(available, 0);
+    playback_get_available_ack_packet->delay = openxt_alsa_get_delay(playback_settings) + queued;
 
     // Send the packet.
     ret = openxt_v4v_send(conn, &snd_packet);
-    openxt_assert_ret(ret == sizeof(OpenXTPlaybackGetAvailableAckPacket), ret, ret);
+    openxt_assert_ret(ret == length, ret, ret);
 
     // Success
     return 0;
@@ -192,18 +552,40 @@ static int openxt_process_playback_get_available(void)
 // Playback Functions                                                                                  //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static int openxt_process_capture(void)
+///
+/// Reads up to num samples from the capture PCM, and sends them to QEMU in an
+/// OPENXT_CAPTURE_ACK. The capture PCM is non-blocking, so this may be 0.
+/// When the PCM's buffer is mapped, the samples are sent straight out of it.
+///
+/// @param num the most samples to send
+/// @return negative error code on failure
+///         number of samples sent on success
+///
+static int openxt_send_capture(int32_t num)
 {
     int ret;
     int nread;
+    int32_t offset;
+    void *area = NULL;
+
+    // Never ask for more than fits in the packet.
+    if (num > capture_settings->max_packet_size / capture_settings->sample_size)
+        num = capture_settings->max_packet_size / capture_settings->sample_size;
 
-    // Fill in the packet with the samples from the sound card.
-    nread = openxt_alsa_readi(capture_settings,
-                              capture_ack_packet->samples,
-                              capture_packet->num_samples,
-                              MAX_PCM_BUFFER_SIZE);
+    // Use the sound card's buffer if we can, otherwise fill in the packet
+    // with the samples from the sound card. A mapped PCM that has nothing
+    // ready yet just gets an empty ack.
+    nread = openxt_alsa_mmap_begin(capture_settings, &area, &offset, num);
     openxt_assert_ret(nread >= 0, nread, nread);
 
+    if (area == NULL && capture_settings->mmap == false) {
+        nread = openxt_alsa_readi(capture_settings,
+                                  capture_ack_packet->samples,
+                                  num,
+                                  capture_settings->max_packet_size);
+        openxt_assert_ret(nread >= 0, nread, nread);
+    }
+
     // Setup the packet.
     ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_CAPTURE_ACK);
     openxt_assert_ret(ret == 0, ret, ret);
@@ -213,9 +595,65 @@ static int openxt_process_capture(void)
     capture_ack_packet->num_samples = nread;
 
     // Send the packet.
-    ret = openxt_v4v_send(conn, &snd_packet);
+    if (area == NULL) {
+        ret = openxt_v4v_send(conn, &snd_packet);
+        openxt_assert_ret(ret == CAPTURE_ACK_PACKET_LENGTH(nread), ret, ret);
+
+        return nread;
+    }
+
+    ret = openxt_v4v_send_from(conn,
+                               &snd_packet,
+                               offsetof(OpenXTCaptureAckPacket, samples),
+                               area,
+                               nread * capture_settings->sample_size);
     openxt_assert_ret(ret == CAPTURE_ACK_PACKET_LENGTH(nread), ret, ret);
 
+    // The samples are gone, let ALSA have the space back
+    ret = openxt_alsa_mmap_commit(capture_settings, offset, nread);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    // Success
+    return nread;
+}
+
+///
+/// Sends QEMU whatever the capture PCM has, once it polls readable. Only used
+/// when QEMU asked for OPENXT_INIT_CAPTURE_PUSH.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_push_capture(void)
+{
+    int ret;
+    int32_t num;
+
+    num = capture_settings->max_packet_size / capture_settings->sample_size;
+
+    // Keep going while there are full packets to send
+    do {
+        ret = openxt_send_capture(num);
+        openxt_assert_ret(ret >= 0, ret, ret);
+    } while (ret == num);
+
+    // Success
+    return 0;
+}
+
+///
+/// Answers an OPENXT_CAPTURE request from QEMU.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_process_capture(void)
+{
+    int ret;
+
+    ret = openxt_send_capture(capture_packet->num_samples);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
     // Success
     return 0;
 }
@@ -224,6 +662,11 @@ static int openxt_process_capture_init(void)
 {
     int ret;
     int valid = 1;
+    int32_t length;
+
+    // See openxt_process_playback_init
+    length = openxt_negotiate(capture_settings, OPENXT_INIT_CAPTURE_PUSH | OPENXT_INIT_DELAY);
+    length = INIT_ACK_PACKET_LENGTH(OpenXTCaptureInitAckPacket, length);
 
     // Set the valid bit
     valid &= (openxt_alsa_init(capture_settings) == 0) ? 1 : 0;
@@ -234,7 +677,7 @@ static int openxt_process_capture_init(void)
     // Setup the ack packet
     ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_CAPTURE_INIT_ACK);
     openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_v4v_set_length(&snd_packet, sizeof(OpenXTCaptureInitAckPacket));
+    ret = openxt_v4v_set_length(&snd_packet, length);
     openxt_assert_ret(ret == 0, ret, ret);
 
     // Setup the ack body that will be sent back to QEMU. Specifically we need to
@@ -244,10 +687,12 @@ static int openxt_process_capture_init(void)
     capture_init_ack_packet->freq = capture_settings->freq;
     capture_init_ack_packet->valid = capture_settings->valid;
     capture_init_ack_packet->nchannels = capture_settings->nchannels;
+    capture_init_ack_packet->max_packet_size = capture_settings->max_packet_size;
+    capture_init_ack_packet->flags = capture_settings->flags;
 
     // Send the ack.
     ret = openxt_v4v_send(conn, &snd_packet);
-    openxt_assert_ret(ret == sizeof(OpenXTCaptureInitAckPacket), ret, ret);
+    openxt_assert_ret(ret == length, ret, ret);
 
     // Success
     return 0;
@@ -255,6 +700,7 @@ static int openxt_process_capture_init(void)
 
 static int openxt_process_capture_fini(void)
 {
+    openxt_watch_pcm(capture_settings, false);
     openxt_alsa_fini(capture_settings);
 
     // No validation code on fini. If there is an error there really isn't
@@ -273,6 +719,44 @@ static int openxt_process_capture_enable_voice(void)
     ret = openxt_alsa_start(capture_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
+    // From now on samples are sent as they come in
+    if (capture_settings->flags & OPENXT_INIT_CAPTURE_PUSH) {
+        ret = openxt_watch_pcm(capture_settings, true);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    return 0;
+}
+
+///
+/// Tells QEMU how many samples are waiting to be read, and with
+/// OPENXT_INIT_DELAY, how old the oldest of them is.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_process_capture_get_available(void)
+{
+    int ret;
+    int32_t length;
+
+    length = GET_AVAILABLE_ACK_PACKET_LENGTH(OpenXTCaptureGetAvailableAckPacket, capture_settings->flags);
+
+    // Setup the packet.
+    ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_CAPTURE_GET_AVAILABLE_ACK);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_v4v_set_length(&snd_packet, length);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // Fill in the packet's contents.
+    capture_get_available_ack_packet->available = max(openxt_alsa_get_available(capture_settings), 0);
+    capture_get_available_ack_packet->delay = openxt_alsa_get_delay(capture_settings);
+
+    // Send the packet.
+    ret = openxt_v4v_send(conn, &snd_packet);
+    openxt_assert_ret(ret == length, ret, ret);
+
+    // Success
     return 0;
 }
 
@@ -280,6 +764,8 @@ static int openxt_process_capture_disable_voice(void)
 {
     int ret;
 
+    ret = openxt_watch_pcm(capture_settings, false);
+    openxt_assert_ret(ret == 0, ret, ret);
     ret = openxt_alsa_drop(capture_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
@@ -287,64 +773,463 @@ static int openxt_process_capture_disable_voice(void)
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Main                                                                                                //
+// VM Functions                                                                                        //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-int openxt_vmaudio(int argc, char *argv[])
+///
+/// Makes a stubdomain the one that the packet handlers work on, and the one
+/// that packets are sent to.
+///
+/// @param vm the stubdomain to service
+///
+static void openxt_vm_select(VMAudio *vm)
+{
+    playback_settings = vm->playback_settings;
+    capture_settings = vm->capture_settings;
+
+    conn->remote_addr = vm->addr;
+}
+
+///
+/// Finds the stubdomain a packet came from
+///
+/// @param stubdomid the domain id to look for
+/// @return NULL if this stubdomain is not being served yet, the VM otherwise
+///
+static VMAudio *openxt_vm_find(int32_t stubdomid)
+{
+    VMAudio *vm;
+
+    for (vm = vms; vm != NULL; vm = vm->next) {
+        if (vm->stubdomid == stubdomid)
+            return vm;
+    }
+
+    return NULL;
+}
+
+///
+/// Stops serving a stubdomain, and releases everything it had open
+///
+/// @param vm the stubdomain to remove
+///
+static void openxt_vm_destroy(VMAudio *vm)
+{
+    VMAudio **link;
+
+    // Unlink
+    for (link = &vms; *link != NULL; link = &(*link)->next) {
+        if (*link == vm) {
+            *link = vm->next;
+            break;
+        }
+    }
+
+    // Stop waiting on anything
+    openxt_watch_pcm(vm->playback_settings, false);
+    openxt_watch_pcm(vm->capture_settings, false);
+
+    // Remove the PCM
+    openxt_alsa_remove_pcm(vm->playback_settings);
+
+    // Safely shutdown ALSA mixer
+    openxt_alsa_mixer_fini(vm->playback_settings);
+
+    // Safely shutdown ALSA
+    openxt_alsa_fini(vm->playback_settings);
+    openxt_alsa_fini(vm->capture_settings);
+
+    // Cleanup
+    openxt_jitter_destroy(vm->playback_settings->jitter);
+    vm->playback_settings->jitter = NULL;
+    openxt_resampler_destroy(vm->playback_settings->resampler);
+    vm->playback_settings->resampler = NULL;
+    openxt_alsa_destroy(vm->playback_settings);
+    openxt_alsa_destroy(vm->capture_settings);
+
+    if (playback_settings == vm->playback_settings) {
+        playback_settings = NULL;
+        capture_settings = NULL;
+    }
+
+    free(vm);
+}
+
+///
+/// Watches xenstore for domains going away, so that a stubdomain that is
+/// destroyed without sending its fini can be dropped. Its events are told
+/// apart from the others by the xenstore handle's pointer.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_vm_watch_domains(void)
 {
-    // Local variables
     int ret;
-    int32_t opcode = 0;
-    int32_t stubdomid = 0;
+    struct epoll_event event;
 
-    // Make sure that we have the right number of arguments.
-    if (argc != 2) {
-        openxt_info("wrong syntax: expecting %s <stubdomid>\n", argv[0]);
-        return -EINVAL;
+    xsh = xs_domain_open();
+    openxt_checkp(xsh, -ENODEV);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = xsh;
+
+    ret = -EIO;
+    openxt_assert_goto(xs_watch(xsh, "@releaseDomain", "vmaudio") == true, failure);
+
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, xs_fileno(xsh), &event);
+    if (ret != 0)
+        ret = -errno;
+    openxt_assert_goto(ret == 0, failure);
+
+    return 0;
+
+failure:
+
+    xs_daemon_close(xsh);
+    xsh = NULL;
+
+    return ret;
+}
+
+///
+/// Drops every stubdomain that is no longer there. Called when the
+/// @releaseDomain watch fires, which it does for any domain going away.
+///
+static void openxt_vm_reap(void)
+{
+    char **watch;
+    unsigned int num;
+    VMAudio *vm;
+    VMAudio *next;
+
+    // There is only the one watch, so there is nothing to look at in it
+    watch = xs_read_watch(xsh, &num);
+    free(watch);
+
+    for (vm = vms; vm != NULL; vm = next) {
+        next = vm->next;
+
+        if (xs_is_domain_introduced(xsh, vm->stubdomid) == true)
+            continue;
+
+        openxt_warn("stubdomain %d went away, dropping it\n", vm->stubdomid);
+        openxt_vm_destroy(vm);
     }
+}
 
-    // Get the stubdomain's id
-    stubdomid = atoi(argv[1]);
+///
+/// Starts serving a stubdomain. The streams are set up here, but nothing is
+/// opened until QEMU asks for it.
+///
+/// @param stubdomid the stubdomain's domain id
+/// @param addr the V4V address QEMU sends from
+/// @return NULL on failure, the new VM on success
+///
+static VMAudio *openxt_vm_create(int32_t stubdomid, v4v_addr_t *addr)
+{
+    int ret;
+    VMAudio *vm;
+
+    vm = (VMAudio *)calloc(1, sizeof(VMAudio));
+    openxt_checkp(vm, NULL);
+
+    vm->stubdomid = stubdomid;
+    vm->addr = *addr;
 
     // Create the settings structures.
-    ret = openxt_alsa_create(&playback_settings);
-    openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_alsa_create(&capture_settings);
-    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_alsa_create(&vm->playback_settings);
+    openxt_assert_goto(ret == 0, failure);
+    ret = openxt_alsa_create(&vm->capture_settings);
+    openxt_assert_goto(ret == 0, failure);
 
     // Setup the playback ALSA settings. Note that because the format is
     // 16 bit signed little endian with 2 channels, the total sample size per
     // channel is 32 bits.
-    playback_settings->fmt = SND_PCM_FORMAT_S16_LE;
-    playback_settings->freq = 44100;
-    playback_settings->mode = 0;
-    playback_settings->stream = SND_PCM_STREAM_PLAYBACK;
-    playback_settings->nchannels = 2;
-    playback_settings->sample_size = sizeof(uint32_t);
-    playback_settings->selement_index = 0;
+    vm->playback_settings->fmt = SND_PCM_FORMAT_S16_LE;
+    vm->playback_settings->freq = 44100;
+    vm->playback_settings->mode = SND_PCM_NONBLOCK;
+    vm->playback_settings->stream = SND_PCM_STREAM_PLAYBACK;
+    vm->playback_settings->nchannels = 2;
+    vm->playback_settings->sample_size = sizeof(uint32_t);
+    vm->playback_settings->max_packet_size = MAX_PCM_BUFFER_SIZE;
+    vm->playback_settings->selement_index = 0;
 
     // Setup the capture ALSA settings. Note that because the format is
     // 16 bit signed little endian with 2 channels, the total sample size per
     // channel is 32 bits.
-    capture_settings->fmt = SND_PCM_FORMAT_S16_LE;
-    capture_settings->freq = 44100;
-    capture_settings->mode = SND_PCM_NONBLOCK;
-    capture_settings->stream = SND_PCM_STREAM_CAPTURE;
-    capture_settings->nchannels = 2;
-    capture_settings->sample_size = sizeof(uint32_t);
-    capture_settings->selement_index = 0;
+    vm->capture_settings->fmt = SND_PCM_FORMAT_S16_LE;
+    vm->capture_settings->freq = 44100;
+    vm->capture_settings->mode = SND_PCM_NONBLOCK;
+    vm->capture_settings->stream = SND_PCM_STREAM_CAPTURE;
+    vm->capture_settings->nchannels = 2;
+    vm->capture_settings->sample_size = sizeof(uint32_t);
+    vm->capture_settings->max_packet_size = MAX_PCM_BUFFER_SIZE;
+    vm->capture_settings->selement_index = 0;
 
     // Set the ALSA device names. These device names exist inside of the
     // ALSA configuration file, so we need to make sure that they match. To
     // see where these are being set, look at the audio_helper_start script.
-    snprintf(capture_settings->pcm_name, MAX_NAME_LENGTH, "dsnoop0");
-    snprintf(playback_settings->pcm_name, MAX_NAME_LENGTH, "plug:vm-%d", stubdomid - 1);
-    snprintf(playback_settings->selement_name, MAX_NAME_LENGTH, "vm-%d", stubdomid - 1);
+    snprintf(vm->capture_settings->pcm_name, MAX_NAME_LENGTH, "dsnoop0");
+    snprintf(vm->playback_settings->pcm_name, MAX_NAME_LENGTH, "plug:vm-%d", stubdomid - 1);
+    snprintf(vm->playback_settings->selement_name, MAX_NAME_LENGTH, "vm-%d", stubdomid - 1);
+
+    // Link
+    vm->next = vms;
+    vms = vm;
+
+    // Success
+    return vm;
+
+failure:
+
+    // Cleanup
+    openxt_alsa_destroy(vm->playback_settings);
+    openxt_alsa_destroy(vm->capture_settings);
+    free(vm);
+
+    // Failure
+    return NULL;
+}
+
+///
+/// Handles a packet from the selected stubdomain
+///
+/// @param opcode the packet's opcode
+/// @return -EINVAL unknown opcode
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_process_packet(int32_t opcode)
+{
+    switch(opcode) {
+
+        case OPENXT_FINI:
+            return 0;
+
+        case OPENXT_PLAYBACK:
+            return openxt_process_playback();
+
+        case OPENXT_PLAYBACK_INIT:
+            return openxt_process_playback_init();
+
+        case OPENXT_PLAYBACK_FINI:
+            return openxt_process_playback_fini();
+
+        case OPENXT_PLAYBACK_SET_VOLUME:
+            return openxt_process_playback_set_volume();
+
+        case OPENXT_PLAYBACK_ENABLE_VOICE:
+            return openxt_process_playback_enable_voice();
+
+        case OPENXT_PLAYBACK_DISABLE_VOICE:
+            return openxt_process_playback_disable_voice();
+
+        case OPENXT_PLAYBACK_GET_AVAILABLE:
+            return openxt_process_playback_get_available();
+
+        case OPENXT_CAPTURE:
+            return openxt_process_capture();
+
+        case OPENXT_CAPTURE_INIT:
+            return openxt_process_capture_init();
+
+        case OPENXT_CAPTURE_FINI:
+            return openxt_process_capture_fini();
+
+        case OPENXT_CAPTURE_ENABLE_VOICE:
+            return openxt_process_capture_enable_voice();
+
+        case OPENXT_CAPTURE_DISABLE_VOICE:
+            return openxt_process_capture_disable_voice();
+
+        case OPENXT_CAPTURE_GET_AVAILABLE:
+            return openxt_process_capture_get_available();
+
+        default:
+            openxt_warn("unknown packet opcode: %d\n", opcode);
+            return -EINVAL;
+    }
+}
+
+///
+/// Services a stubdomain's PCMs once epoll has said something happened on
+/// them: the playback PCM has room for what is queued, or the capture PCM has
+/// samples to push. A volume that was held back is set once it is due.
+///
+/// @param vm the stubdomain to service
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_vm_process_pcm(VMAudio *vm)
+{
+    int ret;
+
+    openxt_vm_select(vm);
+
+    // The sound card has room
+    ret = openxt_pcm_ready(playback_settings);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    if (ret & (POLLOUT | POLLERR)) {
+        ret = openxt_flush_playback();
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    // The sound card has samples for QEMU
+    ret = openxt_pcm_ready(capture_settings);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    if (ret & (POLLIN | POLLERR)) {
+        ret = openxt_push_capture();
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    // The volume slider has stopped moving, or been moving for a while
+    ret = openxt_apply_volume(playback_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // Success
+    return 0;
+}
+
+///
+/// Receives the next packet from V4V. Its header is peeked at first: if it
+/// is a playback packet from a stubdomain whose sound card can take samples
+/// straight into its buffer, the samples are received right into it, saving
+/// a copy. That is only done while nothing is queued in front of them, and
+/// they are not being resampled. Anything else is received into rcv_packet
+/// as usual.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_recv_packet(void)
+{
+    int ret;
+    int32_t num = 0;
+    int32_t head;
+    int32_t size;
+    int32_t length;
+    int32_t offset = 0;
+    void *area = NULL;
+    VMAudio *vm;
+    Settings *settings = NULL;
+
+    playback_direct = 0;
+    head = offsetof(OpenXTPlaybackPacket, samples);
+
+    // Who is it from, and what is it
+    ret = openxt_v4v_peek(conn, &rcv_packet, head);
+    openxt_assert_ret(ret >= 0 || ret == -EIO, ret, ret);
+
+    vm = openxt_vm_find(conn->remote_addr.domain);
+
+    if (ret == head &&
+        openxt_v4v_get_opcode(&rcv_packet) == OPENXT_PLAYBACK &&
+        vm != NULL)
+        settings = vm->playback_settings;
+
+    if (settings != NULL &&
+        settings->handle != NULL &&
+        settings->resampler == NULL &&
+        settings->jitter != NULL &&
+        openxt_jitter_used(settings->jitter) == 0) {
+
+        num = min(playback_packet->num_samples, settings->max_packet_size / settings->sample_size);
+        num = openxt_alsa_mmap_begin(settings, &area, &offset, num);
+        num = max(num, 0);
+    }
+
+    // The usual way
+    if (num == 0) {
+        ret = openxt_v4v_recv(conn, &rcv_packet);
+        openxt_assert_ret(ret >= 0, ret, ret);
+
+        return 0;
+    }
+
+    size = num * settings->sample_size;
+
+    ret = openxt_v4v_recv_into(conn, &rcv_packet, head, area, size);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    length = ret;
+
+    // Still the packet that was peeked at: hand over what landed in it
+    if (openxt_vm_find(conn->remote_addr.domain) == vm &&
+        openxt_v4v_get_opcode(&rcv_packet) == OPENXT_PLAYBACK &&
+        length >= head &&
+        playback_packet->num_samples >= 0 &&
+        playback_packet->num_samples * settings->sample_size <= settings->max_packet_size) {
+
+        num = min(num, playback_packet->num_samples);
+        num = min(num, (length - head) / settings->sample_size);
+
+        // Those samples are only in the sound card's buffer, so if ALSA
+        // will not take them they are lost, like any other underrun.
+        ret = openxt_alsa_mmap_commit(settings, offset, num);
+        if (ret < 0)
+            openxt_warn("playback commit failed, dropped %d samples: %d\n", num, ret);
+
+        playback_direct = num;
+        return 0;
+    }
+
+    // Not what was peeked at after all
+    if (length > head)
+        memcpy(rcv_packet.body.buffer + head, area, min(size, length - head));
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main                                                                                                //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int openxt_vmaudio(int argc, char *argv[])
+{
+    // Local variables
+    int i;
+    int ret;
+    int nevents;
+    int timeout;
+    int wait;
+    bool serve_all;
+    bool pending;
+    bool reap;
+    bool running = true;
+    int32_t opcode = 0;
+    int32_t stubdomid = 0;
+    VMAudio *vm = NULL;
+    VMAudio *next = NULL;
+    struct epoll_event event;
+    struct epoll_event events[MAX_EVENTS];
+
+    // Make sure that we have the right number of arguments.
+    if (argc != 2) {
+        openxt_info("wrong syntax: expecting %s <stubdomid | daemon>\n", argv[0]);
+        return -EINVAL;
+    }
+
+    // Get the stubdomain's id. As a daemon, we take packets from any domain,
+    // and a stubdomain is served from its first packet until its fini.
+    serve_all = (strncmp(argv[1], "daemon", 6) == 0);
+    stubdomid = (serve_all == true) ? V4V_DOMID_ANY : atoi(argv[1]);
+
+    // Every stubdomain's volume control is on the same card, so one mixer
+    // handle will do for all of them.
+    if (serve_all == true)
+        openxt_alsa_set_shared_mixer(true);
 
     // Cleanup memory (safety)
     memset(&snd_packet, 0, sizeof(V4VPacket));
     memset(&rcv_packet, 0, sizeof(V4VPacket));
 
+    // Pointer checks
+    openxt_checkp(init_packet = openxt_v4v_get_body(&rcv_packet), -EINVAL);
+
     // Pointer checks
     openxt_checkp(playback_packet = openxt_v4v_get_body(&rcv_packet), -EINVAL);
     openxt_checkp(playback_init_ack_packet = openxt_v4v_get_body(&snd_packet), -EINVAL);
@@ -358,6 +1243,7 @@ int openxt_vmaudio(int argc, char *argv[])
     openxt_checkp(capture_get_available_ack_packet = openxt_v4v_get_body(&snd_packet), -EINVAL);
 
     // Size checks
+    openxt_assert(openxt_v4v_validate(sizeof(OpenXTInitPacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackPacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackInitAckPacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackSetVolumePacket)) == true, -EINVAL);
@@ -373,100 +1259,147 @@ int openxt_vmaudio(int argc, char *argv[])
     conn = openxt_v4v_open(OPENXT_AUDIO_PORT, V4V_DOMID_ANY, V4V_PORT_NONE, stubdomid);
     openxt_assert_ret(conn != NULL, conn, -EINVAL);
 
-    // Process incoming commands from QEMU in the stubdomain. Once we get a
-    // "fini" command from QEMU, we know that we can stop executing.
-    while (opcode != OPENXT_FINI) {
+    // Setup epoll. The V4V connection is the only thing that is always
+    // watched; it is told apart from the PCMs by its NULL pointer.
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    openxt_assert_ret(epfd >= 0, epfd, -errno);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &event);
+    openxt_assert_ret(ret == 0, ret, -errno);
+
+    // A daemon also drops stubdomains that go away without a fini. Without
+    // xenstore they are still dropped on fini, or once talking to them fails.
+    if (serve_all == true && openxt_vm_watch_domains() != 0)
+        openxt_warn("not watching xenstore, stubdomains are only dropped on fini\n");
+
+    // Process incoming commands from QEMU in the stubdomain(s). When we are
+    // serving a single stubdomain, we stop once it sends its "fini" command.
+    while (running == true) {
+
+        // The connection is only closed when the socket itself is gone, and
+        // then there is nothing left to serve. Stop, and let whoever started
+        // us start us again.
+        if (openxt_v4v_isconnected(conn) == false) {
+            ret = -ENOTCONN;
+            goto done;
+        }
+
+        // Wait on the playback PCMs only while there are samples waiting to
+        // go to them. Capture PCMs are watched while they are pushing. Wake
+        // up in time for the first held back volume.
+        timeout = -1;
+        for (vm = vms; vm != NULL; vm = vm->next) {
+            ret = openxt_watch_pcm(vm->playback_settings, openxt_jitter_used(vm->playback_settings->jitter) > 0);
+            openxt_assert_ret(ret == 0, ret, ret);
+
+            wait = openxt_volume_wait(vm->playback_settings);
+            if (wait >= 0 && (timeout < 0 || wait < timeout))
+                timeout = wait;
+        }
 
-        // Wait for a packet to come in from V4V
-        ret = openxt_v4v_recv(conn, &rcv_packet);
-        openxt_assert_ret(ret >= 0, ret, ret);
+        nevents = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (nevents < 0 && errno == EINTR)
+            continue;
+        openxt_assert_ret(nevents >= 0, nevents, -errno);
+
+        // Hand the PCM events back to their pollfds, so ALSA can make sense
+        // of them all at once.
+        pending = false;
+        reap = false;
+        for (i = 0; i < nevents; i++) {
+            if (events[i].data.ptr == NULL)
+                pending = true;
+            else if (events[i].data.ptr == xsh)
+                reap = true;
+            else
+                ((struct pollfd *)events[i].data.ptr)->revents = events[i].events;
+        }
+
+        // Drop the stubdomains that went away before touching their PCMs
+        if (reap == true)
+            openxt_vm_reap();
+
+        // Service the PCMs. A stubdomain whose sound card fails is dropped
+        // rather than taking the others down with it.
+        for (vm = vms; vm != NULL; vm = next) {
+            next = vm->next;
+
+            ret = openxt_vm_process_pcm(vm);
+            if (ret == 0)
+                continue;
+            if (serve_all == false)
+                goto done;
+
+            openxt_warn("dropping stubdomain %d: %d\n", vm->stubdomid, ret);
+            openxt_vm_destroy(vm);
+        }
+
+        if (pending == false)
+            continue;
+
+        // Get the packet from V4V
+        ret = openxt_recv_packet();
+        if (ret < 0 && serve_all == false)
+            goto done;
+
+        // A packet that could not be received is dropped. If the connection
+        // went with it, that is caught at the top of the loop.
+        if (ret < 0) {
+            openxt_warn("dropping a packet from %d: %d\n", conn->remote_addr.domain, ret);
+            continue;
+        }
+
+        // Work out who it is from
+        opcode = openxt_v4v_get_opcode(&rcv_packet);
+        vm = openxt_vm_find(conn->remote_addr.domain);
+
+        if (vm == NULL && opcode != OPENXT_FINI) {
+            vm = openxt_vm_create(conn->remote_addr.domain, &conn->remote_addr);
+            if (vm == NULL) {
+                ret = -ENOMEM;
+                goto done;
+            }
+        }
+
+        if (vm == NULL)
+            continue;
 
         // Process the packet
-        switch(opcode = openxt_v4v_get_opcode(&rcv_packet)) {
-
-            case OPENXT_FINI:
-                break;
-
-            case OPENXT_PLAYBACK:
-                ret = openxt_process_playback();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_INIT:
-                ret = openxt_process_playback_init();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_FINI:
-                ret = openxt_process_playback_fini();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_SET_VOLUME:
-                ret = openxt_process_playback_set_volume();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_ENABLE_VOICE:
-                ret = openxt_process_playback_enable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_DISABLE_VOICE:
-                ret = openxt_process_playback_disable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_GET_AVAILABLE:
-                ret = openxt_process_playback_get_available();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_CAPTURE:
-                ret = openxt_process_capture();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_CAPTURE_INIT:
-                ret = openxt_process_capture_init();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_CAPTURE_FINI:
-                ret = openxt_process_capture_fini();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_CAPTURE_ENABLE_VOICE:
-                ret = openxt_process_capture_enable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_CAPTURE_DISABLE_VOICE:
-                ret = openxt_process_capture_disable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            default:
-                openxt_warn("unknown packet opcode: %d\n", opcode);
-                exit(-EINVAL);
+        openxt_vm_select(vm);
+        ret = openxt_process_packet(opcode);
+
+        if (ret != 0 && serve_all == false)
+            goto done;
+
+        if (ret != 0)
+            openxt_warn("dropping stubdomain %d: %d\n", vm->stubdomid, ret);
+
+        if (ret != 0 || opcode == OPENXT_FINI) {
+            openxt_vm_destroy(vm);
+            running = serve_all;
         }
     }
 
-    // Remove the PCM
-    openxt_alsa_remove_pcm(playback_settings);
+done:
 
-    // Safely shutdown ALSA mixer
-    openxt_alsa_mixer_fini(playback_settings);
+    // Cleanup
+    while (vms != NULL)
+        openxt_vm_destroy(vms);
 
-    // Safely shutdown ALSA
-    openxt_alsa_fini(playback_settings);
-    openxt_alsa_fini(capture_settings);
+    if (xsh != NULL)
+        xs_daemon_close(xsh);
+    xsh = NULL;
 
-    // Cleanup
-    openxt_alsa_destroy(playback_settings);
-    openxt_alsa_destroy(capture_settings);
+    close(epfd);
+    epfd = -1;
+
+    openxt_v4v_close(conn);
+    conn = NULL;
 
     // Done
-    return 0;
+    return ret;
 }
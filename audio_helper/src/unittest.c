@@ -512,6 +512,112 @@ void test_alsa(void)
     capture_settings = NULL;
 }
 
+void test_jitter(void)
+{
+    int32_t i;
+    void *data;
+    char in[96];
+    char out[96];
+    JitterBuffer *jitter = NULL;
+
+    for (i = 0; i < (int32_t)sizeof(in); i++)
+        in[i] = i;
+
+    // Validate improper usage of the API
+    UT_CHECK(openxt_jitter_create(NULL, 64) == -EINVAL);
+    UT_CHECK(openxt_jitter_create(&jitter, 0) == -EINVAL);
+    UT_CHECK(openxt_jitter_write(NULL, in, 16) == -EINVAL);
+    UT_CHECK(openxt_jitter_peek(NULL, &data) == -EINVAL);
+    UT_CHECK(openxt_jitter_consume(NULL, 0) == -EINVAL);
+    UT_CHECK(openxt_jitter_used(NULL) == 0);
+    UT_CHECK(openxt_jitter_free(NULL) == 0);
+    UT_CHECK(openxt_jitter_destroy(NULL) == 0);
+
+    // Validate proper usage of the API
+    UT_CHECK(openxt_jitter_create(&jitter, 64) == 0);
+    UT_CHECK(openxt_jitter_create(&jitter, 64) == -EINVAL);
+    UT_CHECK(openxt_jitter_used(jitter) == 0);
+    UT_CHECK(openxt_jitter_free(jitter) == 64);
+
+    // Only what fits is written
+    UT_CHECK(openxt_jitter_write(jitter, in, 48) == 48);
+    UT_CHECK(openxt_jitter_write(jitter, in + 48, 48) == 16);
+    UT_CHECK(openxt_jitter_free(jitter) == 0);
+    UT_CHECK(openxt_jitter_consume(jitter, 65) == -EINVAL);
+
+    // Make room, and make the next write wrap around the end
+    UT_CHECK(openxt_jitter_peek(jitter, &data) == 64);
+    UT_CHECK(memcmp(data, in, 64) == 0);
+    UT_CHECK(openxt_jitter_consume(jitter, 40) == 0);
+    UT_CHECK(openxt_jitter_write(jitter, in + 64, 32) == 32);
+    UT_CHECK(openxt_jitter_used(jitter) == 56);
+
+    // Validate that the data comes out in order, in two pieces
+    UT_CHECK(openxt_jitter_peek(jitter, &data) == 24);
+    memcpy(out, data, 24);
+    UT_CHECK(openxt_jitter_consume(jitter, 24) == 0);
+    UT_CHECK(openxt_jitter_peek(jitter, &data) == 32);
+    memcpy(out + 24, data, 32);
+    UT_CHECK(openxt_jitter_consume(jitter, 32) == 0);
+    UT_CHECK(memcmp(out, in + 40, 56) == 0);
+
+    // Validate reset
+    UT_CHECK(openxt_jitter_write(jitter, in, 16) == 16);
+    UT_CHECK(openxt_jitter_reset(jitter) == 0);
+    UT_CHECK(openxt_jitter_used(jitter) == 0);
+    UT_CHECK(openxt_jitter_peek(jitter, &data) == 0);
+
+    // Cleanup
+    UT_CHECK(openxt_jitter_destroy(jitter) == 0);
+}
+
+void test_resampler(void)
+{
+    int32_t i;
+    int32_t num;
+    int16_t in[256 * 2];
+    int16_t *out = NULL;
+    Resampler *resampler = NULL;
+
+    for (i = 0; i < 256 * 2; i++)
+        in[i] = i * 16;
+
+    // Validate improper usage of the API
+    UT_CHECK(openxt_resampler_create(NULL, 1024, 256) == -EINVAL);
+    UT_CHECK(openxt_resampler_create(&resampler, 0, 256) == -EINVAL);
+    UT_CHECK(openxt_resampler_create(&resampler, 1024, 0) == -EINVAL);
+    UT_CHECK(openxt_resampler_adjust(NULL, 0) == -EINVAL);
+    UT_CHECK(openxt_resampler_process(NULL, in, 256, &out) == -EINVAL);
+    UT_CHECK(openxt_resampler_destroy(NULL) == 0);
+
+    // Validate proper usage of the API
+    UT_CHECK(openxt_resampler_create(&resampler, 1024, 256) == 0);
+    UT_CHECK(openxt_resampler_process(resampler, in, 257, &out) == -EINVAL);
+
+    // At the target, samples come out one sample late, but otherwise untouched
+    UT_CHECK(openxt_resampler_adjust(resampler, 1024) == 0);
+    UT_CHECK(openxt_resampler_process(resampler, in, 256, &out) == 256);
+    UT_CHECK(out[0] == 0 && out[1] == 0);
+    UT_CHECK(memcmp(&out[2], in, 255 * 2 * sizeof(int16_t)) == 0);
+
+    // Above the target, fewer samples come out
+    UT_CHECK(openxt_resampler_reset(resampler) == 0);
+    UT_CHECK(openxt_resampler_adjust(resampler, 2048) == 0);
+    for (i = 0, num = 0; i < 16; i++)
+        num += openxt_resampler_process(resampler, in, 256, &out);
+    UT_CHECK(num < 16 * 256);
+
+    // Below the target, more samples come out
+    UT_CHECK(openxt_resampler_reset(resampler) == 0);
+    UT_CHECK(openxt_resampler_adjust(resampler, 0) == 0);
+    for (i = 0, num = 0; i < 16; i++)
+        num += openxt_resampler_process(resampler, in, 256, &out);
+    UT_CHECK(num > 16 * 256);
+
+    // Cleanup
+    UT_CHECK(openxt_resampler_destroy(resampler) == 0);
+}
+
 ///
 /// ALSA_DEVICE="hw:1" ./audio_helper unittest test_capture > /storage/disks/test.snd
 ///
@@ -656,6 +762,8 @@ int openxt_unittest(int argc, char *argv[])
         openxt_info("available tests:\n");
         openxt_info("    - test_v4v\n");
         openxt_info("    - test_alsa\n");
+        openxt_info("    - test_jitter\n");
+        openxt_info("    - test_resampler\n");
         openxt_info("    - test_capture\n");
         openxt_info("    - test_playback\n");
         return -EINVAL;
@@ -673,6 +781,8 @@ int openxt_unittest(int argc, char *argv[])
     for (i = 2; i < argc; i++) {
         if (strcmp(argv[i], "test_v4v") == 0) test_v4v();
         if (strcmp(argv[i], "test_alsa") == 0) test_alsa();
+        if (strcmp(argv[i], "test_jitter") == 0) test_jitter();
+        if (strcmp(argv[i], "test_resampler") == 0) test_resampler();
         if (strcmp(argv[i], "test_capture") == 0) test_capture();
         if (strcmp(argv[i], "test_playback") == 0) test_playback();
     }
@@ -0,0 +1,149 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// Dates Modified:
+//  - 4/8/2015: Initial commit
+//    Rian Quinn <quinnr@ainfosec.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+//
+// A stand-in for libv4v, so that vmaudio-bench can run the real V4V code on
+// a machine without V4V. Every V4V address is an AF_UNIX datagram socket in
+// the abstract namespace named after its domain and port, which lets one
+// socket talk to many others by address the way the daemon does. Only what
+// openxtv4v.c uses is provided, and partner domains are not enforced.
+//
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include <libv4v.h>
+
+// Ports handed out to sockets bound with V4V_PORT_NONE
+static uint32_t next_port = 0x10000;
+
+///
+/// Works out the socket address for a V4V address. Anything bound to any
+/// domain is taken to be in dom0, like the daemon.
+///
+static socklen_t v4v_loopback_name(struct sockaddr_un *name, v4v_addr_t *addr)
+{
+    int ret;
+    uint32_t domain = (addr->domain == V4V_DOMID_ANY) ? 0 : addr->domain;
+
+    memset(name, 0, sizeof(*name));
+    name->sun_family = AF_UNIX;
+
+    ret = snprintf(name->sun_path + 1, sizeof(name->sun_path) - 1, "openxt-v4v-%u-%u", domain, addr->port);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + ret;
+}
+
+int v4v_socket(int type)
+{
+    return socket(AF_UNIX, type, 0);
+}
+
+int v4v_close(int fd)
+{
+    return close(fd);
+}
+
+int v4v_bind(int fd, v4v_addr_t *addr, domid_t partner)
+{
+    socklen_t len;
+    struct sockaddr_un name;
+
+    if (addr->port == V4V_PORT_NONE)
+        addr->port = __sync_fetch_and_add(&next_port, 1);
+
+    len = v4v_loopback_name(&name, addr);
+    return bind(fd, (struct sockaddr *)&name, len);
+}
+
+ssize_t v4v_sendto(int fd, const void *buf, size_t len, int flags, v4v_addr_t *dest_addr)
+{
+    socklen_t namelen;
+    struct sockaddr_un name;
+
+    namelen = v4v_loopback_name(&name, dest_addr);
+    return sendto(fd, buf, len, flags, (struct sockaddr *)&name, namelen);
+}
+
+///
+/// Works out the V4V address of a socket address made by v4v_loopback_name
+///
+static void v4v_loopback_addr(v4v_addr_t *addr, struct sockaddr_un *name, socklen_t namelen)
+{
+    unsigned int port = 0;
+    unsigned int domain = 0;
+
+    if (namelen > offsetof(struct sockaddr_un, sun_path) + 1)
+        sscanf(name->sun_path + 1, "openxt-v4v-%u-%u", &domain, &port);
+
+    addr->domain = domain;
+    addr->port = port;
+}
+
+ssize_t v4v_recvfrom(int fd, void *buf, size_t len, int flags, v4v_addr_t *src_addr)
+{
+    ssize_t ret;
+    struct sockaddr_un name;
+    socklen_t namelen = sizeof(name);
+
+    memset(&name, 0, sizeof(name));
+
+    ret = recvfrom(fd, buf, len, flags, (struct sockaddr *)&name, &namelen);
+    if (ret >= 0 && src_addr != NULL)
+        v4v_loopback_addr(src_addr, &name, namelen);
+
+    return ret;
+}
+
+ssize_t v4v_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    struct msghdr copy = *msg;
+    struct sockaddr_un name;
+
+    copy.msg_namelen = v4v_loopback_name(&name, msg->msg_name);
+    copy.msg_name = &name;
+
+    return sendmsg(fd, &copy, flags);
+}
+
+ssize_t v4v_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    ssize_t ret;
+    struct msghdr copy = *msg;
+    struct sockaddr_un name;
+
+    memset(&name, 0, sizeof(name));
+    copy.msg_name = &name;
+    copy.msg_namelen = sizeof(name);
+
+    ret = recvmsg(fd, &copy, flags);
+    msg->msg_flags = copy.msg_flags;
+
+    if (ret >= 0 && msg->msg_name != NULL)
+        v4v_loopback_addr(msg->msg_name, &name, copy.msg_namelen);
+
+    return ret;
+}
@@ -0,0 +1,475 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// Dates Modified:
+//  - 4/8/2015: Initial commit
+//    Rian Quinn <quinnr@ainfosec.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+//
+// Runs the audio_helper daemon against simulated stubdomains, and reports
+// packets per second, round trip latency and the daemon's CPU use per stream.
+// V4V is replaced by v4v-loopback.c, and every PCM is ALSA's null plugin (or
+// the file plugin with -f), so no hardware, V4V or guests are needed. Build
+// with "make vmaudio-bench".
+//
+
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "openxtv4v.h"
+#include "openxtalsa.h"
+#include "openxtdebug.h"
+#include "openxtpackets.h"
+#include "openxtvmaudio.h"
+
+#define DEFAULT_GUESTS 4
+#define DEFAULT_SECONDS 10
+#define MAX_GUESTS 64
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Global Data / Structures                                                                            //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// One simulated stubdomain, with what it measured
+///
+typedef struct Guest {
+
+    pthread_t thread;
+    int32_t stubdomid;
+    int32_t error;
+
+    V4VConnection *conn;
+    V4VPacket snd_packet;
+    V4VPacket rcv_packet;
+    int32_t max_packet_size;
+
+    uint64_t packets;
+    uint64_t samples;
+    uint64_t requests;
+    uint64_t latency;
+    uint64_t max_latency;
+
+} Guest;
+
+int32_t guests = DEFAULT_GUESTS;
+int32_t seconds = DEFAULT_SECONDS;
+int32_t packet_size = MAX_PCM_BUFFER_SIZE;
+int32_t flags = 0;
+char *file_dir = NULL;
+
+volatile bool running = true;
+pthread_barrier_t start;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Guest Functions                                                                                     //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int guest_send(Guest *guest, int32_t opcode, int32_t length)
+{
+    int ret;
+
+    ret = openxt_v4v_set_opcode(&guest->snd_packet, opcode);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_v4v_set_length(&guest->snd_packet, length);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    ret = openxt_v4v_send(guest->conn, &guest->snd_packet);
+    openxt_assert_ret(ret == length, ret, ret);
+
+    guest->packets++;
+    return 0;
+}
+
+///
+/// Waits for a packet with the given opcode. Pushed capture packets that
+/// come in first are counted along the way.
+///
+static int guest_recv(Guest *guest, int32_t opcode)
+{
+    int ret;
+    int32_t received;
+    OpenXTCaptureAckPacket *capture_ack_packet = openxt_v4v_get_body(&guest->rcv_packet);
+
+    while (1) {
+
+        ret = openxt_v4v_recv(guest->conn, &guest->rcv_packet);
+        openxt_assert_ret(ret >= 0, ret, ret);
+
+        guest->packets++;
+
+        received = openxt_v4v_get_opcode(&guest->rcv_packet);
+        if (received == OPENXT_CAPTURE_ACK)
+            guest->samples += capture_ack_packet->num_samples;
+
+        if (received == opcode)
+            return 0;
+
+        openxt_assert(received == OPENXT_CAPTURE_ACK, -EPROTO);
+    }
+}
+
+static int guest_request(Guest *guest, int32_t opcode, int32_t length, int32_t ack)
+{
+    int ret;
+    uint64_t latency;
+    uint64_t before = bench_now();
+
+    ret = guest_send(guest, opcode, length);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = guest_recv(guest, ack);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    latency = bench_now() - before;
+
+    guest->requests++;
+    guest->latency += latency;
+    guest->max_latency = max(guest->max_latency, latency);
+
+    return 0;
+}
+
+///
+/// Takes whatever capture packets have been pushed, without waiting
+///
+static int guest_drain(Guest *guest)
+{
+    int ret;
+    struct pollfd fd = { guest->conn->fd, POLLIN, 0 };
+
+    while (poll(&fd, 1, 0) > 0) {
+        ret = guest_recv(guest, OPENXT_CAPTURE_ACK);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    return 0;
+}
+
+static int guest_init(Guest *guest, int32_t opcode, int32_t ack)
+{
+    int ret;
+    OpenXTInitPacket *init_packet = openxt_v4v_get_body(&guest->snd_packet);
+    OpenXTPlaybackInitAckPacket *init_ack_packet = openxt_v4v_get_body(&guest->rcv_packet);
+
+    init_packet->max_packet_size = packet_size;
+    init_packet->flags = flags;
+
+    ret = guest_request(guest, opcode, sizeof(OpenXTInitPacket), ack);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // Without a sound card there is no mixer, so the stream can come back
+    // invalid and still be usable.
+    if (init_ack_packet->valid == 0)
+        openxt_warn("stubdomain %d: init %d reported invalid\n", guest->stubdomid, opcode);
+
+    guest->max_packet_size = init_ack_packet->max_packet_size;
+
+    return 0;
+}
+
+static int guest_run(Guest *guest)
+{
+    int ret;
+    int32_t num;
+    int32_t available;
+    OpenXTPlaybackPacket *playback_packet = openxt_v4v_get_body(&guest->snd_packet);
+    OpenXTCapturePacket *capture_packet = openxt_v4v_get_body(&guest->snd_packet);
+    OpenXTPlaybackGetAvailableAckPacket *available_ack_packet = openxt_v4v_get_body(&guest->rcv_packet);
+
+    num = guest->max_packet_size / sizeof(uint32_t);
+
+    while (running == true) {
+
+        // Play as much as the daemon will take
+        ret = guest_request(guest, OPENXT_PLAYBACK_GET_AVAILABLE, 0, OPENXT_PLAYBACK_GET_AVAILABLE_ACK);
+        openxt_assert_ret(ret == 0, ret, ret);
+
+        available = min(available_ack_packet->available, num);
+
+        if (available > 0) {
+            playback_packet->num_samples = available;
+
+            ret = guest_send(guest, OPENXT_PLAYBACK, PLAYBACK_PACKET_LENGTH(available));
+            openxt_assert_ret(ret == 0, ret, ret);
+
+            guest->samples += available;
+        }
+
+        // Capture, either as it is pushed or by asking for it
+        if (flags & OPENXT_INIT_CAPTURE_PUSH) {
+            ret = guest_drain(guest);
+            openxt_assert_ret(ret == 0, ret, ret);
+        }
+        else {
+            capture_packet->num_samples = num;
+
+            ret = guest_request(guest, OPENXT_CAPTURE, sizeof(OpenXTCapturePacket), OPENXT_CAPTURE_ACK);
+            openxt_assert_ret(ret == 0, ret, ret);
+        }
+    }
+
+    return 0;
+}
+
+static void *guest_thread(void *arg)
+{
+    Guest *guest = arg;
+
+    guest->conn = openxt_v4v_open(V4V_PORT_NONE, guest->stubdomid, OPENXT_AUDIO_PORT, 0);
+    if (guest->conn == NULL)
+        guest->error = -ENODEV;
+
+    if (guest->error == 0)
+        guest->error = guest_init(guest, OPENXT_PLAYBACK_INIT, OPENXT_PLAYBACK_INIT_ACK);
+    if (guest->error == 0)
+        guest->error = guest_init(guest, OPENXT_CAPTURE_INIT, OPENXT_CAPTURE_INIT_ACK);
+    if (guest->error == 0)
+        guest->error = guest_send(guest, OPENXT_PLAYBACK_ENABLE_VOICE, 0);
+    if (guest->error == 0)
+        guest->error = guest_send(guest, OPENXT_CAPTURE_ENABLE_VOICE, 0);
+
+    // Only the streaming is measured
+    guest->packets = 0;
+    guest->samples = 0;
+    guest->requests = 0;
+    guest->latency = 0;
+    guest->max_latency = 0;
+
+    pthread_barrier_wait(&start);
+
+    if (guest->error == 0)
+        guest->error = guest_run(guest);
+
+    if (guest->conn != NULL && openxt_v4v_isconnected(guest->conn) == true) {
+        guest_send(guest, OPENXT_PLAYBACK_DISABLE_VOICE, 0);
+        guest_send(guest, OPENXT_CAPTURE_DISABLE_VOICE, 0);
+        guest_send(guest, OPENXT_FINI, 0);
+    }
+
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Setup Functions                                                                                     //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Points ALSA at a configuration with a null (or file) PCM for every
+/// guest's playback, and for the shared capture PCM. This has to happen
+/// before anything opens ALSA.
+///
+static int bench_alsa_config(void)
+{
+    int i;
+    int fd;
+    FILE *file;
+    char *dir;
+    static char path[] = "/tmp/vmaudio-bench-XXXXXX";
+    static char config_path[MAX_NAME_LENGTH * 2];
+
+    fd = mkstemp(path);
+    openxt_assert_ret(fd >= 0, fd, -errno);
+    file = fdopen(fd, "w");
+    openxt_checkp(file, -errno);
+
+    for (i = 0; i < guests; i++) {
+        if (file_dir != NULL)
+            fprintf(file, "pcm.vm-%d { type file slave.pcm \"null\" file \"%s/vm-%d.raw\" format \"raw\" }\n", i, file_dir, i);
+        else
+            fprintf(file, "pcm.vm-%d { type null }\n", i);
+    }
+    fprintf(file, "pcm.dsnoop0 { type null }\n");
+    fclose(file);
+
+    // Keep the normal configuration, and add ours after it
+    dir = getenv("ALSA_CONFIG_DIR");
+    snprintf(config_path, sizeof(config_path), "%s/alsa.conf:%s", dir ? dir : "/usr/share/alsa", path);
+    setenv("ALSA_CONFIG_PATH", config_path, 1);
+
+    return 0;
+}
+
+///
+/// Waits for the daemon to bind its V4V port, as anything sent before then
+/// is refused.
+///
+static bool bench_daemon_ready(void)
+{
+    int i;
+    FILE *file;
+    char line[256];
+    char name[64];
+    bool found = false;
+
+    snprintf(name, sizeof(name), "@openxt-v4v-0-%d", OPENXT_AUDIO_PORT);
+
+    for (i = 0; i < 500 && found == false; i++) {
+
+        if ((file = fopen("/proc/net/unix", "r")) == NULL)
+            return false;
+
+        while (found == false && fgets(line, sizeof(line), file) != NULL)
+            found = (strstr(line, name) != NULL);
+
+        fclose(file);
+
+        if (found == false)
+            usleep(10000);
+    }
+
+    return found;
+}
+
+static void *daemon_thread(void *arg)
+{
+    char *argv[] = { "vmaudio-bench", "daemon", NULL };
+
+    openxt_vmaudio(2, argv);
+    return NULL;
+}
+
+static void usage(char *name)
+{
+    openxt_info("Usage: %s <options>\n", name);
+    openxt_info("    -g N       number of simulated guests, default %d\n", DEFAULT_GUESTS);
+    openxt_info("    -s N       seconds to run for, default %d\n", DEFAULT_SECONDS);
+    openxt_info("    -b N       PCM packet size to ask for, default %d\n", MAX_PCM_BUFFER_SIZE);
+    openxt_info("    -p         have capture pushed, rather than asking for it\n");
+    openxt_info("    -f DIR     write each guest's playback to DIR/vm-N.raw\n");
+    exit(0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main                                                                                                //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+    int c;
+    int i;
+    int ret;
+    Guest *guest;
+    Guest *guest_list;
+    pthread_t daemon;
+    clockid_t daemon_clock;
+    struct timespec cpu_before;
+    struct timespec cpu_after;
+    uint64_t before;
+    double elapsed;
+    double cpu;
+    uint64_t packets = 0;
+    uint64_t samples = 0;
+    int32_t failed = 0;
+
+    while ((c = getopt(argc, argv, "hg:s:b:pf:")) >= 0) {
+        switch (c) {
+            case 'g': guests = atoi(optarg); break;
+            case 's': seconds = atoi(optarg); break;
+            case 'b': packet_size = atoi(optarg); break;
+            case 'p': flags |= OPENXT_INIT_CAPTURE_PUSH; break;
+            case 'f': file_dir = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (guests <= 0 || guests > MAX_GUESTS || seconds <= 0 || packet_size <= 0)
+        usage(argv[0]);
+
+    openxt_debug_set_enabled(true);
+
+    ret = bench_alsa_config();
+    openxt_assert_ret(ret == 0, ret, 1);
+
+    guest_list = (Guest *)calloc(guests, sizeof(Guest));
+    openxt_checkp(guest_list, 1);
+
+    // Start the daemon, then the guests. Stubdomain N plays to vm-(N - 1).
+    pthread_create(&daemon, NULL, daemon_thread, NULL);
+    pthread_getcpuclockid(daemon, &daemon_clock);
+
+    if (bench_daemon_ready() == false) {
+        openxt_error("daemon did not start\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&start, NULL, guests + 1);
+
+    for (i = 0; i < guests; i++) {
+        guest_list[i].stubdomid = i + 1;
+        pthread_create(&guest_list[i].thread, NULL, guest_thread, &guest_list[i]);
+    }
+
+    // Measure
+    pthread_barrier_wait(&start);
+
+    before = bench_now();
+    clock_gettime(daemon_clock, &cpu_before);
+
+    sleep(seconds);
+
+    clock_gettime(daemon_clock, &cpu_after);
+    elapsed = (bench_now() - before) / 1e9;
+    running = false;
+
+    for (i = 0; i < guests; i++)
+        pthread_join(guest_list[i].thread, NULL);
+
+    // Report
+    printf("guest  packets/s  samples/s  rtt avg us  rtt max us\n");
+
+    for (i = 0; i < guests; i++) {
+        guest = &guest_list[i];
+
+        if (guest->error != 0) {
+            printf("%5d  failed: %d\n", guest->stubdomid, guest->error);
+            failed++;
+            continue;
+        }
+
+        printf("%5d  %9.0f  %9.0f  %10.1f  %10.1f\n",
+               guest->stubdomid,
+               guest->packets / elapsed,
+               guest->samples / elapsed,
+               guest->requests ? guest->latency / 1e3 / guest->requests : 0.0,
+               guest->max_latency / 1e3);
+
+        packets += guest->packets;
+        samples += guest->samples;
+    }
+
+    cpu = (cpu_after.tv_sec - cpu_before.tv_sec) + (cpu_after.tv_nsec - cpu_before.tv_nsec) / 1e9;
+
+    printf("total  %9.0f  %9.0f\n", packets / elapsed, samples / elapsed);
+    printf("daemon cpu: %.1f%% of a core, %.2f%% per stream, %.0f ns per packet\n",
+           cpu / elapsed * 100,
+           cpu / elapsed * 100 / guests,
+           packets ? cpu * 1e9 / packets : 0.0);
+
+    return failed ? 1 : 0;
+}
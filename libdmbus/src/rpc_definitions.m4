@@ -17,6 +17,11 @@ divert(-1)
 #   Define a synchronous, inbound (dm to service) RPC using
 #   in_message_type as a previously defined input message type.
 #   The caller expects a reply of the out_message_type message type.
+#   An asynchronous variant is generated as well: a service that sets
+#   the in_message_type_async op (in struct dmbus_rpc_async_ops, see
+#   dmbus_client_set_async_ops()) gets a request ID instead of an out
+#   message, and replies later on with in_message_type_reply(). The
+#   device model can pipeline requests; replies go back in request order.
 #
 #   DEFINE_OUT_RPC(out_message_type)
 #   Define an asynchronous, outbound (service to dm) RPC using
@@ -12,6 +12,7 @@ foreach(`X',`    X;
 
 define(`MSG_STRUCTS',`')
 define(`SERV_MSG_OPS',`')
+define(`SERV_MSG_ASYNC_OPS',`')
 define(`SERV_MSG_HANDLERS',`')
 define(`DM_RPC_FUNCS',`')
 define(`DM_RPC_DEFS',`')
@@ -42,21 +43,45 @@ case MSGID_$1:
 define(`DEFINE_IN_RPC_WITH_RETURN', `define(`SERV_MSG_OPS', SERV_MSG_OPS`'dnl
 int (*$1)(``void *priv, struct msg_$1 *msg, size_t msglen, struct msg_$2 *out'');
 )'dnl
+`define(`SERV_MSG_ASYNC_OPS', SERV_MSG_ASYNC_OPS`'dnl
+void (*$1_async)(``dmbus_client_t client, void *priv, struct msg_$1 *msg, size_t msglen, dmbus_request_t req'');
+)'dnl
 `define(`SERV_MSG_HANDLERS', SERV_MSG_HANDLERS`'dnl
 case MSGID_$1:
 {
         struct msg_$2 out;
         size_t len = m->hdr.msg_len;
+        dmbus_request_t req = c->next_request++;
         int ret = -1;
 
+        if (c->async_ops && c->async_ops->$1_async) {
+            c->async_ops->$1_async(``c, c->priv, &m->''$1``, len, req'');
+            break;
+        }
         if (c->rpc_ops->$1) {
             ret = c->rpc_ops->$1(``c->priv, &m->''$1``, len, &out'');
         }
         out.hdr.return_value = (uint32_t) ret;
-        send_msg(``c, ''MSGID_$2``, &out, sizeof (out)'');
+        reply_msg(``c, req, ''MSGID_$2``, &out, sizeof (out)'');
         break;
 }
 )'dnl
+`define(`DM_RPC_DEFS', DM_RPC_DEFS
+`void '$1`_reply(dmbus_client_t client, dmbus_request_t req, int ret, struct msg_'$2` *out);')'dnl
+`define(`DM_RPC_FUNCS', DM_RPC_FUNCS
+`void '$1`_reply(dmbus_client_t client, dmbus_request_t req, int ret, struct msg_'$2` *out)'
+{
+    struct dmbus_client *c = client;
+    struct msg_$2 empty;
+
+    if (!out) {
+        memset(&empty, 0, sizeof (empty));
+        out = &empty;
+    }
+    out->hdr.return_value = (uint32_t) ret;
+    reply_msg(c, req, MSGID_$2, out, sizeof (*out));
+}
+)'dnl
 )
 
 define(`DEFINE_OUT_RPC', `define(`DM_RPC_DEFS', DM_RPC_DEFS
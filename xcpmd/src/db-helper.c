@@ -28,6 +28,7 @@
 #include "project.h"
 #include "xcpmd.h"
 #include "db-helper.h"
+#include "modules.h"
 
 /**
  * This file contains functions for reading from and writing to the DB, both
@@ -46,7 +47,8 @@
  * Cached variables cannot be deleted if they are referred to by any rules, but
  * they can be overwritten at any time, provided there are no type conflicts.
  * Typing is strictly enforced; a variable cannot be overwritten if the new value
- * does not match its current type.
+ * does not match its current type. Overwriting a variable rechecks only the
+ * conditions listening on it, and fires any resulting rule transitions.
  * See rules.h for more on argument types.
  *
  * Functions for touching the variable cache are defined here, but its global
@@ -67,9 +69,14 @@ static void delete_db_vars();
 
 static char ** json_rule_to_parseable(char * name, char * json);
 static char * rule_to_json(struct rule * rule);
+static char * rules_to_json(yajl_val db_rules, const char ** drop_names);
+static void gen_rule_json(yajl_gen yajl, struct rule * rule);
+static void gen_yajl_val(yajl_gen yajl, yajl_val val);
+static bool is_dropped(const char * name, const char ** drop_names);
 
 static struct db_var * cache_db_var(char * name, enum arg_type type, union arg_u value);
 static int uncache_db_var(char * name);
+static void free_db_var(struct db_var * var);
 
 
 //Write a value to the specified DB path.
@@ -265,6 +272,46 @@ void write_db_rules() {
 }
 
 
+//Rewrites the rules in the DB with a single injection, however many rules
+//there are. dbd's inject replaces the node at the path it is given rather than
+//merging into it (write_db_rule() relies on the same thing to overwrite a
+//rule), so what goes in is the complete rules object: every rule in the
+//internal list, plus the rules that are only in the DB (e.g. ones that failed
+//to parse at load time), less any named in the NULL-terminated drop_names.
+//drop_names may be NULL. Does not modify the internal rule list.
+void replace_db_rules(const char ** drop_names) {
+
+    yajl_val db_rules = NULL;
+    char * json_all, * json;
+    char err[1024];
+
+    json_all = db_dump_path(DB_RULE_PATH);
+    if (json_all == NULL) {
+        xcpmd_log(LOG_WARNING, "Couldn't get rules from DB; rules only in the DB will be lost.\n");
+    }
+    else if (*json_all != '\0' && strncmp(json_all, "null", 4)) {
+        db_rules = yajl_tree_parse(json_all, err, sizeof(err));
+        if (db_rules == NULL)
+            xcpmd_log(LOG_WARNING, "Error parsing DB rules: %s; rules only in the DB will be lost.\n", err);
+    }
+    free(json_all);
+
+    json = rules_to_json(db_rules, drop_names);
+    if (db_rules != NULL)
+        yajl_tree_free(db_rules);
+    if (json == NULL)
+        return;
+
+    //An empty object would leave an empty node behind.
+    if (!strcmp(json, "{}"))
+        db_rm(DB_RULE_PATH);
+    else
+        db_inject(DB_RULE_PATH, json);
+
+    free(json);
+}
+
+
 //Deletes the specified rule from the DB. Does not modify the internal rule list.
 void delete_db_rule(char * rule_name) {
 
@@ -282,6 +329,15 @@ void delete_db_rules() {
 }
 
 
+//Allocates memory!
+//Dumps all power management policy (variables and rules) in the DB as a single
+//JSON string. The string returned should be freed.
+char * dump_db_policy() {
+
+    return db_dump_path(DB_PM_PATH);
+}
+
+
 //Parses rules from the DB and adds them to the internal rule list.
 bool parse_db_rules(struct parse_data * data) {
 
@@ -667,12 +723,6 @@ free_yajl:
 //is easy to retrieve from the rule anyway.)
 static char * rule_to_json(struct rule * rule) {
 
-    char index_string[32];
-    char * arg_string, * bool_string;
-    int index, arg_index;
-    struct condition * cond;
-    struct action * act;
-    struct arg_node * arg;
     yajl_gen yajl;
     char * ret;
     size_t len;
@@ -683,9 +733,126 @@ static char * rule_to_json(struct rule * rule) {
         return NULL;
     }
 
-    //Add rule name
-    //yajl_gen_string(yajl, (const unsigned char *)rule->id, strlen(rule->id));
-    //yajl_gen_map_open(yajl);
+    gen_rule_json(yajl, rule);
+
+    yajl_gen_get_buf(yajl, (const unsigned char **)&ret, &len);
+    ret = clone_string(ret);
+
+    yajl_gen_free(yajl);
+
+    return ret;
+}
+
+
+//Allocates memory!
+//Converts the whole internal rule list to a dynamically allocated json string,
+//mapping each rule's name to the structure produced by rule_to_json(). Rules in
+//db_rules (the DB's rules node, or NULL) that aren't in the internal list are
+//carried over as they are, unless they are named in drop_names.
+static char * rules_to_json(yajl_val db_rules, const char ** drop_names) {
+
+    struct rule * rule;
+    yajl_gen yajl;
+    const char * name;
+    char * ret;
+    size_t len;
+    unsigned int i;
+
+    yajl = yajl_gen_alloc(NULL);
+    if (yajl == NULL) {
+        xcpmd_log(LOG_ERR, "Could not allocate memory!\n");
+        return NULL;
+    }
+
+    yajl_gen_map_open(yajl);
+
+    if (db_rules != NULL && YAJL_IS_OBJECT(db_rules)) {
+        for (i = 0; i < db_rules->u.object.len; ++i) {
+            name = db_rules->u.object.keys[i];
+            if (lookup_rule((char *)name) != NULL || is_dropped(name, drop_names))
+                continue;
+
+            yajl_gen_string(yajl, (const unsigned char *)name, strlen(name));
+            gen_yajl_val(yajl, db_rules->u.object.values[i]);
+        }
+    }
+
+    list_for_each_entry(rule, &rules.list, list) {
+        yajl_gen_string(yajl, (const unsigned char *)rule->id, strlen(rule->id));
+        gen_rule_json(yajl, rule);
+    }
+
+    yajl_gen_map_close(yajl);
+
+    yajl_gen_get_buf(yajl, (const unsigned char **)&ret, &len);
+    ret = clone_string(ret);
+
+    yajl_gen_free(yajl);
+
+    return ret;
+}
+
+
+//Returns true if name is in the NULL-terminated list drop_names.
+static bool is_dropped(const char * name, const char ** drop_names) {
+
+    int i;
+
+    if (drop_names == NULL)
+        return false;
+
+    for (i = 0; drop_names[i] != NULL; ++i) {
+        if (!strcmp(name, drop_names[i]))
+            return true;
+    }
+
+    return false;
+}
+
+
+//Generates json for a parsed yajl tree, as it was read.
+static void gen_yajl_val(yajl_gen yajl, yajl_val val) {
+
+    unsigned int i;
+
+    if (YAJL_IS_STRING(val)) {
+        yajl_gen_string(yajl, (const unsigned char *)val->u.string, strlen(val->u.string));
+    }
+    else if (YAJL_IS_NUMBER(val)) {
+        yajl_gen_number(yajl, val->u.number.r, strlen(val->u.number.r));
+    }
+    else if (YAJL_IS_OBJECT(val)) {
+        yajl_gen_map_open(yajl);
+        for (i = 0; i < val->u.object.len; ++i) {
+            yajl_gen_string(yajl, (const unsigned char *)val->u.object.keys[i], strlen(val->u.object.keys[i]));
+            gen_yajl_val(yajl, val->u.object.values[i]);
+        }
+        yajl_gen_map_close(yajl);
+    }
+    else if (YAJL_IS_ARRAY(val)) {
+        yajl_gen_array_open(yajl);
+        for (i = 0; i < val->u.array.len; ++i)
+            gen_yajl_val(yajl, val->u.array.values[i]);
+        yajl_gen_array_close(yajl);
+    }
+    else if (YAJL_IS_TRUE(val) || YAJL_IS_FALSE(val)) {
+        yajl_gen_bool(yajl, YAJL_IS_TRUE(val));
+    }
+    else {
+        yajl_gen_null(yajl);
+    }
+}
+
+
+//Generates the json structure for a single rule (without its name).
+static void gen_rule_json(yajl_gen yajl, struct rule * rule) {
+
+    char index_string[32];
+    char * arg_string, * bool_string;
+    int index, arg_index;
+    struct condition * cond;
+    struct action * act;
+    struct arg_node * arg;
 
     //Open the root.
     yajl_gen_map_open(yajl);
@@ -815,13 +982,6 @@ static char * rule_to_json(struct rule * rule) {
         yajl_gen_map_close(yajl);
     }
     yajl_gen_map_close(yajl);
-
-    yajl_gen_get_buf(yajl, (const unsigned char **)&ret, &len);
-    ret = clone_string(ret);
-
-    yajl_gen_free(yajl);
-
-    return ret;
 }
 
 
@@ -829,13 +989,15 @@ static char * rule_to_json(struct rule * rule) {
 //Adds a variable, transparently caching it and writing back to the DB.
 //If the variable already exists, and there are no type conflicts, its previous
 //value will be overwritten.
-//Modifies the internal cache.
+//Modifies the internal cache, and re-evaluates any rules with conditions
+//depending on the variable if its value changed.
 //Writes error messages to *parse_error.
 //May try to free existing strings in *parse_error--don't supply the address of
 //a non-malloc'd string!
 struct db_var * add_var(char * name, enum arg_type type, union arg_u value, char ** parse_error) {
 
     struct db_var * var = lookup_var(name);
+    bool changed = false;
 
     //A var with this name exists already. Check the type.
     if (var != NULL) {
@@ -858,6 +1020,7 @@ struct db_var * add_var(char * name, enum arg_type type, union arg_u value, char
         else {
             var->value.arg = value;
         }
+        changed = true;
     }
     else {
         var = cache_db_var(name, type, value);
@@ -867,6 +1030,11 @@ struct db_var * add_var(char * name, enum arg_type type, union arg_u value, char
         write_db_var(var->name, var->value.type, var->value.arg);
     }
 
+    //A brand new variable can't have listeners yet, so only overwrites matter.
+    if (changed) {
+        handle_var_change(var);
+    }
+
     return var;
 }
 
@@ -940,6 +1108,32 @@ void delete_vars() {
 }
 
 
+//Allocates memory!
+//Puts a variable straight into the cache without touching the DB, replacing
+//any cached value. Used when restoring policy that is known to match the DB.
+struct db_var * restore_var(char * name, enum arg_type type, union arg_u value) {
+
+    struct db_var * var;
+
+    list_for_each_entry(var, &(db_vars.list), list) {
+        if (strcmp(var->name, name) == 0) {
+            if (var->value.type == ARG_STR)
+                free(var->value.arg.str);
+
+            var->value.type = type;
+            if (type == ARG_STR)
+                var->value.arg.str = clone_string(value.str);
+            else
+                var->value.arg = value;
+
+            return var;
+        }
+    }
+
+    return cache_db_var(name, type, value);
+}
+
+
 //Allocates memory!
 //Adds a variable to the cache. Allocates memory for both the db_var struct and
 //any strings that must be copied.
@@ -961,6 +1155,7 @@ static struct db_var * cache_db_var(char * name, enum arg_type type, union arg_u
     }
 
     var->ref_count = 0;
+    INIT_LIST_HEAD(&var->listeners.list);
 
     list_add_tail(&var->list, &db_vars.list);
 
@@ -992,15 +1187,30 @@ static int uncache_db_var(char * name) {
     }
 
     list_del(&found_var->list);
-    if (found_var->value.type == ARG_STR) {
-        free(found_var->value.arg.str);
-    }
-    free(found_var->name);
-    free(found_var);
+    free_db_var(found_var);
     return 1;
 }
 
 
+//Frees a db_var that has already been removed from the cache, along with its
+//list of listeners.
+static void free_db_var(struct db_var * var) {
+
+    struct condition_node *node, *tmp;
+
+    list_for_each_entry_safe(node, tmp, &var->listeners.list, list) {
+        list_del(&node->list);
+        free(node);
+    }
+
+    if (var->value.type == ARG_STR) {
+        free(var->value.arg.str);
+    }
+    free(var->name);
+    free(var);
+}
+
+
 //Clears the entire var cache, regardless of refcounts. Does not modify the DB.
 void delete_cached_vars() {
 
@@ -1011,10 +1221,6 @@ void delete_cached_vars() {
     list_for_each_safe(posi, i, &db_vars.list) {
         tmp_var = list_entry(posi, struct db_var, list);
         list_del(posi);
-        free(tmp_var->name);
-        if (tmp_var->value.type == ARG_STR) {
-            free(tmp_var->value.arg.str);
-        }
-        free(tmp_var);
+        free_db_var(tmp_var);
     }
 }
@@ -29,8 +29,10 @@ bool parse_db_rules(struct parse_data * data);
 //General use:
 void write_db_rule(struct rule * rule);
 void write_db_rules();
+void replace_db_rules(const char ** drop_names);
 void delete_db_rule(char * rule_name);
 void delete_db_rules();
+char * dump_db_policy();
 
 //Access variables through a write-through cache:
 struct db_var * lookup_var(char * name);
@@ -38,6 +40,7 @@ struct arg_node * resolve_var(char * name);
 struct db_var * add_var(char * name, enum arg_type type, union arg_u value, char ** parse_error);
 int delete_var(char * name);
 void delete_vars();
+struct db_var * restore_var(char * name, enum arg_type type, union arg_u value);
 
 //Tear down the cache:
 void delete_cached_vars();
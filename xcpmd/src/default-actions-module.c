@@ -78,7 +78,15 @@ static void __attribute__ ((constructor)) init_module() {
 
 //Cleans up after this module.
 static void __attribute__ ((destructor)) uninit_module() {
-    return;
+
+    unsigned int i;
+
+    --times_loaded;
+    if (times_loaded > 0)
+        return;
+
+    for (i=0; i < num_action_types; ++i)
+        delete_action_type(lookup_action_type(action_table[i].name));
 }
 
 
@@ -31,6 +31,7 @@
 #include "rules.h"
 #include "parser.h"
 #include "db-helper.h"
+#include "policy-cache.h"
 
 /**
  * This file deals with loading and unloading modules and policy.
@@ -42,28 +43,196 @@
  */
 
 
+//Private data structures
+
+//A module that can be loaded into xcpmd. Required modules are loaded at
+//startup and stay loaded. All others are loaded the first time a rule
+//references one of the condition or action types listed in types, and are
+//unloaded (taking their events and DBus filters with them) once no condition
+//or action of those types remains.
+struct module_entry {
+    char * filename;
+    bool required;
+    char ** types;
+    void * handle;
+    unsigned int ref_count;
+};
+
+
 //Private data
-static char * _module_list[] = {
-    MODULE_PATH "acpi-module.so",
-    MODULE_PATH "vm-actions-module.so",
-    MODULE_PATH "default-actions-module.so",
-    MODULE_PATH "vm-events-module.so"
+static char * default_actions_types[] = {
+    "doNothing", "printString", "logString", "runScript",
+    NULL
+};
+
+static char * vm_events_types[] = {
+    "whenAnyVmCreating", "whenAnyVmStopping", "whenAnyVmRebooting",
+    "whenAnyVmRunning", "whenAnyVmStopped", "whenAnyVmPaused",
+    "whenVmUuidCreating", "whenVmUuidStopping", "whenVmUuidRebooting",
+    "whenVmUuidRunning", "whenVmUuidStopped", "whenVmUuidPaused",
+    "whenVmCreating", "whenVmStopping", "whenVmRebooting", "whenVmRunning",
+    "whenVmStopped", "whenVmPaused",
+    NULL
+};
+
+static char * timer_types[] = {
+    "whenTimerExpires", "startTimer", "startPeriodicTimer", "stopTimer",
+    NULL
+};
+
+//The types listed for each on-demand module have to match what the module
+//registers; load_module_entry() checks this whenever one is loaded.
+//acpi-module is required because acpi-events feeds its event table directly.
+//vm-actions-module is required because replies to its asynchronous xenmgr
+//calls may arrive after the last rule using it has been deleted.
+static struct module_entry _module_list[] = {
+    { MODULE_PATH "acpi-module.so"            , true  , NULL                  , NULL , 0 },
+    { MODULE_PATH "vm-actions-module.so"      , true  , NULL                  , NULL , 0 },
+    { MODULE_PATH "default-actions-module.so" , false , default_actions_types , NULL , 0 },
+    { MODULE_PATH "vm-events-module.so"       , false , vm_events_types       , NULL , 0 },
+    { MODULE_PATH "timer-module.so"           , false , timer_types           , NULL , 0 }
 };
 
+static unsigned int num_modules = sizeof(_module_list) / sizeof(_module_list[0]);
+
+
+//Finds the on-demand module providing a condition or action type.
+//Returns null if the type belongs to a required module or to no module at all.
+static struct module_entry * lookup_module_by_type(char * type_name) {
+
+    unsigned int i;
+    char ** type;
+
+    for (i=0; i < num_modules; ++i) {
+        if (_module_list[i].types == NULL)
+            continue;
+
+        for (type = _module_list[i].types; *type != NULL; ++type) {
+            if (strcmp(*type, type_name) == 0)
+                return &_module_list[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+//Returns true if a type name is in a module's list of types.
+static bool module_lists_type(struct module_entry * entry, char * type_name) {
+
+    char ** type;
+
+    for (type = entry->types; *type != NULL; ++type) {
+        if (strcmp(*type, type_name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+
+//Checks that a module that was just loaded registered exactly the types listed
+//for it in _module_list: the list is kept by hand, and a type missing from it
+//would keep no reference on the module. last_cond and last_act are the tails
+//of the condition_type and action_type lists from before the module was loaded.
+static bool check_module_types(struct module_entry * entry, struct list_head * last_cond, struct list_head * last_act) {
+
+    struct list_head * pos;
+    struct condition_type * cond_type;
+    struct action_type * act_type;
+    char ** type;
+    bool ret = true;
+
+    for (pos = last_cond->next; pos != &(condition_types.list); pos = pos->next) {
+        cond_type = list_entry(pos, struct condition_type, list);
+        if (!module_lists_type(entry, cond_type->name)) {
+            xcpmd_log(LOG_ERR, "Module %s registered unlisted condition type %s\n", entry->filename, cond_type->name);
+            ret = false;
+        }
+    }
+
+    for (pos = last_act->next; pos != &(action_types.list); pos = pos->next) {
+        act_type = list_entry(pos, struct action_type, list);
+        if (!module_lists_type(entry, act_type->name)) {
+            xcpmd_log(LOG_ERR, "Module %s registered unlisted action type %s\n", entry->filename, act_type->name);
+            ret = false;
+        }
+    }
+
+    for (type = entry->types; *type != NULL; ++type) {
+        if (lookup_condition_type(*type) == NULL && lookup_action_type(*type) == NULL) {
+            xcpmd_log(LOG_ERR, "Module %s didn't register listed type %s\n", entry->filename, *type);
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+
+//Loads a module's .so file if it isn't loaded already. An on-demand module
+//whose types don't match its entry in _module_list is unloaded again.
+static int load_module_entry(struct module_entry * entry) {
+
+    struct list_head * last_cond = condition_types.list.prev;
+    struct list_head * last_act = action_types.list.prev;
+
+    if (entry->handle != NULL)
+        return 0;
+
+    entry->handle = load_module(entry->filename);
+    if (entry->handle == NULL)
+        return -1;
+
+    if (entry->types != NULL && !check_module_types(entry, last_cond, last_act)) {
+        unload_module(entry->handle);
+        entry->handle = NULL;
+        return -1;
+    }
+
+    xcpmd_log(LOG_DEBUG, "Loaded module %s", entry->filename);
+    return 0;
+}
+
+
+//Unloads a module's .so file if it is loaded.
+static void unload_module_entry(struct module_entry * entry) {
+
+    if (entry->handle == NULL)
+        return;
 
-//Loads all modules in _module_list.
+    unload_module(entry->handle);
+    entry->handle = NULL;
+    entry->ref_count = 0;
+
+    xcpmd_log(LOG_DEBUG, "Unloaded module %s", entry->filename);
+}
+
+
+//Loads all required modules. All others are loaded on demand.
 int init_modules() {
 
-    unsigned int num_modules = sizeof(_module_list) / sizeof(_module_list[0]);
-    return load_modules(_module_list, num_modules);
+    unsigned int i;
+
+    for (i=0; i < num_modules; ++i) {
+        if (_module_list[i].required && load_module_entry(&_module_list[i]) == -1)
+            return -1;
+    }
+
+    return 0;
 }
 
 
-//Unloads all modules in _module_list.
+//Deletes all rules, then unloads all modules.
 void uninit_modules() {
 
-    unsigned int num_modules = sizeof(_module_list) / sizeof(_module_list[0]);
-    unload_modules(_module_list, num_modules);
+    unsigned int i;
+
+    //Rules hold references to types provided by modules; drop them first.
+    delete_rules();
+
+    for (i=num_modules; i > 0; --i)
+        unload_module_entry(&_module_list[i - 1]);
 }
 
 
@@ -91,13 +260,11 @@ void * load_module(char * filename) {
 }
 
 
-//Unloads a module. This implicitly calls its destructor function.
+//Unloads a module by the handle load_module() returned for it. Once the last
+//handle to the module is closed, this implicitly calls its destructor function.
 //Once again, ensure that destructors are either static or uniquely named.
-void unload_module(char * filename) {
+void unload_module(void * handle) {
 
-    void * handle;
-
-    handle = load_module(filename);
     if (handle == NULL) {
         return;
     }
@@ -106,31 +273,69 @@ void unload_module(char * filename) {
 }
 
 
-//Loads a list of modules.
-int load_modules(char ** module_list, unsigned int num_modules) {
+//Loads the module providing a condition or action type, if there is one and
+//it isn't loaded already. Returns true if the module is now loaded.
+bool load_module_for_type(char * type_name) {
+
+    struct module_entry * entry = lookup_module_by_type(type_name);
+
+    if (entry == NULL)
+        return false;
+
+    return load_module_entry(entry) == 0;
+}
+
+
+//Takes a reference on the module providing a type. Called whenever a
+//condition or action of that type is created.
+void get_module_ref(char * type_name) {
+
+    struct module_entry * entry = lookup_module_by_type(type_name);
+
+    if (entry != NULL && entry->handle != NULL)
+        ++entry->ref_count;
+}
+
+
+//Drops a reference on the module providing a type, unloading the module if no
+//conditions or actions of its types remain.
+void put_module_ref(char * type_name) {
+
+    struct module_entry * entry = lookup_module_by_type(type_name);
+
+    if (entry == NULL || entry->handle == NULL || entry->ref_count == 0)
+        return;
+
+    if (--entry->ref_count == 0)
+        unload_module_entry(entry);
+}
+
+
+//Loads every module, so that all condition and action types are registered.
+//Pair with unload_unused_modules() once done with the types.
+int load_all_modules() {
 
     unsigned int i;
+    int ret = 0;
 
     for (i=0; i < num_modules; ++i) {
-        if (load_module(module_list[i]) == NULL) {
-            return -1;
-        }
-        else {
-            xcpmd_log(LOG_DEBUG, "Loaded module %s", module_list[i]);
-        }
+        if (load_module_entry(&_module_list[i]) == -1)
+            ret = -1;
     }
 
-    return 0;
+    return ret;
 }
 
 
-//Unloads a list of modules.
-void unload_modules(char ** module_list, unsigned int num_modules) {
+//Unloads every on-demand module that no rule references.
+void unload_unused_modules() {
 
     unsigned int i;
 
-    for (i=0; i < num_modules; ++i)
-        unload_module(module_list[i]);
+    for (i=0; i < num_modules; ++i) {
+        if (!_module_list[i].required && _module_list[i].ref_count == 0)
+            unload_module_entry(&_module_list[i]);
+    }
 }
 
 
@@ -218,6 +423,86 @@ void handle_events(struct ev_wrapper * event) {
 }
 
 
+//On a change to a variable's value, rechecks only the conditions that take
+//that variable as an argument, evaluates the rules owning any conditions that
+//changed, and performs actions or undos for rules that changed state.
+//Conditions depending on stateless events are skipped, as they are only
+//meaningful at the instant their event fires.
+void handle_var_change(struct db_var * var) {
+
+    struct condition_node * node;
+    struct condition * condition;
+    struct ev_wrapper * event;
+    struct rule ** checklist;
+    struct rule ** alloc_check;
+    unsigned int nodes_allocd = 8;
+    unsigned int nodes_assigned = 0;
+    unsigned int i;
+    bool condition_is_true, condition_was_true;
+    bool rule_is_true, rule_was_true;
+
+    if (var == NULL || list_empty(&var->listeners.list))
+        return;
+
+    checklist = (struct rule **)malloc(nodes_allocd * sizeof(struct rule *));
+    if (checklist == NULL) {
+        xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+        return;
+    }
+
+    //Recheck each condition that depends on this variable.
+    list_for_each_entry(node, &(var->listeners.list), list) {
+        condition = node->condition;
+        event = condition->type->event;
+
+        if (event->is_stateless)
+            continue;
+
+        condition_was_true = condition->is_true;
+        condition_is_true = condition->type->check(event, &condition->args);
+        condition->is_true = condition_is_true;
+
+        if (condition_was_true == condition_is_true)
+            continue;
+
+        //Conditions of a rule are registered together, so a rule with several
+        //changed conditions will only show up at the tail of the rundown list.
+        if (nodes_assigned > 0 && checklist[nodes_assigned - 1] == condition->rule)
+            continue;
+
+        if (nodes_assigned >= nodes_allocd) {
+            alloc_check = (struct rule **)realloc(checklist, nodes_allocd * 2 * sizeof(struct rule *));
+            if (alloc_check == NULL) {
+                xcpmd_log(LOG_ERR, "Failed to realloc memory\n");
+                free(checklist);
+                return;
+            }
+            checklist = alloc_check;
+            nodes_allocd *= 2;
+        }
+
+        checklist[nodes_assigned] = condition->rule;
+        ++nodes_assigned;
+    }
+
+    //Evaluate each rule depending on those conditions.
+    for (i=0; i < nodes_assigned; ++i) {
+
+        rule_is_true = evaluate_rule(checklist[i]);
+        rule_was_true = checklist[i]->is_active;
+
+        if (rule_is_true && !rule_was_true)
+            do_actions(checklist[i]);
+        else if (rule_was_true && !rule_is_true)
+            do_undos(checklist[i]);
+
+        checklist[i]->is_active = rule_is_true;
+    }
+
+    free(checklist);
+}
+
+
 //Gets a pointer to a particular module's event table by variable name.
 //Expects table_module to be the filename of the module's .so file.
 //It is essential that table names be unique to each module, or shadowing may
@@ -290,11 +575,25 @@ void evaluate_policy(void) {
 
 
 //Load policy from the DB.
+//If the policy cache was written for the policy currently in the DB, it is
+//used instead of parsing the DB. Otherwise the cache is rewritten once the DB
+//has been parsed.
 int load_policy_from_db() {
 
+    uint64_t hash;
+
+    if (policy_source_hash(&hash) == 0 && load_policy_cache(hash) == 0) {
+        evaluate_policy();
+        return 0;
+    }
+
     if (parse_config_from_db() != 0)
         return -1;
 
+    //Parsing writes variables back to the DB, so hash it again.
+    if (policy_source_hash(&hash) == 0)
+        write_policy_cache(hash);
+
     evaluate_policy();
     return 0;
 }
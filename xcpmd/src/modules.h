@@ -21,20 +21,28 @@
 #ifndef __MODULES_H__
 #define __MODULES_H__
 
+#include <stdbool.h>
+
 
 struct ev_wrapper;
+struct db_var;
 
 
 int init_modules();
 void uninit_modules();
 void * load_module(char * filename);
-void unload_module(char * filename);
-int load_modules(char ** module_list, unsigned int num_modules);
-void unload_modules(char ** module_list, unsigned int num_modules);
+void unload_module(void * handle);
+
+bool load_module_for_type(char * type_name);
+void get_module_ref(char * type_name);
+void put_module_ref(char * type_name);
+int load_all_modules();
+void unload_unused_modules();
 
 struct ev_wrapper ** get_event_table(char * table_name, char * table_module);
 
 void handle_events(struct ev_wrapper * event);
+void handle_var_change(struct db_var * var);
 
 int load_policy_from_db();
 int load_policy_from_file(char * filename);
@@ -1701,6 +1701,76 @@ bool parse_rule(char * name,       //rule name
 }
 
 
+//Sets up the parser FSM once and adds a set of rules. The set is all-or-nothing:
+//if any rule can't be parsed, every rule added by this call is removed again.
+//On success, the DB is updated once for the whole set.
+bool parse_rules(int num_rules,      //number of entries in each of the arrays below
+                 char ** names,      //rule names
+                 char ** conditions, //space-separated lists of conditions
+                 char ** actions,    //space-separated lists of actions
+                 char ** undos,      //space-separated lists of undo actions
+                 char ** error) //A reference to a preallocated char *, overwritten by this function; usually data->message
+{
+
+    struct state_list states;
+    struct var_map var_map;
+    struct parse_data data;
+    struct rule ** added, * tail;
+    int i, num_added = 0;
+    bool ret = true, failed = false;
+
+    added = (struct rule **)malloc((num_rules > 0 ? num_rules : 1) * sizeof(struct rule *));
+    if (added == NULL) {
+        safe_str_append(error, "couldn't allocate memory");
+        return false;
+    }
+
+    init_state_list(&states);
+    init_var_map(&var_map);
+
+    memset(&data, 0, sizeof(struct parse_data));
+    memset(&var_map, 0, sizeof(struct var_map));
+
+    init_parse_data(&data, &var_map, build_parse_state_list(&states), NULL, NULL, NULL, NULL, NULL, TYPE_UNDETERMINED);
+    if (parse_db_vars(&data)) {
+        for (i = 0; i < num_rules; ++i) {
+            tail = get_rule_tail();
+
+            failed = !parse_rule_persistent(&data, names[i], conditions[i], actions[i], undos[i]);
+
+            //A rule with a recoverable error is added anyway; it has to go too.
+            if (get_rule_tail() != tail)
+                added[num_added++] = get_rule_tail();
+
+            if (failed) {
+                safe_str_append(error, "couldn't parse rule %s: %s", names[i], extract_parse_error(&data));
+                break;
+            }
+        }
+
+        if (failed) {
+            for (i = 0; i < num_added; ++i)
+                delete_rule(added[i]);
+            ret = false;
+        }
+        else if (num_added > 0) {
+            replace_db_rules(NULL);
+        }
+    }
+    else {
+        safe_str_append(error, "couldn't parse varmap: %s", data.message);
+        ret = false;
+    }
+
+    cleanup_parse_data(&data);
+    free_var_map(&var_map);
+    free_parse_state_list(&states);
+    free(added);
+
+    return ret;
+}
+
+
 //Sets up the parser state machine and adds or modifies a single variable. //TODO: More depth
 bool parse_var(char * var_string, //string of the form varname(value)
                char ** error) //A reference to a preallocated char *, overwritten by this function; usually data->message
@@ -44,6 +44,7 @@ bool parse_rule_persistent(struct parse_data * data, char * name, char * conditi
 bool parse_var_persistent(struct parse_data * data, char * var_string);
 
 bool parse_rule(char * name, char * conditions, char * actions, char * undos, char ** error);
+bool parse_rules(int num_rules, char ** names, char ** conditions, char ** actions, char ** undos, char ** error);
 bool parse_var(char * var_string, char ** error);
 bool parse_arg(char * arg_string, struct arg_node * arg_out, char ** error);
 
@@ -0,0 +1,522 @@
+/*
+ * policy-cache.c
+ *
+ * Save and restore the resolved policy as a compact binary blob.
+ *
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "project.h"
+#include "xcpmd.h"
+#include "rules.h"
+#include "db-helper.h"
+#include "policy-cache.h"
+
+/**
+ * Loading policy from the DB means fetching every rule as JSON, converting it
+ * back into policy text and running it through the parser's state machine.
+ * Once that has been done, the validated rules and variables are written to
+ * POLICY_CACHE_PATH, keyed by a hash of the DB's power management subtree.
+ *
+ * On the next start, if the hash still matches, the cache is mmap()ed and the
+ * rules are rebuilt directly from it: one DB dump instead of one per rule, and
+ * no text parsing. Condition and action types are stored by name and resolved
+ * through the usual lookup, since modules are loaded on demand and the order
+ * in which types are registered is not stable across runs.
+ *
+ * Any mismatch or malformed record makes the load fail, in which case the
+ * caller falls back to parsing the DB as usual.
+ */
+
+//Private data structures
+struct cache_buf {
+    char * data;
+    uint32_t len;
+    uint32_t cap;
+    bool failed;
+};
+
+struct cache_cursor {
+    const char * data;
+    uint32_t pos;
+    uint32_t end;
+};
+
+
+//Function prototypes
+static uint64_t fnv1a_hash(const char * str);
+static void buf_append(struct cache_buf * buf, const void * data, uint32_t len);
+static uint32_t buf_intern(struct cache_buf * strings, char * str);
+static void write_arg(struct cache_buf * records, struct cache_buf * strings, enum arg_type type, union arg_u arg);
+static void write_fn(struct cache_buf * records, struct cache_buf * strings, char * type_name, bool is_inverted, struct arg_node * args);
+static const void * cursor_take(struct cache_cursor * cursor, uint32_t len);
+static char * cache_string(const char * strings, uint32_t strings_len, uint32_t offset);
+static bool read_arg(struct cache_cursor * cursor, const char * strings, uint32_t strings_len, struct arg_node * out);
+static struct rule * read_rule(struct cache_cursor * cursor, const char * strings, uint32_t strings_len);
+
+
+//Hashes a string with 64-bit FNV-1a.
+static uint64_t fnv1a_hash(const char * str) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+
+//Hashes the policy source (the DB's power management subtree).
+//Returns 0 on success, -1 if the DB couldn't be read.
+int policy_source_hash(uint64_t * hash) {
+
+    char * json = dump_db_policy();
+
+    if (json == NULL)
+        return -1;
+
+    *hash = fnv1a_hash(json);
+    free(json);
+
+    return 0;
+}
+
+
+//Appends raw bytes to a buffer, growing it as needed. On allocation failure,
+//marks the buffer as failed and ignores all further appends.
+static void buf_append(struct cache_buf * buf, const void * data, uint32_t len) {
+
+    char * new_data;
+    uint32_t new_cap;
+
+    if (buf->failed)
+        return;
+
+    if (buf->len + len > buf->cap) {
+        new_cap = buf->cap ? buf->cap : 1024;
+        while (new_cap < buf->len + len)
+            new_cap *= 2;
+
+        new_data = (char *)realloc(buf->data, new_cap);
+        if (new_data == NULL) {
+            xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+            buf->failed = true;
+            return;
+        }
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+
+//Adds a string to the string table unless an identical one is already there.
+//Returns its offset.
+static uint32_t buf_intern(struct cache_buf * strings, char * str) {
+
+    uint32_t offset = 0;
+
+    while (offset < strings->len) {
+        if (strcmp(strings->data + offset, str) == 0)
+            return offset;
+        offset += strlen(strings->data + offset) + 1;
+    }
+
+    buf_append(strings, str, strlen(str) + 1);
+    return offset;
+}
+
+
+//Serializes a single argument.
+static void write_arg(struct cache_buf * records, struct cache_buf * strings, enum arg_type type, union arg_u arg) {
+
+    struct policy_cache_arg out;
+
+    out.type = (uint32_t)type;
+    out.value = 0;
+
+    switch (type) {
+        case ARG_INT:
+            out.value = (uint32_t)arg.i;
+            break;
+        case ARG_BOOL:
+            out.value = arg.b ? 1 : 0;
+            break;
+        case ARG_CHAR:
+            out.value = (unsigned char)arg.c;
+            break;
+        case ARG_FLOAT:
+            memcpy(&out.value, &arg.f, sizeof(float));
+            break;
+        case ARG_STR:
+            out.value = buf_intern(strings, arg.str);
+            break;
+        case ARG_VAR:
+            out.value = buf_intern(strings, arg.var_name);
+            break;
+        default:
+            break;
+    }
+
+    buf_append(records, &out, sizeof(out));
+}
+
+
+//Serializes a condition or action along with its arguments.
+static void write_fn(struct cache_buf * records, struct cache_buf * strings, char * type_name, bool is_inverted, struct arg_node * args) {
+
+    struct policy_cache_fn fn;
+    struct arg_node * arg;
+
+    fn.type_name = buf_intern(strings, type_name);
+    fn.is_inverted = is_inverted ? 1 : 0;
+    fn.num_args = list_length(&args->list);
+    buf_append(records, &fn, sizeof(fn));
+
+    list_for_each_entry(arg, &args->list, list) {
+        write_arg(records, strings, arg->type, arg->arg);
+    }
+}
+
+
+//Writes all currently loaded rules and cached variables to POLICY_CACHE_PATH,
+//keyed by source_hash. The file is replaced atomically.
+//Returns 0 on success, -1 on failure.
+int write_policy_cache(uint64_t source_hash) {
+
+    struct cache_buf records = { NULL, 0, 0, false };
+    struct cache_buf strings = { NULL, 0, 0, false };
+    struct policy_cache_header header;
+    struct policy_cache_var cvar;
+    struct policy_cache_rule crule;
+    struct db_var * var;
+    struct rule * rule;
+    struct condition * condition;
+    struct action * action;
+    char * tmp_path;
+    int fd, ret = -1;
+    ssize_t written;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = POLICY_CACHE_MAGIC;
+    header.version = POLICY_CACHE_VERSION;
+    header.source_hash = source_hash;
+
+    list_for_each_entry(var, &db_vars.list, list) {
+        cvar.name = buf_intern(&strings, var->name);
+        buf_append(&records, &cvar.name, sizeof(cvar.name));
+        write_arg(&records, &strings, var->value.type, var->value.arg);
+        ++header.num_vars;
+    }
+
+    list_for_each_entry(rule, &rules.list, list) {
+        crule.name = buf_intern(&strings, rule->id);
+        crule.num_conditions = list_length(&rule->conditions.list);
+        crule.num_actions = list_length(&rule->actions.list);
+        crule.num_undos = list_length(&rule->undos.list);
+        buf_append(&records, &crule, sizeof(crule));
+
+        list_for_each_entry(condition, &rule->conditions.list, list) {
+            write_fn(&records, &strings, condition->type->name, condition->is_inverted, &condition->args);
+        }
+        list_for_each_entry(action, &rule->actions.list, list) {
+            write_fn(&records, &strings, action->type->name, false, &action->args);
+        }
+        list_for_each_entry(action, &rule->undos.list, list) {
+            write_fn(&records, &strings, action->type->name, false, &action->args);
+        }
+        ++header.num_rules;
+    }
+
+    if (records.failed || strings.failed)
+        goto out;
+
+    header.strings_offset = sizeof(header) + records.len;
+    header.strings_len = strings.len;
+    header.size = header.strings_offset + strings.len;
+
+    mkdir(POLICY_CACHE_DIR, 0700);
+    tmp_path = safe_sprintf("%s.tmp", POLICY_CACHE_PATH);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        xcpmd_log(LOG_DEBUG, "Couldn't open %s for writing: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        goto out;
+    }
+
+    written = write(fd, &header, sizeof(header));
+    if (records.len > 0 && written == sizeof(header))
+        written += write(fd, records.data, records.len);
+    if (strings.len > 0 && written == (ssize_t)(sizeof(header) + records.len))
+        written += write(fd, strings.data, strings.len);
+    close(fd);
+
+    if (written != (ssize_t)header.size || rename(tmp_path, POLICY_CACHE_PATH) != 0) {
+        xcpmd_log(LOG_DEBUG, "Couldn't write policy cache %s\n", POLICY_CACHE_PATH);
+        unlink(tmp_path);
+    }
+    else {
+        xcpmd_log(LOG_DEBUG, "Wrote policy cache: %u rules, %u vars, %u bytes\n", header.num_rules, header.num_vars, header.size);
+        ret = 0;
+    }
+    free(tmp_path);
+
+out:
+    free(records.data);
+    free(strings.data);
+    return ret;
+}
+
+
+//Returns a pointer to the next len bytes of the record area and advances the
+//cursor, or null if fewer than len bytes remain.
+static const void * cursor_take(struct cache_cursor * cursor, uint32_t len) {
+
+    const void * ptr;
+
+    if (cursor->end - cursor->pos < len)
+        return NULL;
+
+    ptr = cursor->data + cursor->pos;
+    cursor->pos += len;
+    return ptr;
+}
+
+
+//Returns the string at an offset in the string table, or null if the offset
+//is out of bounds. The table is known to end in a NUL.
+static char * cache_string(const char * strings, uint32_t strings_len, uint32_t offset) {
+
+    if (offset >= strings_len)
+        return NULL;
+
+    return (char *)strings + offset;
+}
+
+
+//Deserializes a single argument. String arguments are copied.
+static bool read_arg(struct cache_cursor * cursor, const char * strings, uint32_t strings_len, struct arg_node * out) {
+
+    const struct policy_cache_arg * in = cursor_take(cursor, sizeof(*in));
+    char * str;
+
+    if (in == NULL)
+        return false;
+
+    out->type = (enum arg_type)in->type;
+    memset(&out->arg, 0, sizeof(out->arg));
+
+    switch (out->type) {
+        case ARG_INT:
+            out->arg.i = (int)in->value;
+            break;
+        case ARG_BOOL:
+            out->arg.b = in->value != 0;
+            break;
+        case ARG_CHAR:
+            out->arg.c = (char)in->value;
+            break;
+        case ARG_FLOAT:
+            memcpy(&out->arg.f, &in->value, sizeof(float));
+            break;
+        case ARG_STR:
+        case ARG_VAR:
+            str = cache_string(strings, strings_len, in->value);
+            if (str == NULL)
+                return false;
+            if (out->type == ARG_STR)
+                out->arg.str = clone_string(str);
+            else
+                out->arg.var_name = clone_string(str);
+            break;
+        case ARG_NONE:
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+
+//Allocates memory!
+//Rebuilds a single rule and its conditions, actions and undos.
+//Returns the new rule (not yet added to the rule list), or null on failure.
+static struct rule * read_rule(struct cache_cursor * cursor, const char * strings, uint32_t strings_len) {
+
+    const struct policy_cache_rule * crule;
+    const struct policy_cache_fn * fn;
+    struct rule * rule;
+    struct condition * condition;
+    struct action * action;
+    struct arg_node arg;
+    char * name;
+    uint32_t i, j, num_fns;
+
+    crule = cursor_take(cursor, sizeof(*crule));
+    if (crule == NULL)
+        return NULL;
+
+    name = cache_string(strings, strings_len, crule->name);
+    if (name == NULL)
+        return NULL;
+
+    rule = new_rule(clone_string(name));
+    if (rule == NULL)
+        return NULL;
+
+    num_fns = crule->num_conditions + crule->num_actions + crule->num_undos;
+    for (i = 0; i < num_fns; ++i) {
+
+        fn = cursor_take(cursor, sizeof(*fn));
+        if (fn == NULL || (name = cache_string(strings, strings_len, fn->type_name)) == NULL)
+            goto fail;
+
+        if (i < crule->num_conditions) {
+            condition = new_condition_from_string(name);
+            if (condition == NULL)
+                goto fail;
+            if (fn->is_inverted)
+                invert_condition(condition);
+            add_condition_to_rule(rule, condition);
+
+            for (j = 0; j < fn->num_args; ++j) {
+                if (!read_arg(cursor, strings, strings_len, &arg))
+                    goto fail;
+                add_condition_arg(condition, arg.type, arg.arg);
+            }
+        }
+        else {
+            action = new_action_from_string(name);
+            if (action == NULL)
+                goto fail;
+            if (i < crule->num_conditions + crule->num_actions)
+                add_action_to_rule(rule, action);
+            else
+                add_undo_to_rule(rule, action);
+
+            for (j = 0; j < fn->num_args; ++j) {
+                if (!read_arg(cursor, strings, strings_len, &arg))
+                    goto fail;
+                add_action_arg(action, arg.type, arg.arg);
+            }
+        }
+    }
+
+    return rule;
+
+fail:
+    delete_rule(rule);
+    return NULL;
+}
+
+
+//Loads rules and variables from POLICY_CACHE_PATH if it was written for
+//source_hash. Returns 0 on success. On failure, returns -1 and deletes any
+//rules loaded so far; only meant to be used while the rule list is empty.
+int load_policy_cache(uint64_t source_hash) {
+
+    const struct policy_cache_header * header;
+    const uint32_t * var_name;
+    struct cache_cursor cursor;
+    struct stat st;
+    struct rule * rule;
+    struct arg_node arg;
+    const char * strings;
+    char * name, * err = NULL;
+    void * map;
+    uint32_t i;
+    int fd, ret = -1;
+
+    fd = open(POLICY_CACHE_PATH, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*header)) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    header = (const struct policy_cache_header *)map;
+    if (header->magic != POLICY_CACHE_MAGIC || header->version != POLICY_CACHE_VERSION ||
+        header->source_hash != source_hash || header->size != (uint64_t)st.st_size ||
+        header->strings_offset < sizeof(*header) || header->strings_offset > header->size ||
+        header->strings_len != header->size - header->strings_offset ||
+        (header->strings_len > 0 && ((const char *)map)[header->size - 1] != '\0')) {
+        xcpmd_log(LOG_DEBUG, "Policy cache is stale or malformed; ignoring\n");
+        goto out;
+    }
+
+    strings = (const char *)map + header->strings_offset;
+    cursor.data = (const char *)map;
+    cursor.pos = sizeof(*header);
+    cursor.end = header->strings_offset;
+
+    for (i = 0; i < header->num_vars; ++i) {
+        //A var record is its name followed by an arg record.
+        var_name = cursor_take(&cursor, sizeof(*var_name));
+        if (var_name == NULL || (name = cache_string(strings, header->strings_len, *var_name)) == NULL)
+            goto fail;
+        if (!read_arg(&cursor, strings, header->strings_len, &arg))
+            goto fail;
+
+        restore_var(name, arg.type, arg.arg);
+        if (arg.type == ARG_STR)
+            free(arg.arg.str);
+        else if (arg.type == ARG_VAR)
+            free(arg.arg.var_name);
+    }
+
+    for (i = 0; i < header->num_rules; ++i) {
+        rule = read_rule(&cursor, strings, header->strings_len);
+        if (rule == NULL)
+            goto fail;
+
+        //The types' prototypes may have changed since the cache was written.
+        if (validate_rule(rule, &err) != RULE_VALID) {
+            delete_rule(rule);
+            goto fail;
+        }
+        add_rule(rule);
+    }
+
+    xcpmd_log(LOG_INFO, "Loaded %u rules and %u vars from policy cache\n", header->num_rules, header->num_vars);
+    ret = 0;
+    goto out;
+
+fail:
+    xcpmd_log(LOG_WARNING, "Policy cache %s is unusable; reparsing policy\n", POLICY_CACHE_PATH);
+    delete_rules();
+
+out:
+    free(err);
+    munmap(map, st.st_size);
+    return ret;
+}
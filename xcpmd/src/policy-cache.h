@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __POLICY_CACHE_H__
+#define __POLICY_CACHE_H__
+
+#include <stdint.h>
+
+#define POLICY_CACHE_DIR        "/var/cache/xcpmd"
+#define POLICY_CACHE_PATH       POLICY_CACHE_DIR "/policy.bin"
+#define POLICY_CACHE_MAGIC      0x434d5058 //"XPMC"
+#define POLICY_CACHE_VERSION    1
+
+
+//On-disk layout. All fields are native-endian; the cache is never shared
+//between machines. String fields are byte offsets into the string table.
+//
+//  header
+//  var record * num_vars
+//  rule record * num_rules, each followed by its fn records
+//  fn record, followed by num_args arg records
+//  string table (NUL-terminated strings)
+struct policy_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash;
+    uint32_t size;
+    uint32_t num_vars;
+    uint32_t num_rules;
+    uint32_t strings_offset;
+    uint32_t strings_len;
+    uint32_t reserved;
+};
+
+struct policy_cache_arg {
+    uint32_t type;
+    uint32_t value; //Integer bits, float bits, or string offset.
+};
+
+struct policy_cache_var {
+    uint32_t name;
+    struct policy_cache_arg value;
+};
+
+struct policy_cache_rule {
+    uint32_t name;
+    uint32_t num_conditions;
+    uint32_t num_actions;
+    uint32_t num_undos;
+};
+
+struct policy_cache_fn {
+    uint32_t type_name;
+    uint32_t is_inverted;
+    uint32_t num_args;
+};
+
+
+int policy_source_hash(uint64_t * hash);
+int load_policy_cache(uint64_t source_hash);
+int write_policy_cache(uint64_t source_hash);
+
+#endif
@@ -30,6 +30,7 @@
 #include "prototypes.h"
 #include "rules.h"
 #include "db-helper.h"
+#include "modules.h"
 
 
 //Global variables
@@ -44,6 +45,8 @@ struct db_var db_vars;
 static char * long_prototype(char * short_prototype);
 static void dec_variable_refs(struct rule * rule);
 static void inc_variable_refs(struct rule * rule);
+static void add_var_listener(struct db_var * var, struct condition * condition);
+static void delete_var_listener(struct db_var * var, struct condition * condition);
 
 
 //Initializes all global lists.
@@ -183,6 +186,49 @@ struct action_type * add_action_type(char * name, void (* action_func)(struct ar
 }
 
 
+//Removes an event from the shared list of events and frees it, along with any
+//listener nodes still attached to it. Modules call this when they are unloaded.
+void delete_event(struct ev_wrapper * event) {
+
+    struct condition_node *node, *tmp;
+
+    if (event == NULL)
+        return;
+
+    list_for_each_entry_safe(node, tmp, &event->listeners.list, list) {
+        list_del(&node->list);
+        free(node);
+    }
+
+    list_del(&event->list);
+    free(event);
+}
+
+
+//Removes a condition_type from the shared list of condition_types and frees it.
+//No condition of this type may remain in any rule.
+void delete_condition_type(struct condition_type * type) {
+
+    if (type == NULL)
+        return;
+
+    list_del(&type->list);
+    free(type);
+}
+
+
+//Removes an action_type from the shared list of action_types and frees it.
+//No action of this type may remain in any rule.
+void delete_action_type(struct action_type * type) {
+
+    if (type == NULL)
+        return;
+
+    list_del(&type->list);
+    free(type);
+}
+
+
 //Allocates memory!
 //Creates a new blank rule, but does not add it to the global linked list.
 //Returns the new rule.
@@ -235,6 +281,9 @@ struct condition * new_condition(struct condition_type * type) {
     new_ref->condition = new_condition;
     list_add_tail(&(new_ref->list), &(type->event->listeners.list));
 
+    //Keep the module providing this type loaded for as long as the condition exists.
+    get_module_ref(type->name);
+
     return new_condition;
 }
 
@@ -258,6 +307,9 @@ struct action * new_action(struct action_type * type) {
 
     INIT_LIST_HEAD(&(new_action->args.list));
 
+    //Keep the module providing this type loaded for as long as the action exists.
+    get_module_ref(type->name);
+
     return new_action;
 }
 
@@ -384,8 +436,8 @@ void add_rule(struct rule * rule) {
 }
 
 
-//Increments the refcount for all variables referenced by a rule.
-//TODO: move to keeping references to rules instead of counts
+//Increments the refcount for all variables referenced by a rule, and registers
+//the rule's conditions as listeners of the variables they take as arguments.
 static void inc_variable_refs(struct rule * rule) {
 
     struct condition * cond;
@@ -399,6 +451,7 @@ static void inc_variable_refs(struct rule * rule) {
             if (arg->type == ARG_VAR) {
                 var = lookup_var(arg->arg.var_name);
                 ++var->ref_count;
+                add_var_listener(var, cond);
             }
         }
     }
@@ -425,7 +478,8 @@ static void inc_variable_refs(struct rule * rule) {
 }
 
 
-//Decrements the refcount for all variables referenced by a rule.
+//Decrements the refcount for all variables referenced by a rule, and removes
+//the rule's conditions from the variables' lists of listeners.
 static void dec_variable_refs(struct rule * rule) {
 
     struct condition * cond;
@@ -439,6 +493,7 @@ static void dec_variable_refs(struct rule * rule) {
             if (arg->type == ARG_VAR) {
                 var = lookup_var(arg->arg.var_name);
                 --var->ref_count;
+                delete_var_listener(var, cond);
             }
         }
     }
@@ -465,6 +520,46 @@ static void dec_variable_refs(struct rule * rule) {
 }
 
 
+//Allocates memory!
+//Adds a condition to a variable's list of listeners. A condition that takes
+//the same variable more than once is only added once.
+static void add_var_listener(struct db_var * var, struct condition * condition) {
+
+    struct condition_node * node;
+
+    //Args of a condition are walked in order, so a repeat shows up at the tail.
+    if (!list_empty(&var->listeners.list)) {
+        node = list_entry(var->listeners.list.prev, struct condition_node, list);
+        if (node->condition == condition)
+            return;
+    }
+
+    node = (struct condition_node *)malloc(sizeof(struct condition_node));
+    if (node == NULL) {
+        xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+        return;
+    }
+
+    node->condition = condition;
+    list_add_tail(&node->list, &var->listeners.list);
+}
+
+
+//Removes a condition from a variable's list of listeners.
+static void delete_var_listener(struct db_var * var, struct condition * condition) {
+
+    struct condition_node *node, *tmp;
+
+    list_for_each_entry_safe(node, tmp, &var->listeners.list, list) {
+        if (node->condition == condition) {
+            list_del(&node->list);
+            free(node);
+            break;
+        }
+    }
+}
+
+
 //Deallocates all memory used for a rule, and if this rule is in the rule list,
 //removes it. Reinitializes the rule list if it becomes empty.
 void delete_rule(struct rule * rule) {
@@ -503,8 +598,9 @@ void delete_rule(struct rule * rule) {
             free(tmp_arg);
         }
 
-        //And free the condition.
+        //And free the condition, releasing its module.
         list_del(posi);
+        put_module_ref(tmp_condition->type->name);
         free(tmp_condition);
     }
 
@@ -528,8 +624,9 @@ void delete_rule(struct rule * rule) {
             free(tmp_arg);
         }
 
-        //And free the action.
+        //And free the action, releasing its module.
         list_del(posi);
+        put_module_ref(tmp_action->type->name);
         free(tmp_action);
     }
 
@@ -553,8 +650,9 @@ void delete_rule(struct rule * rule) {
             free(tmp_arg);
         }
 
-        //And free the action.
+        //And free the action, releasing its module.
         list_del(posi);
+        put_module_ref(tmp_action->type->name);
         free(tmp_action);
     }
 
@@ -865,10 +963,18 @@ struct rule * get_rule_tail() {
 //Allocates memory!
 //Convenience function to create a new condition from a type string.
 //Returns the new condition, or null on failure.
+//If no such type is registered yet, the module providing it is loaded.
 struct condition * new_condition_from_string(char * type_name) {
 
     struct condition_type * type = lookup_condition_type(type_name);
-    struct condition * condition = new_condition(type);
+    struct condition * condition;
+
+    if (type == NULL && load_module_for_type(type_name))
+        type = lookup_condition_type(type_name);
+
+    condition = new_condition(type);
+    if (condition == NULL)
+        unload_unused_modules();
 
     return condition;
 }
@@ -877,10 +983,18 @@ struct condition * new_condition_from_string(char * type_name) {
 //Allocates memory!
 //Convenience function to create a new action from a type string.
 //Returns the new action, or null on failure.
+//If no such type is registered yet, the module providing it is loaded.
 struct action * new_action_from_string(char * type_name) {
 
     struct action_type * type = lookup_action_type(type_name);
-    struct action * action = new_action(type);
+    struct action * action;
+
+    if (type == NULL && load_module_for_type(type_name))
+        type = lookup_action_type(type_name);
+
+    action = new_action(type);
+    if (action == NULL)
+        unload_unused_modules();
 
     return action;
 }
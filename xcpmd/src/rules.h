@@ -42,7 +42,9 @@
  * Arguments are stored in arg_node structs that contain a union of possible types and an enum specifying the type.
  * Arguments of type string or var are assumed to contain malloc'd strings, which are free'd in undo functions.
  * Arguments of type var have a pointer to a db_var struct containing the cached DB value of that variable; more on
- * the variable cache is available in db-helper.c.
+ * the variable cache is available in db-helper.c. Each db_var also keeps a list of the conditions whose arguments
+ * refer to it (its "listeners"), so that a change to the variable's value only re-checks the conditions that can
+ * be affected by it--see handle_var_change() in modules.c.
  *
  * Similarly to condition_types, there are also a set of action_types (stored in the global "action_types"). An
  * action_type has a name, a function returning void, a prototype for that function, and a pretty prototype for
@@ -200,12 +202,15 @@ struct rule {
 };
 
 
-//A linked list node representing a variable from the DB.
+//A linked list node representing a variable from the DB. Conditions that
+//take this variable as an argument are kept in its list of listeners, and
+//are rechecked whenever the variable's value changes.
 struct db_var {
     struct list_head list;
     char * name;
     struct arg_node value;
     int ref_count;
+    struct condition_node listeners;
 };
 
 
@@ -221,6 +226,9 @@ extern struct db_var db_vars;
 struct ev_wrapper * add_event(char * event_name, bool is_stateless, enum arg_type value_type, union arg_u reset_value);
 struct condition_type * add_condition_type(char * name, bool (* check)(struct ev_wrapper *, struct arg_node *), char * prototype, char * pretty_prototype, struct ev_wrapper * event);
 struct action_type * add_action_type(char * name, void (* action_func)(struct arg_node *), char * prototype, char * pretty_prototype);
+void delete_event(struct ev_wrapper * event);
+void delete_condition_type(struct condition_type * type);
+void delete_action_type(struct action_type * type);
 
 struct rule * new_rule(char * id);
 struct condition * new_condition(struct condition_type * type);
@@ -0,0 +1,514 @@
+/*
+ * timer-module.c
+ *
+ * XCPMD module that provides named one-shot and periodic timers to policy.
+ *
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "project.h"
+#include "xcpmd.h"
+#include "modules.h"
+#include "rules.h"
+#include "timer-module.h"
+
+/**
+ * This module lets policy start and stop named timers, and react to them
+ * expiring. Timers are started and stopped by actions, and their expiry is a
+ * stateless event, so they compose with the rest of the policy:
+ *
+ *   One-shot:   ... | startTimer("name" 30)         |
+ *   Periodic:   ... | startPeriodicTimer("name" 60) | stopTimer("name")
+ *   Expiry:     whenTimerExpires("name") | ...
+ *
+ * "State held for N seconds" is a pair of rules: one that starts a timer when
+ * the state is entered and stops it as its undo, and one that fires on the
+ * timer's expiry. Starting a timer that is already pending restarts it.
+ *
+ * Pending timers live in a hierarchical timer wheel, as in the classic Linux
+ * kernel timer implementation. Level 0 holds timers expiring within the next
+ * TIMER_WHEEL_SIZE ticks, one slot per tick; each higher level covers
+ * TIMER_WHEEL_SIZE times the span of the level below it. Timers in higher
+ * levels are cascaded down one level each time the level below wraps, so
+ * adding, removing and expiring a timer are all O(1), and a tick touches only
+ * the timers actually due. The wheel is driven by a libevent timer that is
+ * only armed while at least one timer is pending. Timers are found by name
+ * through a small hash table, so starting and stopping one is O(1) as well.
+ */
+
+
+//Function prototypes
+bool timer_expired(struct ev_wrapper * event, struct arg_node * args);
+void start_timer(struct arg_node * args);
+void start_periodic_timer(struct arg_node * args);
+void stop_timer(struct arg_node * args);
+
+static void wrapper_timer_tick(int fd, short event, void * opaque);
+
+
+//Private data structures
+struct event_data_row {
+    char * name;
+    bool is_stateless;
+    enum arg_type value_type;
+    union arg_u reset_value;
+    unsigned int index;
+};
+
+struct cond_table_row {
+    char * name;
+    bool (* func)(struct ev_wrapper *, struct arg_node *);
+    char * prototype;
+    char * pretty_prototype;
+    unsigned int event_index;
+};
+
+struct action_table_row {
+    char * name;
+    void (* func)(struct arg_node *);
+    char * prototype;
+    char * pretty_prototype;
+};
+
+//A named timer. Timers are never freed while the module is loaded, so that an
+//expiring timer's name remains valid while its event is being handled.
+struct policy_timer {
+    struct list_head list;      //Link in a wheel slot, if pending
+    struct list_head all;       //Link in its bucket of the table of all known timers
+    char * name;
+    unsigned long expires;      //Tick at which this timer fires
+    unsigned int period;        //Period in ticks, or 0 for a one-shot timer
+    bool pending;
+};
+
+
+//Private data
+static struct event_data_row event_data[] = {
+    {"event_timer_expired" , IS_STATELESS , ARG_STR , { .str = "" } , EVENT_TIMER_EXPIRED }
+};
+
+static struct cond_table_row condition_data[] = {
+    {"whenTimerExpires" , timer_expired , "s" , "string timer_name" , EVENT_TIMER_EXPIRED }
+};
+
+static struct action_table_row action_table[] = {
+    {"startTimer"         , start_timer          , "s i" , "string timer_name, int seconds" } ,
+    {"startPeriodicTimer" , start_periodic_timer , "s i" , "string timer_name, int seconds" } ,
+    {"stopTimer"          , stop_timer           , "s"   , "string timer_name"              }
+};
+
+static unsigned int num_events = sizeof(event_data) / sizeof(event_data[0]);
+static unsigned int num_conditions = sizeof(condition_data) / sizeof(condition_data[0]);
+static unsigned int num_action_types = sizeof(action_table) / sizeof(action_table[0]);
+
+static int times_loaded = 0;
+
+static struct list_head timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static struct list_head all_timers[TIMER_HASH_SIZE];
+static unsigned long current_tick;
+static unsigned int num_pending;
+static struct timespec epoch;
+static struct event tick_event;
+static bool tick_armed = false;
+
+
+//Public data
+struct ev_wrapper ** _timer_event_table;
+
+
+//Initializes the module.
+//The constructor attribute causes this function to run at load (dlopen()) time.
+__attribute__((constructor)) static void init_module() {
+
+    if (times_loaded > 0)
+        return;
+
+    unsigned int i, j;
+
+    //Allocate space for event tables.
+    _timer_event_table = (struct ev_wrapper **)malloc(num_events * sizeof(struct ev_wrapper *));
+    if (!(_timer_event_table)) {
+        xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+        return;
+    }
+
+    //Add all events to the event list.
+    for (i=0; i < num_events; ++i) {
+        struct event_data_row entry = event_data[i];
+        _timer_event_table[entry.index] = add_event(entry.name, entry.is_stateless, entry.value_type, entry.reset_value);
+    }
+
+    //Add all condition_types to the condition_type list.
+    for (i=0; i < num_conditions; ++i) {
+        struct cond_table_row entry = condition_data[i];
+        add_condition_type(entry.name, entry.func, entry.prototype, entry.pretty_prototype, _timer_event_table[entry.event_index]);
+    }
+
+    //Add all action_types to the action_type list.
+    for (i=0; i < num_action_types; ++i)
+        add_action_type(action_table[i].name, action_table[i].func, action_table[i].prototype, action_table[i].pretty_prototype);
+
+    //Set up the timer wheel.
+    for (i=0; i < TIMER_WHEEL_LEVELS; ++i) {
+        for (j=0; j < TIMER_WHEEL_SIZE; ++j) {
+            INIT_LIST_HEAD(&timer_wheel[i][j]);
+        }
+    }
+    for (i=0; i < TIMER_HASH_SIZE; ++i) {
+        INIT_LIST_HEAD(&all_timers[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    current_tick = 0;
+    num_pending = 0;
+
+    evtimer_set(&tick_event, wrapper_timer_tick, NULL);
+
+    ++times_loaded;
+}
+
+
+//Cleans up after this module.
+//The destructor attribute causes this to run at unload (dlclose()) time.
+__attribute__((destructor)) static void uninit_module() {
+
+    struct policy_timer *timer, *tmp;
+    unsigned int i;
+
+    --times_loaded;
+    if (times_loaded > 0)
+        return;
+
+    if (tick_armed) {
+        evtimer_del(&tick_event);
+        tick_armed = false;
+    }
+
+    for (i=0; i < TIMER_HASH_SIZE; ++i) {
+        list_for_each_entry_safe(timer, tmp, &all_timers[i], all) {
+            list_del(&timer->all);
+            free(timer->name);
+            free(timer);
+        }
+    }
+
+    //Unregister action_types, condition_types and events.
+    for (i=0; i < num_action_types; ++i)
+        delete_action_type(lookup_action_type(action_table[i].name));
+
+    for (i=0; i < num_conditions; ++i)
+        delete_condition_type(lookup_condition_type(condition_data[i].name));
+
+    for (i=0; i < num_events; ++i)
+        delete_event(_timer_event_table[i]);
+
+    //Free event tables.
+    free(_timer_event_table);
+}
+
+
+//Returns the tick the wall clock is currently in.
+static unsigned long clock_tick(void) {
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long)(now.tv_sec - epoch.tv_sec) / TIMER_TICK_SECONDS;
+}
+
+
+//Places a timer into the wheel slot matching its expiry time.
+static void wheel_insert(struct policy_timer * timer) {
+
+    unsigned long delta, max_delta;
+    unsigned int level;
+
+    //Clamp timers beyond the reach of the top level.
+    max_delta = (1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    if ((long)(timer->expires - current_tick) < 0) {
+        timer->expires = current_tick;
+    }
+    else if (timer->expires - current_tick > max_delta) {
+        timer->expires = current_tick + max_delta;
+    }
+
+    delta = timer->expires - current_tick;
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        if (delta < (1UL << (TIMER_WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    list_add_tail(&timer->list, &timer_wheel[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK]);
+}
+
+
+//Moves every timer in a slot of a higher level down into the levels below it.
+//Returns the index of the slot that was cascaded.
+static unsigned int wheel_cascade(unsigned int level) {
+
+    struct list_head work;
+    struct policy_timer *timer, *tmp;
+    unsigned int index;
+
+    index = (current_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    INIT_LIST_HEAD(&work);
+    list_splice_init(&timer_wheel[level][index], &work);
+
+    list_for_each_entry_safe(timer, tmp, &work, list) {
+        list_del(&timer->list);
+        wheel_insert(timer);
+    }
+
+    return index;
+}
+
+
+//Arms or disarms the libevent tick depending on whether any timers are pending.
+static void update_tick(void) {
+
+    struct timeval tv;
+
+    if (num_pending > 0 && !tick_armed) {
+        memset(&tv, 0, sizeof(tv));
+        tv.tv_sec = TIMER_TICK_SECONDS;
+        evtimer_add(&tick_event, &tv);
+        tick_armed = true;
+    }
+    else if (num_pending == 0 && tick_armed) {
+        evtimer_del(&tick_event);
+        tick_armed = false;
+    }
+}
+
+
+//Returns the bucket of the timer table a name belongs in (FNV-1a).
+static struct list_head * timer_bucket(const char * name) {
+
+    uint32_t hash = 0x811c9dc5;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 0x01000193;
+    }
+
+    return &all_timers[hash & (TIMER_HASH_SIZE - 1)];
+}
+
+
+//Looks up a timer by name. Returns null on failure.
+static struct policy_timer * lookup_timer(char * name) {
+
+    struct policy_timer * timer;
+
+    list_for_each_entry(timer, timer_bucket(name), all) {
+        if (strcmp(timer->name, name) == 0)
+            return timer;
+    }
+
+    return NULL;
+}
+
+
+//Allocates memory!
+//Looks up a timer by name, creating it if it doesn't exist yet.
+static struct policy_timer * get_timer(char * name) {
+
+    struct policy_timer * timer;
+
+    timer = lookup_timer(name);
+    if (timer != NULL)
+        return timer;
+
+    timer = (struct policy_timer *)malloc(sizeof(struct policy_timer));
+    if (timer == NULL) {
+        xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+        return NULL;
+    }
+
+    timer->name = clone_string(name);
+    timer->expires = 0;
+    timer->period = 0;
+    timer->pending = false;
+    INIT_LIST_HEAD(&timer->list);
+    list_add_tail(&timer->all, timer_bucket(name));
+
+    return timer;
+}
+
+
+//Removes a timer from the wheel, if it is pending.
+static void disarm_timer(struct policy_timer * timer) {
+
+    if (!timer->pending)
+        return;
+
+    list_del_init(&timer->list);
+    timer->pending = false;
+    --num_pending;
+}
+
+
+//(Re)starts a timer to fire in the given number of seconds.
+static void arm_timer(struct policy_timer * timer, int seconds, bool periodic) {
+
+    unsigned int ticks;
+
+    disarm_timer(timer);
+
+    //An idle wheel is empty, so it can be brought up to date for free.
+    if (num_pending == 0)
+        current_tick = clock_tick();
+
+    ticks = (seconds > 0) ? (seconds + TIMER_TICK_SECONDS - 1) / TIMER_TICK_SECONDS : 1;
+
+    timer->period = periodic ? ticks : 0;
+    timer->expires = current_tick + ticks;
+    timer->pending = true;
+    ++num_pending;
+
+    wheel_insert(timer);
+    update_tick();
+}
+
+
+//Fires the expiry event for a single timer.
+static void expire_timer(struct policy_timer * timer) {
+
+    struct ev_wrapper * e = _timer_event_table[EVENT_TIMER_EXPIRED];
+
+    timer->pending = false;
+    --num_pending;
+
+    //Reschedule periodic timers before running any actions, so that a
+    //stopTimer() triggered by this very expiry takes effect.
+    if (timer->period > 0) {
+        timer->expires += timer->period;
+        timer->pending = true;
+        ++num_pending;
+        wheel_insert(timer);
+    }
+
+    xcpmd_log(LOG_DEBUG, "Timer %s expired\n", timer->name);
+
+    e->value.str = timer->name;
+    handle_events(e);
+}
+
+
+//Runs the wheel forward to the current tick, expiring any timers due.
+static void run_timers(void) {
+
+    struct list_head work;
+    struct policy_timer * timer;
+    unsigned long target;
+    unsigned int index, level;
+
+    target = clock_tick();
+
+    while (num_pending > 0 && (long)(target - current_tick) >= 0) {
+
+        index = current_tick & TIMER_WHEEL_MASK;
+
+        //Level 0 wrapped--pull down the next slot of each level above it.
+        level = 1;
+        while (index == 0 && level < TIMER_WHEEL_LEVELS) {
+            index = wheel_cascade(level);
+            ++level;
+        }
+        index = current_tick & TIMER_WHEEL_MASK;
+
+        INIT_LIST_HEAD(&work);
+        list_splice_init(&timer_wheel[0][index], &work);
+        ++current_tick;
+
+        //Actions run on expiry may start or stop any timer, including ones in
+        //the work list, so take timers off of the list one at a time.
+        while (!list_empty(&work)) {
+            timer = list_entry(work.next, struct policy_timer, list);
+            list_del_init(&timer->list);
+            expire_timer(timer);
+        }
+    }
+
+    if (num_pending == 0)
+        current_tick = target;
+}
+
+
+//Called by libevent once per tick while timers are pending.
+static void wrapper_timer_tick(int fd, short event, void * opaque) {
+
+    tick_armed = false;
+    run_timers();
+    update_tick();
+}
+
+
+//Condition checkers
+bool timer_expired(struct ev_wrapper * event, struct arg_node * args) {
+
+    struct arg_node * node = get_arg(args, 0);
+
+    return (0 == strcmp(event->value.str, node->arg.str));
+}
+
+
+//Actions
+void start_timer(struct arg_node * args) {
+
+    struct arg_node * name = get_arg(args, 0);
+    struct arg_node * seconds = get_arg(args, 1);
+    struct policy_timer * timer;
+
+    timer = get_timer(name->arg.str);
+    if (timer == NULL)
+        return;
+
+    arm_timer(timer, seconds->arg.i, false);
+}
+
+
+void start_periodic_timer(struct arg_node * args) {
+
+    struct arg_node * name = get_arg(args, 0);
+    struct arg_node * seconds = get_arg(args, 1);
+    struct policy_timer * timer;
+
+    timer = get_timer(name->arg.str);
+    if (timer == NULL)
+        return;
+
+    arm_timer(timer, seconds->arg.i, true);
+}
+
+
+void stop_timer(struct arg_node * args) {
+
+    struct arg_node * name = get_arg(args, 0);
+    struct policy_timer * timer;
+
+    timer = lookup_timer(name->arg.str);
+    if (timer == NULL)
+        return;
+
+    disarm_timer(timer);
+    update_tick();
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __TIMER_MODULE_H__
+#define __TIMER_MODULE_H__
+
+#define EVENT_TIMER_EXPIRED 0
+
+//Timer wheel geometry: TIMER_WHEEL_LEVELS levels of 2^TIMER_WHEEL_BITS slots,
+//each slot of level n spanning 2^(n * TIMER_WHEEL_BITS) ticks.
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS  4
+
+//Number of buckets timers are looked up by name in.
+#define TIMER_HASH_BITS     6
+#define TIMER_HASH_SIZE     (1 << TIMER_HASH_BITS)
+
+//Length of a tick, in seconds.
+#define TIMER_TICK_SECONDS  1
+
+//Names required for dynamic loading
+#define TIMER_MODULE_SONAME "timer-module.so"
+#define TIMER_EVENTS        "_timer_event_table"
+
+#endif
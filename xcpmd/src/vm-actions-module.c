@@ -128,7 +128,11 @@ __attribute__ ((constructor)) static void init_module() {
 //Cleans up after this module.
 //The destructor attribute causes this to run at unload (dlclose()) time.
 __attribute__ ((destructor)) static void uninit_module() {
-    return;
+
+    unsigned int i;
+
+    for (i=0; i < num_action_types; ++i)
+        delete_action_type(lookup_action_type(action_table[i].name));
 }
 
 
@@ -157,10 +157,19 @@ __attribute__((constructor)) static void init_module() {
 //The destructor attribute causes this to run at unload (dlclose()) time.
 __attribute__((destructor)) static void uninit_module() {
 
+    unsigned int i;
+
     --times_loaded;
     if (times_loaded > 0)
         return;
 
+    //Unregister condition_types and events.
+    for (i=0; i < num_conditions; ++i)
+        delete_condition_type(lookup_condition_type(condition_data[i].name));
+
+    for (i=0; i < num_events; ++i)
+        delete_event(_vm_event_table[i]);
+
     //Free event tables.
     free(_vm_event_table);
 
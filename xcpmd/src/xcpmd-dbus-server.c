@@ -27,6 +27,7 @@
 #include "xcpmd.h"
 #include "parser.h"
 #include "db-helper.h"
+#include "modules.h"
 #include "battery.h"
 
 xcdbus_conn_t *xcdbus_conn = NULL;
@@ -72,6 +73,66 @@ gboolean xcpmd_remove_rule(XcpmdObject *this, const char* IN_rule_name, GError**
 }
 
 
+//Adds a set of rules in one call. The arrays are parallel, one entry per rule.
+//The rules are parsed against a single snapshot of the variables and written
+//to the DB once; if any rule is rejected, none are added.
+gboolean xcpmd_add_rules(XcpmdObject *this, const char** IN_names, const char** IN_conditions, const char** IN_actions, const char** IN_undo_actions, GError** error) {
+
+    char * parse_error = NULL;
+    guint num_rules;
+    gboolean ret;
+
+    num_rules = g_strv_length((gchar **)IN_names);
+    if (g_strv_length((gchar **)IN_conditions) != num_rules ||
+        g_strv_length((gchar **)IN_actions) != num_rules ||
+        g_strv_length((gchar **)IN_undo_actions) != num_rules) {
+        g_set_error(error, DBUS_GERROR, DBUS_GERROR_FAILED, "Rule arrays differ in length");
+        return FALSE;
+    }
+
+    if (!parse_rules(num_rules, (char **)IN_names, (char **)IN_conditions, (char **)IN_actions, (char **)IN_undo_actions, &parse_error)) {
+        xcpmd_log(LOG_WARNING, "%s", parse_error);
+        g_set_error(error, DBUS_GERROR, DBUS_GERROR_FAILED, "%s", parse_error);
+        ret = FALSE;
+    }
+    else {
+        xcpmd_log(LOG_INFO, "Added %u rules.\n", num_rules);
+        ret = TRUE;
+    }
+
+    free(parse_error);
+    return ret;
+}
+
+
+//Removes a set of named rules from the internal rule list, and from the DB in
+//a single operation. If any rule doesn't exist, none are removed.
+gboolean xcpmd_remove_rules(XcpmdObject *this, const char** IN_rule_names, GError** error) {
+
+    struct rule * rule;
+    guint i;
+
+    for (i = 0; IN_rule_names[i] != NULL; ++i) {
+        if (lookup_rule((char *)IN_rule_names[i]) == NULL) {
+            g_set_error(error, DBUS_GERROR, DBUS_GERROR_FAILED, "No rule named %s", IN_rule_names[i]);
+            return FALSE;
+        }
+    }
+
+    //Tolerate the same name appearing more than once.
+    for (i = 0; IN_rule_names[i] != NULL; ++i) {
+        rule = lookup_rule((char *)IN_rule_names[i]);
+        if (rule != NULL)
+            delete_rule(rule);
+    }
+
+    replace_db_rules(IN_rule_names);
+    xcpmd_log(LOG_INFO, "Deleted %u rules.\n", i);
+
+    return TRUE;
+}
+
+
 //Loads variables and rules from the named file. See parse_config_from_file()
 //in parser.c for file syntax.
 gboolean xcpmd_load_policy_from_file(XcpmdObject *this, const char* IN_filename, GError** error) {
@@ -144,7 +205,7 @@ gboolean xcpmd_clear_vars(XcpmdObject *this, GError** error) {
 //Adds a variable to the DB and internal cache. Type is inferred from string
 //format--strings must be in double quotes, booleans are non-quoted t and f,
 //numbers with a decimal point are floats, and numbers without are ints.
-//TODO: reevaluate rules depending on any modified variables
+//Rules with conditions depending on a modified variable are re-evaluated.
 gboolean xcpmd_add_var(XcpmdObject *this, const char* IN_name, const char* IN_value, GError** error) {
 
     char * var_string;
@@ -190,7 +251,10 @@ gboolean xcpmd_get_conditions(XcpmdObject *this, char** *OUT_conditions, GError*
     int num_strings = 0;
     int i;
 
+    //Modules are loaded on demand; make sure every type is registered.
+    load_all_modules();
     num_strings = get_registered_condition_types(&str_array);
+    unload_unused_modules();
     xcpmd_log(LOG_INFO, "Number of conditions registered: %d\n", num_strings);
 
     //Null-terminate the string array.
@@ -220,7 +284,10 @@ gboolean xcpmd_get_actions(XcpmdObject *this, char** *OUT_actions, GError** erro
     int num_strings = 0;
     int i;
 
+    //Modules are loaded on demand; make sure every type is registered.
+    load_all_modules();
     num_strings = get_registered_action_types(&str_array);
+    unload_unused_modules();
     xcpmd_log(LOG_INFO, "Number of actions registered: %d\n", num_strings);
 
     //Null-terminate the string array.